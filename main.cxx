@@ -32,21 +32,40 @@
 #include <ptlib/video.h>
 #include <h323neg.h>
 
+#include <cmath>
+#include <csignal>
+
 #ifndef _WIN32
 #include <signal.h>
 #endif
 
 PCREATE_PROCESS(CallGen);
 
+#ifndef _WIN32
+static void WriteFuzzCaptures(int)
+{
+  RTPFuzzingChannel::RequestCaptures();
+}
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 
 CallGen::CallGen()
   : PProcess("H323Plus", "CallGen", MAJOR_VERSION, MINOR_VERSION, BUILD_TYPE, BUILD_NUMBER),
     console(PConsoleChannel::StandardInput)
 {
-  totalAttempts = 0;
-  totalEstablished = 0;
   h323 = NULL;
+  scheduler = NULL;
+  totalSlots = 0;
+  quiet = false;
+  cdrWriter = NULL;
+  pacer = NULL;
+  recorder = NULL;
+  cdrFormat = CDRRecord::CSV;
+  workerIndex = 0;
+  workerCount = 0;
+  cdrToParent = false;
+  steadyStateTime = PTime(0);
 }
 
 void CallGen::Main()
@@ -56,92 +75,158 @@ void CallGen::Main()
 #endif
 
   PArgList & args = GetArguments();
-  args.Parse("a-access-token-oid:"
-             "b-bandwidth:"
-             "c-cdr:"
-             "C-cycle."
-             "D-disable:"
-             "f-fast-disable."
-             "g-gatekeeper:"
+  const char * options = "a-access-token-oid:"
+                         "b-bandwidth:"
+                         "c-cdr:"
+                         "C-cycle."
+                         "-cps:"
+                         "-arrivals:"
+                         "-profile:"
+                         "D-disable:"
+                         "f-fast-disable."
+                         "g-gatekeeper:"
 #ifdef H323_H235
-             "-mediaenc:"
-             "-maxtoken:"
+                         "-mediaenc:"
+                         "-maxtoken:"
 #endif
 #ifdef H323_H46017
-             "k-h46017:"
+                         "k-h46017:"
 #endif
 #ifdef H323_H46018
-             "-h46018enable."
+                         "-h46018enable."
 #endif
 #ifdef H323_H46019M
-             "-h46019multiplexenable."
+                         "-h46019multiplexenable."
 #endif
 #ifdef H323_H46023
-             "-h46023enable."
+                         "-h46023enable."
 #endif
 #ifdef H323_H239
-             "-h239enable."
-             "-h239videopattern:"
-             "-h239delay:"
-             "-h239duration:"
+                         "-h239enable."
+                         "-h239videopattern:"
+                         "-h239delay:"
+                         "-h239duration:"
 #endif
-             "I-in-dir:"
-             "i-interface:"
-             "l-listen."
-             "m-max:"
-             " -mcu."
-             "n-no-gatekeeper."
-             "O-out-msg:"
-             "o-output:"
-             "P-prefer:"
-             "p-password:"
-             "r-repeat:"
-             "-require-gatekeeper."
-             "T-h245tunneldisable."
-             "t-trace."
+                         "-compare-audio:"
+                         "I-in-dir:"
+                         "-in-container:"
+                         "-record-threads:"
+                         "-extract-audio:"
+                         "i-interface:"
+                         "l-listen."
+                         "m-max:"
+                         " -mcu."
+                         "n-no-gatekeeper."
+                         "O-out-msg:"
+                         "o-output:"
+                         "P-prefer:"
+                         "q-quiet."
+                         "p-password:"
+                         "r-repeat:"
+                         "-require-gatekeeper."
+                         "-scheduler:"
+                         "-startup:"
+                         "T-h245tunneldisable."
+                         "t-trace."
 #ifdef H323_VIDEO
-			 "v-video."
-			 "-videopattern:"
-			 "R-framerate:"
-			 "-maxframe:"
+                         "v-video."
+                         "-videopattern:"
+                         "R-framerate:"
+                         "-maxframe:"
+                         "-video-replay:"
+                         "-video-decode:"
 #endif
 #ifdef H323_TLS
-             "-tls."
-             "-tls-cafile:"
-             "-tls-cert:"
-             "-tls-privkey:"
-             "-tls-passphrase:"
-             "-tls-listenport:"
+                         "-tls."
+                         "-tls-cafile:"
+                         "-tls-cert:"
+                         "-tls-privkey:"
+                         "-tls-passphrase:"
+                         "-tls-listenport:"
 #endif
-             "-tmaxest:"
-             "-tmincall:"
-             "-tmaxcall:"
-             "-tminwait:"
-             "-tmaxwait:"
-             "-tcp-base:"
-             "-tcp-max:"
-             "-udp-base:"
-             "-udp-max:"
-             "-rtp-base:"
-             "-rtp-max:"
-             "u-user:"
-             "-fuzzing."
-             "-fuzz-header:"
-             "-fuzz-media:"
-             "-fuzz-rtcp:"
-             , FALSE);
+                         "-tmaxest:"
+                         "-tmincall:"
+                         "-tmaxcall:"
+                         "-tminwait:"
+                         "-tmaxwait:"
+                         "-call-dist:"
+                         "-wait-dist:"
+                         "-tcp-base:"
+                         "-tcp-max:"
+                         "-udp-base:"
+                         "-udp-max:"
+                         "-rtp-base:"
+                         "-rtp-max:"
+                         "u-user:"
+                         "-fuzzing."
+                         "-replay."
+                         "-signaling-only."
+                         "-fuzz-header:"
+                         "-fuzz-media:"
+                         "-fuzz-rtcp:"
+                         "-fuzz-seed:"
+                         "-fuzz-mutators:"
+                         "-fuzz-capture:"
+                         "-fuzz-capture-size:"
+                         "-fuzz-replay:"
+                         "-workers:"
+                         "-stats-interval:"
+                         "-cdr-format:"
+                         "-cdr-rotate-size:"
+                         "-cdr-rotate-time:"
+                         "-analyze:"
+                         "-worker:";
+  args.Parse(options, FALSE);
+
+  if (args.HasOption("analyze")) {
+    // offline statistics over CDR files, no calls are made
+    CDRAnalyzer analyzer;
+    PStringArray files = args.GetOptionString("analyze").Lines();
+    for (PINDEX i = 0; i < args.GetCount(); i++)
+      files.AppendString(args[i]);
+    for (PINDEX i = 0; i < files.GetSize(); i++) {
+      PString error;
+      if (!analyzer.Analyze(files[i], error)) {
+        cerr << "Could not analyze \"" << files[i] << "\": " << error << endl;
+        return;
+      }
+    }
+    analyzer.PrintOn(cout);
+    return;
+  }
+
+  if (args.HasOption("extract-audio")) {
+    // WAV files from a --in-container file, no calls are made
+    PString error;
+    PDirectory directory(args.GetOptionString('I', "."));
+    if (!AudioRecorder::Extract(args.GetOptionString("extract-audio"), directory, error))
+      cerr << "Could not extract \"" << args.GetOptionString("extract-audio") << "\": " << error << endl;
+    return;
+  }
 
   if (args.GetCount() == 0 && !args.HasOption('l')) {
     cout << "Usage:\n"
             "  callgen [options] -l\n"
             "  callgen [options] destination [ destination ... ]\n"
+            "  callgen --analyze cdrfile [ cdrfile ... ]\n"
+            "  callgen --extract-audio file [ -I dir ]\n"
             "where options:\n"
             "  -l                   Passive/listening mode\n"
             "  -m --max num         Maximum number of simultaneous calls\n"
             "     --mcu             Pose as MCU (to always win master/slave neg.)\n"
             "  -r --repeat num      Repeat calls n times\n"
             "  -C --cycle           Each simultaneous call cycles through destination list\n"
+            "     --scheduler n     Drive all simultaneous calls from n scheduler threads\n"
+            "                       instead of one thread per call\n"
+            "     --startup policy  How simultaneous calls start: stagger, burst,\n"
+            "                       ramp:secs or cps:rate [stagger]\n"
+            "     --workers n       Run n worker processes sharing calls, ports and rates\n"
+            "     --cps rate        Open-loop mode: start new calls at rate per second,\n"
+            "                       independent of how many calls are active [off]\n"
+            "     --arrivals type   Arrival process for --cps: constant or poisson [poisson]\n"
+            "     --profile file    Open-loop mode following the call rate phases in file\n"
             "  -t --trace           Trace enable (use multiple times for more detail)\n"
+            "  -q --quiet           No output per call, print a summary every --stats-interval\n"
             "  -o --output file     Specify filename for trace output [stdout]\n"
             "  -i --interface addr  Specify IP address and port listen on [*:1720]\n"
             "  -g --gatekeeper host Specify gatekeeper host [auto-discover]\n"
@@ -178,6 +263,8 @@ void CallGen::Main()
             "  -v --video           Enable Video Support\n"
             "     --videopattern    Set video pattern to send, eg. 'Fake', 'Fake/BouncingBoxes' or 'Fake/MovingBlocks'\n"
             "  -R --framerate n     Set frame rate for outgoing video (fps)\n"
+            "  --video-replay dir   Send pre-encoded H.264/H.263 video from dir\n"
+            "  --video-decode n     Decode incoming video of one in n calls, only count the RTP packets of the others (0 = none) [1]\n"
             "  --maxframe name      Maximum Frame Size (qcif, cif, 4cif, 16cif, 480i, 720p, 1080i)\n"
 #endif
 #ifdef H323_TLS
@@ -192,7 +279,14 @@ void CallGen::Main()
             "  -T --h245tunneldisable  Disable H245 tunneling\n"
             "  -O --out-msg file    Specify PCM16 WAV file for outgoing message [ogm.wav]\n"
             "  -I --in-dir dir      Specify directory for incoming WAV files [disabled]\n"
+            "  --in-container file  Record all incoming audio into file instead [disabled]\n"
+            "  --record-threads n   Threads writing the incoming audio [2]\n"
+            "  --compare-audio secs Compare the first secs of incoming audio with the outgoing message\n"
             "  -c --cdr file        Specify Call Detail Record file [none]\n"
+            "  --cdr-format type    CDR file format: csv, json or binary [csv]\n"
+            "  --cdr-rotate-size kb Start a new CDR file when it reaches kb kilobytes [0 - off]\n"
+            "  --cdr-rotate-time secs Start a new CDR file every secs [0 - off]\n"
+            "  --stats-interval secs Print a summary line every secs [0 - off, 10 with -q]\n"
             "  --tcp-base port      Specific the base TCP port to use\n"
             "  --tcp-max port       Specific the maximum TCP port to use\n"
             "  --udp-base port      Specific the base UDP port to use\n"
@@ -204,37 +298,91 @@ void CallGen::Main()
             "  --tmaxcall secs      Maximum call duration in seconds [30]\n"
             "  --tminwait secs      Minimum interval between calls in seconds [10]\n"
             "  --tmaxwait secs      Maximum interval between calls in seconds [30]\n"
+            "  --call-dist type     Call duration distribution [uniform]\n"
+            "  --wait-dist type     Interval between calls distribution [uniform]\n"
+            "  --replay             Send the outgoing message encoded once per codec\n"
+            "                       instead of encoding it for every call\n"
+            "  --signaling-only     Open logical channels without any RTP or codecs\n"
             "  --fuzzing            Enable RTP fuzzing\n"
             "  --fuzz-header        Percentage of RTP header to randomly overwrite [50]\n"
             "  --fuzz-media         Percentage of RTP media to randomly overwrite [0]\n"
             "  --fuzz-rtcp          Percentage of RTCP to randomly overwrite [5]\n"
+            "  --fuzz-seed n        Derive the mutations of every call and session from n\n"
+            "  --fuzz-mutators list Weights of the RTP and RTCP mutations, eg. bytes=2,extension=1 [bytes,rtcp-bytes]\n"
+            "  --fuzz-capture dir   Write the last packets sent to dir as pcap when the peer fails or on SIGUSR1\n"
+            "  --fuzz-capture-size n Number of packets kept per channel [100]\n"
+            "  --fuzz-replay file   Resend the RTP and RTCP packets of a pcap file instead of fuzzing\n"
             "\n"
             "Notes:\n"
             "  If --tmaxest is set a non-zero value then --tmincall is the time to leave\n"
             "  the call running once established. If zero (the default) then --tmincall\n"
             "  is the length of the call from initiation. The call may or may not be\n"
             "  \"answered\" within that time.\n"
+            "\n"
+            "  With --cps, -m is ignored, every call is made once and -r sets the\n"
+            "  total number of calls to make (default: run until ENTER is pressed).\n"
+            "\n"
+            "  A --profile file has one phase per line, durations in s, m or h:\n"
+            "    ramp [from] to duration   change the rate linearly\n"
+            "    hold [rate] duration      keep a constant rate (also: step, soak, spike)\n"
+            "  A phase without a start rate continues at the rate the last one ended.\n"
+            "\n"
+            "  Distributions for --call-dist and --wait-dist, all times in seconds\n"
+            "  with millisecond resolution:\n"
+            "    uniform                  between --tmin* and --tmax*\n"
+            "    fixed[:secs]             always secs [--tmin*]\n"
+            "    exponential[:mean]       exponential with given mean [(tmin+tmax)/2]\n"
+            "    lognormal[:mean[,sigma]] lognormal with given mean and shape [1.0]\n"
+            "    empirical:file           histogram file with lines \"upper-bound weight\"\n"
             "\n";
     return;
   }
 
+  if (args.HasOption("workers")) {
+    RunWorkers(args, options);
+    return;
+  }
+
+  if (args.HasOption("worker")) {
+    // started by RunWorkers() as worker "index/count"
+    PString worker = args.GetOptionString("worker");
+    workerIndex = worker.Left(worker.Find('/')).AsUnsigned();
+    workerCount = worker.Mid(worker.Find('/')+1).AsUnsigned();
+    if (workerIndex == 0 || workerCount < workerIndex) {
+      cerr << "Invalid worker " << worker << endl;
+      return;
+    }
+  }
+
 #if PTRACING
+  PString traceFile = args.GetOptionString('o');
+  if (!traceFile.IsEmpty() && workerCount > 0)
+    traceFile += psprintf(".%u", workerIndex);
   PTrace::Initialise(args.GetOptionCount('t'),
-                     args.HasOption('o') ? (const char *)args.GetOptionString('o') : NULL,
+                     traceFile.IsEmpty() ? NULL : (const char *)traceFile,
 		             PTrace::DateAndTime | PTrace::TraceLevel | PTrace::FileAndLine);
 #endif
 
+  quiet = args.HasOption('q');
+
+  // without media nothing needs pacing
+  if (!args.HasOption("signaling-only"))
+    pacer = new MediaPacer;
+
   h323 = new MyH323EndPoint();
 
   outgoingMessageFile = args.GetOptionString('O', "ogm.wav");
   if (outgoingMessageFile.IsEmpty())
     cout << "Not using outgoing message file." << endl;
-  else if (PFile::Exists(outgoingMessageFile))
-    cout << "Using outgoing message file: " << outgoingMessageFile << endl;
   else {
-    cout << "Outgoing message file  \"" << outgoingMessageFile << "\" does not exist!" << endl;
-    PTRACE(1, "CallGen\tOutgoing message file \"" << outgoingMessageFile << "\" does not exist");
-    outgoingMessageFile = PString::Empty();
+    PString error;
+    if (outgoingMessage.Load(outgoingMessageFile, error))
+      cout << "Using outgoing message file: " << outgoingMessageFile << endl;
+    else {
+      cout << "Outgoing message file  \"" << outgoingMessageFile << "\" " << error << '!' << endl;
+      PTRACE(1, "CallGen\tOutgoing message file \"" << outgoingMessageFile << "\" " << error);
+      outgoingMessageFile = PString::Empty();
+    }
   }
 
   incomingAudioDirectory = args.GetOptionString('I');
@@ -251,6 +399,30 @@ void CallGen::Main()
     incomingAudioDirectory = PString::Empty();
   }
 
+  PFilePath incomingAudioContainer = args.GetOptionString("in-container");
+  if (!incomingAudioContainer.IsEmpty() && workerIndex > 0)
+    incomingAudioContainer += psprintf(".%u", workerIndex);
+  if (!incomingAudioDirectory || !incomingAudioContainer.IsEmpty()) {
+    unsigned threads = args.GetOptionString("record-threads", "2").AsUnsigned();
+    recorder = new AudioRecorder(incomingAudioDirectory, incomingAudioContainer, PMAX(threads, 1U));
+    if (!recorder->IsOpen()) {
+      cout << "Could not create incoming audio container \"" << incomingAudioContainer << "\"!" << endl;
+      delete recorder;
+      recorder = NULL;
+    }
+    else if (!incomingAudioContainer.IsEmpty())
+      cout << "Recording incoming audio into: " << incomingAudioContainer << endl;
+  }
+
+  if (args.HasOption("compare-audio")) {
+    if (outgoingMessage.IsEmpty())
+      cout << "Cannot compare incoming audio without an outgoing message file!" << endl;
+    else if (audioReference.Prepare(outgoingMessage, args.GetOptionString("compare-audio").AsUnsigned()))
+      cout << "Comparing incoming audio with the outgoing message" << endl;
+    else
+      cout << "Outgoing message or --compare-audio time too short to compare incoming audio!" << endl;
+  }
+
   // start the H.323 listener
   H323ListenerTCP * listener = NULL;
   PIPSocket::Address interfaceAddress(INADDR_ANY);
@@ -265,6 +437,8 @@ void CallGen::Main()
       interfaceAddress = interface;
     }
   }
+  if (workerCount > 0)
+    listenPort += workerIndex - 1;
 
   listener = new H323ListenerTCP(*h323, interfaceAddress, listenPort);
 
@@ -276,26 +450,31 @@ void CallGen::Main()
 
   cout << "H.323 listening on: " << setfill(',') << h323->GetListeners() << setfill(' ') << endl;
 
-  if (args.HasOption('c')) {
-    if (cdrFile.Open(args.GetOptionString('c'), PFile::WriteOnly, PFile::Create)) {
-      cdrFile.SetPosition(0, PFile::End);
-      PTRACE(1, "CallGen\tSetting CDR to \"" << cdrFile.GetFilePath() << '"');
-      cout << "Sending Call Detail Records to \"" << cdrFile.GetFilePath() << '"' << endl;
-    }
-    else {
-      cout << "Could not open \"" << cdrFile.GetFilePath() << "\"!" << endl;
-    }
+  if (args.HasOption('c') && workerCount > 0) {
+    cdrToParent = true;
+  }
+  else if (args.HasOption('c')) {
+    OpenCDR(args);
   }
 
-  if (args.HasOption("tcp-base"))
-    h323->SetTCPPorts(args.GetOptionString("tcp-base").AsUnsigned(),
-                     args.GetOptionString("tcp-max").AsUnsigned());
-  if (args.HasOption("udp-base"))
-    h323->SetUDPPorts(args.GetOptionString("udp-base").AsUnsigned(),
-                     args.GetOptionString("udp-max").AsUnsigned());
-  if (args.HasOption("rtp-base"))
-    h323->SetRtpIpPorts(args.GetOptionString("rtp-base").AsUnsigned(),
-                       args.GetOptionString("rtp-max").AsUnsigned());
+  if (args.HasOption("tcp-base")) {
+    unsigned base = args.GetOptionString("tcp-base").AsUnsigned();
+    unsigned max = args.GetOptionString("tcp-max").AsUnsigned();
+    SplitPortRange(base, max, 1);
+    h323->SetTCPPorts(base, max);
+  }
+  if (args.HasOption("udp-base")) {
+    unsigned base = args.GetOptionString("udp-base").AsUnsigned();
+    unsigned max = args.GetOptionString("udp-max").AsUnsigned();
+    SplitPortRange(base, max, 1);
+    h323->SetUDPPorts(base, max);
+  }
+  if (args.HasOption("rtp-base")) {
+    unsigned base = args.GetOptionString("rtp-base").AsUnsigned();
+    unsigned max = args.GetOptionString("rtp-max").AsUnsigned();
+    SplitPortRange(base, max, 2);
+    h323->SetRtpIpPorts(base, max);
+  }
 
 #ifdef H323_H239
   if (args.HasOption("h239enable")) {
@@ -491,6 +670,35 @@ void CallGen::Main()
   }
 #endif
 
+  if (args.HasOption("replay"))
+    h323->SetReplay(true);
+
+#ifdef H323_VIDEO
+  if (args.HasOption("video-replay")) {
+    PDirectory dir = args.GetOptionString("video-replay");
+    if (PDirectory::Exists(dir)) {
+      cout << "Sending pre-encoded video from: " << dir << endl;
+      h323->SetVideoReplay(dir);
+    }
+    else
+      cout << "Video replay directory \"" << dir << "\" does not exist!" << endl;
+  }
+
+  if (args.HasOption("video-decode")) {
+    unsigned oneIn = args.GetOptionString("video-decode").AsUnsigned();
+    if (oneIn == 0)
+      cout << "Incoming video is not decoded." << endl;
+    else if (oneIn > 1)
+      cout << "Incoming video of one in " << oneIn << " calls is decoded." << endl;
+    h323->SetVideoDecode(oneIn);
+  }
+#endif
+
+  if (args.HasOption("signaling-only")) {
+    cout << "Signaling only, no media is sent or received." << endl;
+    h323->SetSignalingOnly(true);
+  }
+
   if (args.HasOption("fuzzing")) {
       h323->SetFuzzing(true);
   }
@@ -503,6 +711,40 @@ void CallGen::Main()
   if (args.HasOption("fuzz-rtcp")) {
       h323->SetPercentBadRTCP(args.GetOptionString("fuzz-rtcp").AsUnsigned());
   }
+  if (args.HasOption("fuzz-mutators")) {
+      FuzzWeights weights;
+      PString error;
+      if (!weights.Parse(args.GetOptionString("fuzz-mutators"), error)) {
+        cerr << "Invalid fuzzing mutators: " << error << endl;
+        return;
+      }
+      h323->SetFuzzWeights(weights);
+  }
+  if (args.HasOption("fuzz-seed")) {
+      PUInt64 seed = args.GetOptionString("fuzz-seed").AsUnsigned64();
+      cout << "Fuzzing with seed " << seed << endl;
+      h323->SetFuzzSeed(seed);
+  }
+  if (args.HasOption("fuzz-capture")) {
+      PDirectory dir = args.GetOptionString("fuzz-capture");
+      if (PDirectory::Exists(dir)) {
+        h323->SetFuzzCapture(dir, args.GetOptionString("fuzz-capture-size", "100").AsUnsigned());
+#ifndef _WIN32
+        signal(SIGUSR1, WriteFuzzCaptures);
+#endif
+      }
+      else
+        cout << "Fuzzing capture directory \"" << dir << "\" does not exist!" << endl;
+  }
+  if (args.HasOption("fuzz-replay")) {
+      PString error;
+      if (h323->SetFuzzReplay(args.GetOptionString("fuzz-replay"), error))
+        cout << "Replaying " << h323->GetFuzzReplay()->GetSize() << " captured packets instead of fuzzing." << endl;
+      else {
+        cerr << "Fuzzing replay file \"" << args.GetOptionString("fuzz-replay") << "\" " << error << endl;
+        return;
+      }
+  }
 
   if (args.HasOption('l')) {
     cout << "Endpoint is listening for incoming calls, press ENTER to exit.\n";
@@ -511,11 +753,11 @@ void CallGen::Main()
   }
   else {
     CallParams params(*this);
-    params.tmax_est .SetInterval(0, args.GetOptionString("tmaxest",  "0" ).AsUnsigned());
-    params.tmin_call.SetInterval(0, args.GetOptionString("tmincall", "10").AsUnsigned());
-    params.tmax_call.SetInterval(0, args.GetOptionString("tmaxcall", "60").AsUnsigned());
-    params.tmin_wait.SetInterval(0, args.GetOptionString("tminwait", "10").AsUnsigned());
-    params.tmax_wait.SetInterval(0, args.GetOptionString("tmaxwait", "30").AsUnsigned());
+    params.tmax_est .SetInterval((PInt64)(args.GetOptionString("tmaxest",  "0" ).AsReal()*1000));
+    params.tmin_call.SetInterval((PInt64)(args.GetOptionString("tmincall", "10").AsReal()*1000));
+    params.tmax_call.SetInterval((PInt64)(args.GetOptionString("tmaxcall", "60").AsReal()*1000));
+    params.tmin_wait.SetInterval((PInt64)(args.GetOptionString("tminwait", "10").AsReal()*1000));
+    params.tmax_wait.SetInterval((PInt64)(args.GetOptionString("tmaxwait", "30").AsReal()*1000));
 
     if (params.tmin_call == 0 ||
         params.tmin_wait == 0 ||
@@ -525,44 +767,150 @@ void CallGen::Main()
       return;
     }
 
-    unsigned number = args.GetOptionString('m').AsUnsigned();
-    if (number == 0)
-      number = 1;
-    cout << "Endpoint starting " << number << " simultaneous call";
-    if (number > 1)
-      cout << 's';
-    cout << ' ';
-
-    params.repeat = args.GetOptionString('r', "10").AsUnsigned();
-    if (params.repeat != 0)
-      cout << params.repeat;
-    else
-      cout << "infinite";
-    cout << " time";
-    if (params.repeat != 1)
-      cout << 's';
-    if (params.repeat != 0)
-      cout << ", grand total of " << number*params.repeat << " calls";
-    cout << '.' << endl;
-
-    // create some threads to do calls, but start them randomly
-    for (unsigned idx = 0; idx < number; idx++) {
-      if (args.HasOption('C'))
-        threadList.Append(new CallThread(idx+1, args.GetParameters(), params));
+    PString error;
+    if (!params.callTime.Parse(args.GetOptionString("call-dist", "uniform"), params.tmin_call, params.tmax_call, error)) {
+      cerr << "Invalid call duration distribution: " << error << endl;
+      return;
+    }
+    if (!params.waitTime.Parse(args.GetOptionString("wait-dist", "uniform"), params.tmin_wait, params.tmax_wait, error)) {
+      cerr << "Invalid wait time distribution: " << error << endl;
+      return;
+    }
+    cout << "Call durations: " << params.callTime << ", intervals between calls: " << params.waitTime << endl;
+
+    if (args.HasOption("cps") || args.HasOption("profile")) {
+      LoadProfile profile;
+      if (args.HasOption("profile")) {
+        PString error;
+        if (!profile.Load(args.GetOptionString("profile"), error)) {
+          cerr << "Invalid load profile: " << error << endl;
+          return;
+        }
+      }
       else {
-        PINDEX arg = idx % args.GetCount();
-        threadList.Append(new CallThread(idx+1, args.GetParameters(arg, arg), params));
+        double cps = args.GetOptionString("cps").AsReal();
+        if (cps <= 0) {
+          cerr << "Invalid calls per second entered!\n";
+          return;
+        }
+        profile.SetConstant(cps);
+      }
+      if (workerCount > 0)
+        profile.Scale(1.0 / workerCount);
+
+      PCaselessString arrivals = args.GetOptionString("arrivals", "poisson");
+      if (arrivals != "poisson" && arrivals != "constant") {
+        cerr << "Unknown arrivals value: " << arrivals << endl;
+        return;
+      }
+
+      unsigned total = GetWorkerShare(args.GetOptionString('r', "0").AsUnsigned());
+      params.repeat = 1;
+
+      if (args.HasOption("profile"))
+        cout << "Endpoint starting calls following load profile " << args.GetOptionString("profile")
+             << " of " << profile.GetDuration().GetSeconds() << " seconds (" << arrivals << " arrivals), ";
+      else
+        cout << "Endpoint starting calls at " << args.GetOptionString("cps") << " per second (" << arrivals << " arrivals), ";
+      if (total != 0)
+        cout << total << " calls in total." << endl;
+      else if (args.HasOption("profile"))
+        cout << "until the profile ends." << endl;
+      else
+        cout << "until ENTER is pressed." << endl;
+
+      unsigned workers = args.GetOptionString("scheduler", "4").AsUnsigned();
+      if (workers == 0)
+        workers = 1;
+      cout << "Using " << workers << " scheduler thread" << (workers > 1 ? "s" : "") << " for all calls." << endl;
+      scheduler = new CallScheduler(params, workers);
+      scheduler->SetArrivals(profile, arrivals == "poisson", total, args.GetParameters());
+      scheduler->Start();
+    }
+    else {
+      unsigned number = args.GetOptionString('m').AsUnsigned();
+      if (number == 0)
+        number = 1;
+      if (workerCount > 0) {
+        number = GetWorkerShare(number);
+        if (number == 0) {
+          cout << "No calls left for worker " << workerIndex << endl;
+          delete h323;
+          return;
+        }
+      }
+      cout << "Endpoint starting " << number << " simultaneous call";
+      if (number > 1)
+        cout << 's';
+      cout << ' ';
+
+      params.repeat = args.GetOptionString('r', "10").AsUnsigned();
+      if (params.repeat != 0)
+        cout << params.repeat;
+      else
+        cout << "infinite";
+      cout << " time";
+      if (params.repeat != 1)
+        cout << 's';
+      if (params.repeat != 0)
+        cout << ", grand total of " << number*params.repeat << " calls";
+      cout << '.' << endl;
+
+      if (!params.startup.Parse(args.GetOptionString("startup", "stagger"), number, error)) {
+        cerr << "Invalid startup policy: " << error << endl;
+        return;
+      }
+      cout << "Startup: " << params.startup << ", steady state expected after "
+           << params.startup.GetRampTime().GetSeconds() << " seconds." << endl;
+      totalSlots = number;
+      startTime = PTime();
+
+      if (args.HasOption("scheduler")) {
+        unsigned workers = args.GetOptionString("scheduler").AsUnsigned();
+        if (workers == 0)
+          workers = 1;
+        cout << "Using " << workers << " scheduler thread" << (workers > 1 ? "s" : "") << " for all calls." << endl;
+        scheduler = new CallScheduler(params, workers);
+      }
+
+      // create some threads or scheduler slots to do calls, but start them randomly
+      for (unsigned idx = 0; idx < number; idx++) {
+        PStringArray destinations;
+        if (args.HasOption('C'))
+          destinations = args.GetParameters();
+        else {
+          PINDEX arg = idx % args.GetCount();
+          destinations = args.GetParameters(arg, arg);
+        }
+        if (scheduler != NULL)
+          scheduler->AddSlot(idx+1, destinations);
+        else
+          threadList.Append(new CallThread(idx+1, destinations, params));
       }
+
+      if (scheduler != NULL)
+        scheduler->Start();
     }
 
     PThread::Create(PCREATE_NOTIFIER(Cancel), 0);
 
+    unsigned statsInterval = args.GetOptionString("stats-interval", quiet ? "10" : "0").AsUnsigned();
+    if (statsInterval > 0) {
+      statsTimer.SetNotifier(PCREATE_NOTIFIER(ReportStats));
+      statsTimer.RunContinuous(PTimeInterval(0, statsInterval));
+    }
+
+    if (workerCount > 0) {
+      workerStatsTimer.SetNotifier(PCREATE_NOTIFIER(SendWorkerStats));
+      workerStatsTimer.RunContinuous(1000);
+    }
+
     for (;;) {
       threadEnded.Wait();
       PThread::Sleep(100);
 
-      PBoolean finished = TRUE;
-      for (PINDEX i = 0; i < threadList.GetSize(); i++) {
+      PBoolean finished = scheduler == NULL || scheduler->IsFinished();
+      for (PINDEX i = 0; finished && i < threadList.GetSize(); i++) {
         if (!threadList[i].IsTerminated()) {
           finished = FALSE;
           break;
@@ -577,11 +925,378 @@ void CallGen::Main()
     }
   }
 
-  if (totalAttempts > 0)
-    cout << "Total calls: " << totalAttempts << " attempted, " << totalEstablished << " established\n";
+  statsTimer.Stop();
+  if (workerCount > 0) {
+    workerStatsTimer.Stop();
+    SendWorkerStats(workerStatsTimer, 0);
+  }
+
+  if (stats.Get(CallStats::Attempts) > 0)
+    cout << "Total calls: " << stats.Get(CallStats::Attempts) << " attempted, "
+         << stats.Get(CallStats::Established) << " established\n";
+
+  LatencyHistogram::Snapshot latencies[CallStats::NumLatencies];
+  stats.GetLatencies(latencies);
+  if (latencies[CallStats::AlertingLatency].GetCount() + latencies[CallStats::ConnectLatency].GetCount() > 0)
+    CallStats::PrintLatencies(cout, latencies);
+
+  CallStats::RTPTotals rtpTotals[RTPReceiveStats::NumMedia];
+  stats.GetRTPTotals(rtpTotals);
+  if (rtpTotals[RTPReceiveStats::Audio].sessions + rtpTotals[RTPReceiveStats::Video].sessions > 0)
+    CallStats::PrintRTPTotals(cout, rtpTotals);
+  rtpTotals[RTPReceiveStats::Audio].mos.PrintOn(cout);
+  stats.GetComparisonTotals().PrintOn(cout);
+
+  delete scheduler;
+  scheduler = NULL;
 
   // delete endpoint object so we unregister cleanly
   delete h323;
+
+  if (pacer != NULL) {
+    pacer->Stop();
+    MediaPacer::Stats pacing = pacer->GetStats();
+    if (pacing.overruns > 0)
+      cout << "Media pacing: " << pacing.overruns << " of " << pacing.ticks << " ticks overran, max "
+           << pacing.maxLate << "ms late, max " << pacing.maxBusy << "ms busy" << endl;
+    delete pacer;
+    pacer = NULL;
+  }
+
+  // all calls are gone, write what the recordings still have buffered
+  delete recorder;
+  recorder = NULL;
+
+  CloseCDR();
+}
+
+// Share of a total for this worker, the first workers get the remainder
+unsigned CallGen::GetWorkerShare(unsigned total) const
+{
+  if (workerCount == 0)
+    return total;
+  return total / workerCount + (workerIndex <= total % workerCount ? 1 : 0);
+}
+
+// Give each worker its own part of a port range, keeping pairs for RTP together
+void CallGen::SplitPortRange(unsigned & base, unsigned & max, unsigned align) const
+{
+  if (workerCount == 0)
+    return;
+
+  if (max <= base) {
+    cout << "Port range starting at " << base << " has no maximum, not split between workers" << endl;
+    return;
+  }
+
+  unsigned size = (max - base + 1) / workerCount / align * align;
+  base += (workerIndex - 1) * size;
+  max = base + size - 1;
+}
+
+void CallGen::SendWorkerStats(PTimer &, H323_INT)
+{
+  coutMutex.Wait();
+  cout << "@stats " << stats.Get(CallStats::Attempts) << ' ' << stats.Get(CallStats::Established) << ' '
+       << (h323 != NULL ? h323->GetActiveCalls() : 0) << endl;
+  coutMutex.Signal();
+}
+
+// One line summary of the calls in the last interval
+void CallGen::ReportStats(PTimer &, H323_INT)
+{
+  static CallStats::Snapshot previous;
+  static LatencyHistogram::Snapshot previousLatencies[CallStats::NumLatencies];
+  static PTimeInterval previousTick = PTimer::Tick() - statsTimer.GetResetTime();
+
+  CallStats::Snapshot current;
+  stats.GetSnapshot(current);
+  CallStats::Snapshot interval = current - previous;
+  previous = current;
+
+  LatencyHistogram::Snapshot latencies[CallStats::NumLatencies];
+  stats.GetLatencies(latencies);
+  for (int i = 0; i < CallStats::NumLatencies; i++) {
+    LatencyHistogram::Snapshot now = latencies[i];
+    latencies[i] = now - previousLatencies[i];
+    previousLatencies[i] = now;
+  }
+
+  PTimeInterval tick = PTimer::Tick();
+  double secs = (double)(tick - previousTick).GetMilliSeconds() / 1000;
+  previousTick = tick;
+  if (secs <= 0)
+    return;
+
+  unsigned attempts = interval.Get(CallStats::Attempts);
+  unsigned established = interval.Get(CallStats::Established);
+
+  PStringStream line;
+  line << PTime().AsString("hh:mm:ss")
+       << " active=" << (h323 != NULL ? h323->GetActiveCalls() : 0)
+       << setprecision(1) << setiosflags(ios::fixed)
+       << " attempted=" << attempts/secs << "/s"
+       << " established=" << established/secs << "/s"
+       << " ASR=";
+  if (attempts > 0)
+    line << 100.0*established/attempts << '%';
+  else
+    line << '-';
+
+  unsigned totalFailed = 0;
+  PStringStream reasons;
+  for (int r = 0; r < H323Connection::NumCallEndReasons; r++) {
+    unsigned failed = interval.GetFailed((H323Connection::CallEndReason)r);
+    if (failed > 0) {
+      reasons << (totalFailed == 0 ? " (" : ", ") << (H323Connection::CallEndReason)r << ':' << failed;
+      totalFailed += failed;
+    }
+  }
+  line << " failed=" << totalFailed;
+  if (totalFailed > 0)
+    line << reasons << ')';
+
+  line << " alert/connect/media p50="
+       << latencies[CallStats::AlertingLatency].GetPercentile(50) << '/'
+       << latencies[CallStats::ConnectLatency].GetPercentile(50) << '/'
+       << latencies[CallStats::FirstMediaLatency].GetPercentile(50)
+       << " p99="
+       << latencies[CallStats::AlertingLatency].GetPercentile(99) << '/'
+       << latencies[CallStats::ConnectLatency].GetPercentile(99) << '/'
+       << latencies[CallStats::FirstMediaLatency].GetPercentile(99) << "ms";
+
+  // media received by the calls cleared in this interval
+  static CallStats::RTPTotals previousRTP[RTPReceiveStats::NumMedia];
+  CallStats::RTPTotals rtpTotals[RTPReceiveStats::NumMedia];
+  stats.GetRTPTotals(rtpTotals);
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    CallStats::RTPTotals rtp = rtpTotals[media] - previousRTP[media];
+    previousRTP[media] = rtpTotals[media];
+    if (rtp.sessions > 0)
+      line << (media == RTPReceiveStats::Audio ? " audio" : " video")
+           << " rx=" << rtp.packets
+           << " lost=" << setprecision(2) << rtp.GetLossPercent() << '%'
+           << " ooo=" << rtp.outOfOrder
+           << " late=" << rtp.late
+           << " jitter avg=" << rtp.avgJitter/rtp.sessions
+           << " p99=" << rtp.maxJitter.GetPercentile(99) << "ms";
+    if (rtp.mos.GetCount() > 0)
+      line << setprecision(2)
+           << " MOS avg=" << rtp.mos.GetMean() << " p5=" << rtp.mos.GetPercentile(5);
+  }
+
+  static CallStats::ComparisonTotals previousComparison;
+  CallStats::ComparisonTotals comparisonTotals = stats.GetComparisonTotals();
+  CallStats::ComparisonTotals comparison = comparisonTotals - previousComparison;
+  previousComparison = comparisonTotals;
+  if (comparison.calls > 0) {
+    line << " compared=" << comparison.calls << " aligned=" << comparison.aligned;
+    if (comparison.aligned > 0)
+      line << " delay p50=" << comparison.delay.GetPercentile(50) << "ms"
+           << " SNR avg=" << setprecision(1) << comparison.snr/comparison.aligned << "dB"
+           << " clipped=" << comparison.clipped
+           << " dropouts=" << comparison.dropouts;
+  }
+
+  if (pacer != NULL) {
+    // the generator itself can't keep up when ticks overrun
+    MediaPacer::Stats pacing = pacer->GetIntervalStats();
+    line << " pacing late=" << pacing.maxLate << "ms overruns=" << pacing.overruns;
+  }
+
+  coutMutex.Wait();
+  cout << line << endl;
+  coutMutex.Signal();
+}
+
+void CallGen::WriteCDR(const CDRRecord & record)
+{
+  if (cdrToParent) {
+    // the parent writes it in the format it was asked for, a JSON line
+    // carries all of the record, the binary one truncates the strings
+    PString json = record.AsJSON();
+    coutMutex.Wait();
+    cout << "@cdr " << json << endl;
+    coutMutex.Signal();
+    return;
+  }
+
+  if (cdrWriter != NULL) {
+    PBYTEArray data;
+    record.Encode(cdrFormat, data);
+    cdrWriter->Write(data);
+  }
+}
+
+void CallGen::WriteCDR(const PString & line)
+{
+  CDRRecord record;
+  if (record.FromJSON(line))
+    WriteCDR(record);
+  else
+    PTRACE(1, "CallGen\tInvalid CDR from worker: " << line);
+}
+
+void CallGen::OpenCDR(PArgList & args)
+{
+  if (args.HasOption("cdr-format") && !CDRRecord::ParseFormat(args.GetOptionString("cdr-format"), cdrFormat)) {
+    cout << "Unknown CDR format \"" << args.GetOptionString("cdr-format") << "\", not writing CDRs" << endl;
+    return;
+  }
+
+  off_t maxSize = (off_t)args.GetOptionString("cdr-rotate-size").AsUnsigned() * 1024;
+  PTimeInterval maxAge(0, args.GetOptionString("cdr-rotate-time").AsUnsigned());
+
+  cdrWriter = new CDRWriter(args.GetOptionString('c'), CDRRecord::GetHeader(cdrFormat), maxSize, maxAge);
+  if (cdrWriter->IsOpen()) {
+    PTRACE(1, "CallGen\tSetting CDR to \"" << cdrWriter->GetFilePath() << '"');
+    cout << "Sending Call Detail Records to \"" << cdrWriter->GetFilePath() << '"' << endl;
+  }
+  else {
+    cout << "Could not open \"" << cdrWriter->GetFilePath() << "\"!" << endl;
+    delete cdrWriter;
+    cdrWriter = NULL;
+  }
+}
+
+// write out the remaining records
+void CallGen::CloseCDR()
+{
+  if (cdrWriter == NULL)
+    return;
+
+  CDRWriter * writer = cdrWriter;
+  cdrWriter = NULL;
+  writer->Close();
+  delete writer;
+}
+
+// Start copies of this program with a share of the calls each, wait for them
+// to finish and collect their statistics and call detail records
+void CallGen::RunWorkers(PArgList & args, const char * options)
+{
+#ifndef _WIN32
+  signal(SIGCHLD, SIG_DFL); // we need the exit status of our workers
+#endif
+
+  unsigned count = args.GetOptionString("workers").AsUnsigned();
+  if (count == 0)
+    count = 1;
+
+  if (args.HasOption('c'))
+    OpenCDR(args);
+
+  // rebuild the command line from all options except --workers
+  PStringArray arguments;
+  const char * spec = options;
+  while (*spec != '\0') {
+    char letter = *spec++;
+    PString name;
+    if (letter == '-')
+      letter = ' ';
+    else
+      spec++; // skip '-' after the letter
+    while (*spec != '\0' && *spec != ':' && *spec != '.')
+      name += *spec++;
+    bool hasValue = *spec++ == ':';
+
+    if (name == "workers")
+      continue;
+
+    if (hasValue) {
+      PStringArray values = args.GetOptionString(name).Lines();
+      for (PINDEX i = 0; i < values.GetSize(); i++) {
+        arguments.AppendString("--" + name);
+        arguments.AppendString(values[i]);
+      }
+    }
+    else {
+      for (PINDEX i = 0; i < args.GetOptionCount(name); i++)
+        arguments.AppendString("--" + name);
+    }
+  }
+
+  cout << "Starting " << count << " worker processes." << endl;
+  for (unsigned i = 1; i <= count; i++) {
+    PStringArray workerArguments = arguments;
+    workerArguments.AppendString("--worker");
+    workerArguments.AppendString(psprintf("%u/%u", i, count));
+    PStringArray parameters = args.GetParameters();
+    for (PINDEX p = 0; p < parameters.GetSize(); p++)
+      workerArguments.AppendString(parameters[p]);
+    workerList.Append(new WorkerProcess(i, GetFile(), workerArguments));
+  }
+
+  PThread::Create(PCREATE_NOTIFIER(CancelWorkers), 0);
+
+  PTimeInterval lastReport = PTimer::Tick();
+  unsigned attempts = 0, established = 0, active = 0;
+  for (;;) {
+    threadEnded.Wait(1000);
+
+    attempts = established = active = 0;
+    PBoolean finished = TRUE;
+    for (PINDEX i = 0; i < workerList.GetSize(); i++) {
+      attempts += workerList[i].GetAttempts();
+      established += workerList[i].GetEstablished();
+      active += workerList[i].GetActive();
+      if (!workerList[i].IsTerminated())
+        finished = FALSE;
+    }
+    if (finished) {
+      cout << "\nAll workers completed." << endl;
+      console.Close();
+      break;
+    }
+
+    if (PTimer::Tick() - lastReport >= 10000) {
+      lastReport = PTimer::Tick();
+      coutMutex.Wait();
+      cout << "All workers: active=" << active << " attempted=" << attempts << " established=" << established << endl;
+      coutMutex.Signal();
+    }
+  }
+
+  if (attempts > 0)
+    cout << "Total calls from " << count << " workers: " << attempts << " attempted, " << established << " established\n";
+
+  CloseCDR();
+}
+
+void CallGen::CancelWorkers(PThread &, INT)
+{
+  coutMutex.Wait();
+  cout << "Press ENTER at any time to quit.\n" << endl;
+  coutMutex.Signal();
+
+  // wait for a keypress
+  while (console.ReadChar() != '\n') {
+    if (!console.IsOpen())
+      return;
+  }
+
+  coutMutex.Wait();
+  cout << "\nAborting all workers ..." << endl;
+  coutMutex.Signal();
+
+  for (PINDEX i = 0; i < workerList.GetSize(); i++)
+    workerList[i].Stop();
+}
+
+void CallGen::OnSlotStarted()
+{
+  if (++startedSlots != (long)totalSlots)
+    return;
+
+  steadyStateTime = PTime();
+
+  coutMutex.Wait();
+  cout << "Steady state reached at " << steadyStateTime.AsString("hh:mm:ss.uuu")
+       << ", all " << totalSlots << " simultaneous calls started after "
+       << (steadyStateTime - startTime) << " seconds." << endl;
+  coutMutex.Signal();
+
+  PTRACE(1, "CallGen\tSteady state reached, " << totalSlots << " calls started");
 }
 
 void CallGen::Cancel(PThread &, INT)
@@ -609,6 +1324,8 @@ void CallGen::Cancel(PThread &, INT)
   // stop threads
   for (PINDEX i = 0; i < threadList.GetSize(); i++)
     threadList[i].Stop();
+  if (scheduler != NULL)
+    scheduler->Stop();
 
   // stop all calls
   CallGen::Current().ClearAll();
@@ -627,58 +1344,311 @@ CallThread::CallThread(unsigned _index, const PStringArray & _destinations, cons
   Resume();
 }
 
-static unsigned RandomRange(PRandom & rand, const PTimeInterval & tmin, const PTimeInterval & tmax)
+static unsigned RandomRange(FastRandom & rand, const PTimeInterval & tmin, const PTimeInterval & tmax)
 {
   unsigned umax = tmax.GetInterval();
   unsigned umin = tmin.GetInterval();
-  return rand.Generate() % (umax - umin + 1) + umin;
-}
-
-#define START_OUTPUT(index, token) \
-{ \
-  CallGen::Current().coutMutex.Wait(); \
-  cout << setw(3) << index << ": " << setw(20) << token.Left(20) << ": "
-
-#define END_OUTPUT() \
-  cout << endl; \
-  CallGen::Current().coutMutex.Signal(); \
+  return rand.Generate(umax - umin + 1) + umin;
 }
 
-#define OUTPUT(index, token, info) START_OUTPUT(index, token) << info; END_OUTPUT()
+///////////////////////////////////////////////////////////////////////////////
 
-void CallThread::Main()
+PBoolean StartupPolicy::Parse(const PString & spec, unsigned _slots, PString & error)
 {
-  PTRACE(2, "CallGen\tStarted thread " << index);
-
-  CallGen & callgen = CallGen::Current();
-  PRandom rand(PRandom::Number());
+  PCaselessString name = spec;
+  PString parameter;
+  PINDEX colon = spec.Find(':');
+  if (colon != P_MAX_INDEX) {
+    name = spec.Left(colon);
+    parameter = spec.Mid(colon+1);
+  }
 
-  PTimeInterval delay = RandomRange(rand, (index-1)*500, (index+1)*500);
-  OUTPUT(index, PString::Empty(), "Initial delay of " << delay << " seconds");
+  slots = _slots;
+  value = parameter.AsReal();
 
-  if (exit.Wait(delay)) {
-    PTRACE(2, "CallGen\tAborted thread " << index);
-    callgen.threadEnded.Signal();
-    return;
+  if (name == "stagger")
+    type = Stagger;
+  else if (name == "burst")
+    type = Burst;
+  else if (name == "ramp" && value > 0) {
+    type = Ramp;
+    value *= 1000;
+  }
+  else if (name == "cps" && value > 0)
+    type = RampCPS;
+  else {
+    error = "unknown or incomplete policy " + spec;
+    return FALSE;
   }
 
-  // Loop "repeat" times for (repeat > 0), or loop forever for (repeat == 0)
-  unsigned count = 1;
-  do {
-    PString destination = destinations[(index-1 + count-1) % destinations.GetSize()];
+  return TRUE;
+}
 
-    // trigger a call
-    PString token;
-    PTRACE(1, "CallGen\tMaking call to " << destination);
-    unsigned totalAttempts = ++callgen.totalAttempts;
-    if (!callgen.Start(destination, token))
-      PError << setw(3) << index << ": Call creation to " << destination << " failed" << endl;
-    else {
-      PBoolean stopping = FALSE;
+PTimeInterval StartupPolicy::GetInitialDelay(unsigned index, FastRandom & rand) const
+{
+  switch (type) {
+    case Burst :
+      return 0;
+    case Ramp :
+      return (PInt64)(value * (index-1) / slots);
+    case RampCPS :
+      return (PInt64)(1000 * (index-1) / value);
+    default :
+      return RandomRange(rand, (index-1)*500, (index+1)*500);
+  }
+}
 
-      delay = RandomRange(rand, params.tmin_call, params.tmax_call);
+PTimeInterval StartupPolicy::GetRampTime() const
+{
+  switch (type) {
+    case Burst :
+      return 0;
+    case Ramp :
+      return (PInt64)value;
+    case RampCPS :
+      return (PInt64)(1000 * slots / value);
+    default :
+      return (slots+1)*500;
+  }
+}
 
-      START_OUTPUT(index, token) << "Making call " << count;
+void StartupPolicy::PrintOn(ostream & strm) const
+{
+  switch (type) {
+    case Burst :
+      strm << "burst";
+      break;
+    case Ramp :
+      strm << "linear ramp over " << value/1000 << " seconds";
+      break;
+    case RampCPS :
+      strm << "ramp at " << value << " calls per second";
+      break;
+    default :
+      strm << "staggered by about 500 ms per call";
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+Distribution::Distribution()
+  : type(Uniform),
+    minimum(0),
+    maximum(0),
+    mean(0),
+    mu(0),
+    sigma(0)
+{
+}
+
+PBoolean Distribution::Parse(const PString & spec, const PTimeInterval & tmin, const PTimeInterval & tmax, PString & error)
+{
+  PCaselessString name = spec;
+  PString parameters;
+  PINDEX colon = spec.Find(':');
+  if (colon != P_MAX_INDEX) {
+    name = spec.Left(colon);
+    parameters = spec.Mid(colon+1);
+  }
+  PStringArray values = parameters.Tokenise(",", FALSE);
+
+  minimum = (double)tmin.GetMilliSeconds();
+  maximum = (double)tmax.GetMilliSeconds();
+  mean = (minimum + maximum) / 2;
+
+  if (name == "uniform")
+    type = Uniform;
+  else if (name == "fixed") {
+    type = Fixed;
+    if (values.GetSize() > 0)
+      minimum = values[0].AsReal() * 1000;
+  }
+  else if (name == "exponential") {
+    type = Exponential;
+    if (values.GetSize() > 0)
+      mean = values[0].AsReal() * 1000;
+  }
+  else if (name == "lognormal") {
+    type = LogNormal;
+    if (values.GetSize() > 0)
+      mean = values[0].AsReal() * 1000;
+    sigma = values.GetSize() > 1 ? values[1].AsReal() : 1.0;
+    if (sigma <= 0) {
+      error = "sigma must be positive in " + spec;
+      return FALSE;
+    }
+    // choose mu so the distribution has the requested mean
+    mu = log(mean) - sigma*sigma/2;
+  }
+  else if (name == "empirical") {
+    type = Empirical;
+    return LoadHistogram(parameters, error);
+  }
+  else {
+    error = "unknown distribution " + spec;
+    return FALSE;
+  }
+
+  if (mean <= 0 || minimum < 0) {
+    error = "durations must be positive in " + spec;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+PBoolean Distribution::LoadHistogram(const PFilePath & filename, PString & error)
+{
+  PTextFile file;
+  if (filename.IsEmpty() || !file.Open(filename, PFile::ReadOnly)) {
+    error = "could not open histogram file \"" + filename + '"';
+    return FALSE;
+  }
+
+  histogramFile = filename;
+  bounds.clear();
+  weights.clear();
+
+  double total = 0;
+  PString line;
+  while (file.ReadLine(line)) {
+    line = line.Trim();
+    if (line.IsEmpty() || line[0] == '#')
+      continue;
+
+    PStringArray tokens = line.Tokenise(" \t,", FALSE);
+    double bound = tokens.GetSize() > 0 ? tokens[0].AsReal() * 1000 : 0;
+    double weight = tokens.GetSize() > 1 ? tokens[1].AsReal() : 1;
+    if (tokens.GetSize() > 2 || weight < 0 || bound <= 0 || (!bounds.empty() && bound <= bounds.back())) {
+      error = "invalid histogram line in " + filename + ": " + line;
+      return FALSE;
+    }
+    total += weight;
+    bounds.push_back(bound);
+    weights.push_back(total);
+  }
+
+  if (total <= 0) {
+    error = "empty histogram in " + filename;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+PTimeInterval Distribution::Generate(FastRandom & rand) const
+{
+  double value = minimum;
+
+  switch (type) {
+    case Uniform :
+      value = minimum + (maximum - minimum) * (1 - rand.GetReal());
+      break;
+
+    case Fixed :
+      break;
+
+    case Exponential :
+      value = -log(rand.GetReal()) * mean;
+      break;
+
+    case LogNormal :
+    {
+      // Box-Muller transform for a standard normal value
+      const double TwoPi = 6.283185307179586;
+      value = exp(mu + sigma * sqrt(-2 * log(rand.GetReal())) * cos(TwoPi * rand.GetReal()));
+      break;
+    }
+
+    case Empirical :
+    {
+      // pick a bin by weight, then a uniform value within it
+      double pick = (1 - rand.GetReal()) * weights.back();
+      size_t bin = upper_bound(weights.begin(), weights.end(), pick) - weights.begin();
+      if (bin >= bounds.size())
+        bin = bounds.size() - 1;
+      double lower = bin > 0 ? bounds[bin-1] : 0;
+      value = lower + (bounds[bin] - lower) * (1 - rand.GetReal());
+      break;
+    }
+  }
+
+  return (PInt64)(value + 0.5);
+}
+
+void Distribution::PrintOn(ostream & strm) const
+{
+  switch (type) {
+    case Uniform :
+      strm << "uniform " << minimum/1000 << '-' << maximum/1000 << 's';
+      break;
+    case Fixed :
+      strm << "fixed " << minimum/1000 << 's';
+      break;
+    case Exponential :
+      strm << "exponential mean " << mean/1000 << 's';
+      break;
+    case LogNormal :
+      strm << "lognormal mean " << mean/1000 << "s sigma " << sigma;
+      break;
+    case Empirical :
+      strm << "empirical from " << histogramFile;
+      break;
+  }
+}
+
+// per call output, suppressed with --quiet
+#define START_OUTPUT(index, token) \
+{ \
+  if (!CallGen::Current().quiet) { \
+  CallGen::Current().coutMutex.Wait(); \
+  cout << setw(3) << index << ": " << setw(20) << token.Left(20) << ": "
+
+#define END_OUTPUT() \
+  cout << endl; \
+  CallGen::Current().coutMutex.Signal(); \
+  } \
+}
+
+#define OUTPUT(index, token, info) START_OUTPUT(index, token) << info; END_OUTPUT()
+
+void CallThread::Main()
+{
+  PTRACE(2, "CallGen\tStarted thread " << index);
+
+  CallGen & callgen = CallGen::Current();
+  FastRandom rand(PRandom::Number());
+
+  PTimeInterval delay = params.startup.GetInitialDelay(index, rand);
+  OUTPUT(index, PString::Empty(), "Initial delay of " << delay << " seconds");
+
+  if (exit.Wait(delay)) {
+    PTRACE(2, "CallGen\tAborted thread " << index);
+    callgen.threadEnded.Signal();
+    return;
+  }
+
+  // Loop "repeat" times for (repeat > 0), or loop forever for (repeat == 0)
+  unsigned count = 1;
+  do {
+    PString destination = destinations[(index-1 + count-1) % destinations.GetSize()];
+
+    if (count == 1)
+      callgen.OnSlotStarted();
+
+    // trigger a call
+    PString token;
+    PTRACE(1, "CallGen\tMaking call to " << destination);
+    callgen.stats.Increment(CallStats::Attempts);
+    unsigned totalAttempts = callgen.stats.Get(CallStats::Attempts);
+    if (!callgen.Start(destination, token))
+      PError << setw(3) << index << ": Call creation to " << destination << " failed" << endl;
+    else {
+      PBoolean stopping = FALSE;
+
+      delay = params.callTime.Generate(rand);
+
+      START_OUTPUT(index, token) << "Making call " << count;
       if (params.repeat)
         cout << " of " << params.repeat;
       cout << " (total=" << totalAttempts
@@ -719,7 +1689,7 @@ void CallThread::Main()
       break;
 
     // wait for a random delay
-    delay = RandomRange(rand, params.tmin_wait, params.tmax_wait);
+    delay = params.waitTime.Generate(rand);
     OUTPUT(index, PString::Empty(), "Delaying for " << delay << " seconds");
 
     PTRACE(1, "CallGen\tDelaying for " << delay);
@@ -742,609 +1712,5042 @@ void CallThread::Stop()
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void CallDetail::Drop(H323Connection & connection)
+// seconds with an optional s, m or h suffix
+static PBoolean ParseDuration(const PString & str, double & ms)
 {
-  PTextFile & cdrFile = CallGen::Current().cdrFile;
-
-  if (!cdrFile.IsOpen())
-    return;
+  PString value = str;
+  double unit = 1000;
+  switch (tolower(str[str.GetLength()-1])) {
+    case 'h' :
+      unit *= 60;
+      // fall through
+    case 'm' :
+      unit *= 60;
+      // fall through
+    case 's' :
+      value = str.Left(str.GetLength()-1);
+      break;
+  }
+  // eg. 500ms would be taken as 500m without this
+  if (value.IsEmpty() || value.FindSpan("0123456789.") != P_MAX_INDEX)
+    return FALSE;
+  ms = value.AsReal() * unit;
+  return ms > 0;
+}
 
-  static PMutex cdrMutex;
-  cdrMutex.Wait();
-
-  if (cdrFile.GetLength() == 0)
-    cdrFile << "Call Start Time,"
-               "Total duration,"
-               "Media open transmit time,"
-               "Media open received time,"
-               "Media received time,"
-               "ALERTING time,"
-               "CONNECT time,"
-               "Call End Reason,"
-               "Remote party,"
-               "Signaling gateway,"
-               "Media gateway,"
-               "Call Id,"
-               "Call Token\n";
+PBoolean LoadProfile::Load(const PFilePath & filename, PString & error)
+{
+  PTextFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    error = "could not open " + filename;
+    return FALSE;
+  }
 
-  PTime setupTime = connection.GetSetupUpTime();
+  phases.clear();
+  double start = 0;
+  double rate = 0;
+  unsigned lineNumber = 0;
+  PString line;
+  while (file.ReadLine(line)) {
+    lineNumber++;
+    line = line.Trim();
+    if (line.IsEmpty() || line[0] == '#')
+      continue;
+
+    PStringArray tokens = line.Tokenise(" \t", FALSE);
+    PCaselessString kind = tokens[0];
+    Phase phase;
+    phase.name = kind;
+    phase.start = start;
+    phase.fromRate = rate;
+
+    bool ok;
+    if (kind == "ramp" && (tokens.GetSize() == 3 || tokens.GetSize() == 4)) {
+      if (tokens.GetSize() == 4)
+        phase.fromRate = tokens[1].AsReal() / 1000;
+      phase.toRate = tokens[tokens.GetSize()-2].AsReal() / 1000;
+      ok = ParseDuration(tokens[tokens.GetSize()-1], phase.duration);
+    }
+    else if ((kind == "hold" || kind == "step" || kind == "soak" || kind == "spike")
+              && (tokens.GetSize() == 2 || tokens.GetSize() == 3)) {
+      if (tokens.GetSize() == 3)
+        phase.fromRate = tokens[1].AsReal() / 1000;
+      phase.toRate = phase.fromRate;
+      ok = ParseDuration(tokens[tokens.GetSize()-1], phase.duration);
+    }
+    else
+      ok = false;
 
-  cdrFile << setupTime.AsString("yyyy/M/d hh:mm:ss") << ','
-          << setprecision(1) << (connection.GetConnectionEndTime() - setupTime) << ',';
+    if (!ok || phase.fromRate < 0 || phase.toRate < 0) {
+      error = psprintf("%s line %u: ", (const char *)filename, lineNumber) + line;
+      return FALSE;
+    }
 
-  if (openedTransmitMedia.IsValid())
-    cdrFile << (openedTransmitMedia - setupTime);
-  cdrFile << ',';
+    phases.push_back(phase);
+    start += phase.duration;
+    rate = phase.toRate;
+  }
 
-  if (openedReceiveMedia.IsValid())
-    cdrFile << (openedReceiveMedia - setupTime);
-  cdrFile << ',';
+  if (phases.empty()) {
+    error = "no phases in " + filename;
+    return FALSE;
+  }
 
-  if (receivedMedia.IsValid())
-    cdrFile << (receivedMedia - setupTime);
-  cdrFile << ',';
+  return TRUE;
+}
 
-  if (connection.GetAlertingTime().IsValid())
-    cdrFile << (connection.GetAlertingTime() - setupTime);
-  cdrFile << ',';
+void LoadProfile::SetConstant(double cps)
+{
+  Phase phase;
+  phase.name = "hold";
+  phase.start = 0;
+  phase.duration = -1;
+  phase.fromRate = phase.toRate = cps / 1000;
+
+  phases.clear();
+  phases.push_back(phase);
+}
 
-  if (connection.GetConnectionStartTime().IsValid())
-    cdrFile << (connection.GetConnectionStartTime() - setupTime);
-  cdrFile << ',';
+void LoadProfile::Scale(double factor)
+{
+  for (size_t i = 0; i < phases.size(); i++) {
+    phases[i].fromRate *= factor;
+    phases[i].toRate *= factor;
+  }
+}
 
-  cdrFile << connection.GetCallEndReason() << ','
-          << connection.GetRemotePartyName() << ','
-          << connection.GetRemotePartyAddress() << ','
-          << mediaGateway << ','
-          << connection.GetCallIdentifier() << ','
-          << connection.GetCallToken()
-          << endl;
+double LoadProfile::Phase::GetRate(double offset) const
+{
+  if (duration <= 0)
+    return fromRate;
+  return fromRate + (toRate - fromRate) * offset / duration;
+}
 
-  cdrMutex.Signal();
+double LoadProfile::Phase::GetArrivals(double offset) const
+{
+  // integral of the linear rate from the start of the phase
+  return (fromRate + GetRate(offset)) / 2 * offset;
 }
 
-void CallDetail::OnRTPStatistics(const RTP_Session & session, const PString & token)
+PBoolean LoadProfile::Advance(double & time, double arrivals) const
 {
-  if (session.GetSessionID() == 1 && !receivedAudio) {
-    receivedAudio = true;
-    OUTPUT("", token, "Received audio");
-  }
-  if (session.GetSessionID() == 2 && !receivedVideo) {
-    receivedVideo = true;
-    OUTPUT("", token, "Received video");
+  for (PINDEX i = GetPhase(time); i < (PINDEX)phases.size(); i++) {
+    const Phase & phase = phases[i];
+    double offset = PMAX(time - phase.start, 0.0);
+    double rate = phase.GetRate(offset);
+
+    if (phase.duration >= 0) {
+      double left = phase.GetArrivals(phase.duration) - phase.GetArrivals(offset);
+      if (left < arrivals) {
+        arrivals -= left;
+        time = phase.start + phase.duration;
+        continue;
+      }
+    }
+    else if (rate <= 0)
+      return FALSE;
+
+    // solve slope/2 x^2 + rate x = arrivals for the time x within this phase
+    double slope = phase.duration > 0 ? (phase.toRate - phase.fromRate) / phase.duration : 0;
+    double x;
+    if (slope == 0)
+      x = arrivals / rate;
+    else
+      x = (sqrt(rate*rate + 2*slope*arrivals) - rate) / slope;
+    time = phase.start + offset + x;
+    return TRUE;
   }
-  if (receivedMedia.GetTimeInSeconds() == 0 && session.GetPacketsReceived() > 0) {
-    receivedMedia = PTime();
 
-    const RTP_UDP * udpSess = dynamic_cast<const RTP_UDP *>(&session);
-    if (udpSess != NULL)
-      mediaGateway = H323TransportAddress(udpSess->GetRemoteAddress(), udpSess->GetRemoteDataPort());
-  }
+  return FALSE;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-
-MyH323EndPoint::MyH323EndPoint()
+double LoadProfile::GetArrivals(double time) const
 {
-  // load plugins for H.460.17, .18 etc.
-  LoadBaseFeatureSet();
+  double arrivals = 0;
+  for (size_t i = 0; i < phases.size() && time > phases[i].start; i++) {
+    const Phase & phase = phases[i];
+    double offset = time - phase.start;
+    if (phase.duration >= 0 && offset > phase.duration)
+      offset = phase.duration;
+    arrivals += phase.GetArrivals(offset);
+  }
+  return arrivals;
+}
 
-  useJitterBuffer = false; // save a little processing time
+PINDEX LoadProfile::GetPhase(double time) const
+{
+  for (size_t i = 0; i < phases.size(); i++) {
+    if (phases[i].duration < 0 || time < phases[i].start + phases[i].duration)
+      return i;
+  }
+  return P_MAX_INDEX;
+}
 
-  AddAllCapabilities(0, P_MAX_INDEX, "*");
-  AddAllUserInputCapabilities(0, P_MAX_INDEX);
-  SetPerCallBandwidth(384);
-  SetFrameRate(30);
-  m_maxFrameSize = H323Capability::i1080MPI;
-  SetFuzzing(false);
-  SetPercentBadRTPHeader(50);
-  SetPercentBadRTPMedia(0);
-  SetPercentBadRTCP(5);
-  SetStartH239(false);
-  SetH239Delay(1);
-  SetH239Duration(-1);
+PString LoadProfile::GetPhaseDescription(PINDEX phase) const
+{
+  const Phase & p = phases[phase];
+  PStringStream str;
+  str << p.name << ' ';
+  if (p.fromRate != p.toRate)
+    str << p.fromRate*1000 << " to ";
+  str << p.toRate*1000 << " cps";
+  if (p.duration >= 0)
+    str << " for " << p.duration/1000 << " seconds";
+  return str;
 }
 
-PBoolean MyH323EndPoint::SetVideoFrameSize(H323Capability::CapabilityFrameSize frameSize, int frameUnits)
+PTimeInterval LoadProfile::GetDuration() const
 {
-  m_maxFrameSize = frameSize;
-  return H323EndPoint::SetVideoFrameSize(frameSize, frameUnits);
+  double duration = 0;
+  for (size_t i = 0; i < phases.size(); i++) {
+    if (phases[i].duration < 0)
+      return 0;
+    duration += phases[i].duration;
+  }
+  return (PInt64)duration;
 }
 
-H323Connection * MyH323EndPoint::CreateConnection(unsigned callReference)
+///////////////////////////////////////////////////////////////////////////////
+
+WorkerProcess::WorkerProcess(unsigned _index, const PFilePath & program, const PStringArray & arguments)
+  : PThread(1000, NoAutoDeleteThread, NormalPriority, psprintf("Worker %u", _index)),
+    index(_index),
+    attempts(0),
+    established(0),
+    active(0)
 {
-  return new MyH323Connection(*this, callReference);
+  if (!pipe.Open(program, arguments, PPipeChannel::ReadWrite, FALSE, FALSE))
+    cerr << "Could not start worker " << index << endl;
+  Resume();
 }
 
-static PString TidyRemotePartyName(const H323Connection & connection)
+void WorkerProcess::Main()
 {
-  PString name = connection.GetRemotePartyName();
+  PTRACE(2, "CallGen\tStarted worker " << index);
+
+  // forward output line by line, pick out statistics and call detail records
+  PString line;
+  char buffer[4096];
+  while (pipe.IsOpen() && pipe.Read(buffer, sizeof(buffer))) {
+    PINDEX count = pipe.GetLastReadCount();
+    PINDEX start = 0;
+    for (PINDEX i = 0; i < count; i++) {
+      if (buffer[i] == '\n') {
+        line += PString(buffer + start, i - start);
+        OnLine(line);
+        line = PString::Empty();
+        start = i+1;
+      }
+    }
+    if (start < count)
+      line += PString(buffer + start, count - start);
+  }
+  if (!line.IsEmpty())
+    OnLine(line);
 
-  PINDEX bracket = name.FindLast('[');
-  if (bracket == 0 || bracket == P_MAX_INDEX)
-    return name;
+  int status = pipe.WaitForTermination();
+  PTRACE(2, "CallGen\tWorker " << index << " ended with status " << status);
 
-  return name.Left(bracket).Trim();
+  CallGen::Current().threadEnded.Signal();
 }
 
-void MyH323EndPoint::OnConnectionEstablished(H323Connection & connection, const PString & token)
+void WorkerProcess::OnLine(const PString & line)
 {
-  OUTPUT("", token, "Established \"" << TidyRemotePartyName(connection) << "\""
-                    " " << connection.GetControlChannel().GetRemoteAddress() <<
-                    " active=" << connectionsActive.GetSize() <<
-                    " total=" << ++CallGen::Current().totalEstablished);
+  CallGen & callgen = CallGen::Current();
+
+  if (line.Left(7) == "@stats ") {
+    PStringArray values = line.Mid(7).Tokenise(" ", FALSE);
+    if (values.GetSize() >= 3) {
+      PWaitAndSignal lock(mutex);
+      attempts = values[0].AsUnsigned();
+      established = values[1].AsUnsigned();
+      active = values[2].AsUnsigned();
+    }
+  }
+  else if (line.Left(5) == "@cdr ")
+    callgen.WriteCDR(line.Mid(5));
+  else {
+    callgen.coutMutex.Wait();
+    cout << '[' << index << "] " << line << endl;
+    callgen.coutMutex.Signal();
+  }
 }
 
-void MyH323EndPoint::OnConnectionCleared(H323Connection & connection, const PString & token)
+void WorkerProcess::Stop()
 {
-  OUTPUT("", token, "Cleared \"" << TidyRemotePartyName(connection) << "\""
-                    " " << connection.GetControlChannel().GetRemoteAddress() <<
-                    " reason=" << connection.GetCallEndReason());
-  ((MyH323Connection&)connection).details.Drop(connection);
+  // same as pressing ENTER on the console of the worker
+  pipe.Write("\n", 1);
 }
 
-PBoolean MyH323EndPoint::OnStartLogicalChannel(H323Connection & connection, H323Channel & channel)
+unsigned WorkerProcess::GetAttempts() const
 {
-  (channel.GetDirection() == H323Channel::IsTransmitter
-        ? ((MyH323Connection&)connection).details.openedTransmitMedia
-        : ((MyH323Connection&)connection).details.openedReceiveMedia) = PTime();
+  PWaitAndSignal lock(mutex);
+  return attempts;
+}
 
-  OUTPUT("", connection.GetCallToken(),
-         "Opened " << (channel.GetDirection() == H323Channel::IsTransmitter ? "transmitter" : "receiver")
-                   << " for " << channel.GetCapability());
+unsigned WorkerProcess::GetEstablished() const
+{
+  PWaitAndSignal lock(mutex);
+  return established;
+}
 
-  return H323EndPoint::OnStartLogicalChannel(connection, channel);
+unsigned WorkerProcess::GetActive() const
+{
+  PWaitAndSignal lock(mutex);
+  return active;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-MyH323Connection::MyH323Connection(MyH323EndPoint & ep, unsigned callRef)
-  : H323Connection(ep, callRef)
-  , endpoint(ep)
-  , videoChannelIn(NULL)
-  , videoChannelOut(NULL)
-  , m_isH239ready(false)
-  , m_haveStartedH239(false)
+// records are written at least this often
+static const PTimeInterval CDRFlushInterval(200);
+// wake the writer early when this many records are waiting
+static const size_t CDRBatchSize = 1000;
+
+CDRWriter::CDRWriter(const PFilePath & _filename, const PBYTEArray & _header, off_t _maxSize, const PTimeInterval & _maxAge)
+  : PThread(1000, NoAutoDeleteThread, NormalPriority, "CDRWriter"),
+    filename(_filename),
+    header(_header),
+    maxSize(_maxSize),
+    maxAge(_maxAge),
+    stopping(false),
+    fileSize(0),
+    fileRecords(0)
 {
-    detectInBandDTMF = FALSE; // turn off in-band DTMF detection (uses a huge amount of CPU)
+  if (OpenFile())
+    Resume();
 }
 
-MyH323Connection::~MyH323Connection()
+CDRWriter::~CDRWriter()
 {
-    delete videoChannelIn;
-    delete videoChannelOut;
+  Close();
 }
 
-PBoolean MyH323Connection::OnSendSignalSetup(H323SignalPDU & setupPDU)
+void CDRWriter::Write(const PBYTEArray & record)
 {
-    // set outgoing bearer capability to unrestricted information transfer + transfer rate
-	PBYTEArray caps;
-	caps.SetSize(4);
-	caps[0] = 0x88;
-	caps[1] = 0x18;
-	caps[2] = 0x80 | endpoint.GetRateMultiplier();
-	caps[3] = 0xa5;
-	setupPDU.GetQ931().SetIE(Q931::BearerCapabilityIE, caps);
+  // no disk access here, this is called when calls are cleared
+  mutex.Wait();
+  pending.push_back(record);
+  bool wake = pending.size() == CDRBatchSize;
+  mutex.Signal();
+
+  if (wake)
+    wakeup.Signal();
+}
 
-    return H323Connection::OnSendSignalSetup(setupPDU);
+void CDRWriter::Close()
+{
+  mutex.Wait();
+  bool running = !stopping && !IsSuspended();
+  stopping = true;
+  mutex.Signal();
+
+  if (running) {
+    wakeup.Signal();
+    WaitForTermination();
+  }
+  file.Close();
 }
 
-H323Channel * MyH323Connection::CreateRealTimeLogicalChannel(const H323Capability & capability, H323Channel::Directions dir,
-                                                unsigned sessionID, const H245_H2250LogicalChannelParameters * param, RTP_QOS * rtpqos)
+void CDRWriter::Main()
 {
+  vector<PBYTEArray> batch;
+  for (;;) {
+    wakeup.Wait(CDRFlushInterval);
+
+    mutex.Wait();
+    batch.swap(pending);
+    bool done = stopping;
+    mutex.Signal();
+
+    WriteBatch(batch);
+    batch.clear();
+
+    if (fileRecords > 0 && ((maxSize > 0 && fileSize >= maxSize) ||
+                            (maxAge > 0 && PTime() - fileOpened >= maxAge)))
+      Rotate();
+
+    if (done)
+      break;
+  }
+}
+
+PBoolean CDRWriter::OpenFile()
+{
+  if (!file.Open(filename, PFile::WriteOnly, PFile::Create))
+    return FALSE;
+
+  fileSize = file.GetLength();
+  file.SetPosition(fileSize);
+  fileOpened = PTime();
+  fileRecords = 0;
+
+  if (fileSize == 0 && header.GetSize() > 0) {
+    file.Write(header, header.GetSize());
+    fileSize += header.GetSize();
+  }
+  return TRUE;
+}
+
+// one write for all records that came in since the last batch
+void CDRWriter::WriteBatch(const vector<PBYTEArray> & batch)
+{
+  if (batch.empty() || !file.IsOpen())
+    return;
+
+  PINDEX length = 0;
+  for (size_t i = 0; i < batch.size(); i++)
+    length += batch[i].GetSize();
+
+  PBYTEArray buffer(length);
+  BYTE * ptr = buffer.GetPointer();
+  for (size_t i = 0; i < batch.size(); i++) {
+    memcpy(ptr, (const BYTE *)batch[i], batch[i].GetSize());
+    ptr += batch[i].GetSize();
+  }
+
+  if (!file.Write(buffer, length)) {
+    PTRACE(1, "CallGen\tError writing CDR file: " << file.GetErrorText(PChannel::LastWriteError));
+    return;
+  }
+  fileSize += length;
+  fileRecords += batch.size();
+}
+
+// rename the current file to name-yyyyMMdd-hhmmss.ext and start a new one
+void CDRWriter::Rotate()
+{
+  file.Close();
+
+  PString stamp = filename.GetTitle() + '-' + PTime().AsString("yyyyMMdd-hhmmss");
+  PString newName = stamp + filename.GetType();
+  for (unsigned i = 1; PFile::Exists(filename.GetDirectory() + newName); i++)
+    newName = stamp + psprintf("-%u", i) + filename.GetType();
+
+  if (PFile::Rename(filename, newName))
+    PTRACE(3, "CallGen\tRotated CDR file to " << newName);
+  else
+    PTRACE(1, "CallGen\tCould not rename CDR file to " << newName);
+
+  if (!OpenFile())
+    PTRACE(1, "CallGen\tCould not open new CDR file " << filename);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CallScheduler::CallScheduler(const CallParams & _params, unsigned _workers)
+  : params(_params),
+    numWorkers(_workers),
+    activeSlots(0),
+    stopping(false),
+    arrivals(NULL),
+    currentPhase(P_MAX_INDEX),
+    poissonArrivals(false),
+    arrivalTotal(0),
+    arrivalCount(0),
+    nextArrival(0),
+    lastReportCount(0),
+    lastReportAttempts(0),
+    lastReportEstablished(0),
+    startAttempts(0),
+    startEstablished(0)
+{
+}
+
+CallScheduler::~CallScheduler()
+{
+  Stop();
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i]->WaitForTermination();
+    delete workers[i];
+  }
+
+  if (arrivals != NULL)
+    ReportArrivals(PTimer::Tick(), true);
+
+  // open-loop calls are only referenced by the queue
+  while (!queue.empty()) {
+    if (queue.top().slot->oneShot)
+      delete queue.top().slot;
+    queue.pop();
+  }
+
+  for (size_t i = 0; i < slots.size(); i++)
+    delete slots[i];
+}
+
+void CallScheduler::AddSlot(unsigned index, const PStringArray & destinations)
+{
+  Slot * slot = new Slot(index, destinations);
+  slots.push_back(slot);
+
+  PWaitAndSignal lock(queueMutex);
+  activeSlots++;
+}
+
+void CallScheduler::SetArrivals(const LoadProfile & _profile, bool poisson, unsigned total, const PStringArray & destinations)
+{
+  arrivals = new Slot(0, destinations);
+  arrivals->state = Slot::e_Arrivals;
+  slots.push_back(arrivals);
+
+  profile = _profile;
+  poissonArrivals = poisson;
+  arrivalTotal = total;
+
+  PWaitAndSignal lock(queueMutex);
+  activeSlots++;
+}
+
+void CallScheduler::Start()
+{
+  FastRandom rand(PRandom::Number());
+
+  if (arrivals != NULL) {
+    CallGen & callgen = CallGen::Current();
+    arrivalStart = lastReport = PTimer::Tick();
+    startAttempts = lastReportAttempts = callgen.stats.Get(CallStats::Attempts);
+    startEstablished = lastReportEstablished = callgen.stats.Get(CallStats::Established);
+    nextArrival = 0;
+    double first = poissonArrivals ? -log(rand.GetReal()) : 1;
+    if (profile.Advance(nextArrival, first))
+      Schedule(*arrivals, (PInt64)nextArrival);
+    else
+      Schedule(*arrivals, 0); // profile without any calls
+  }
+
+  // same startup as CallThread
+  for (size_t i = 0; i < slots.size(); i++) {
+    if (slots[i] == arrivals)
+      continue;
+    PTimeInterval delay = params.startup.GetInitialDelay(slots[i]->index, rand);
+    OUTPUT(slots[i]->index, PString::Empty(), "Initial delay of " << delay << " seconds");
+    Schedule(*slots[i], delay);
+  }
+
+  for (unsigned i = 0; i < numWorkers; i++)
+    workers.push_back(new Worker(*this, i+1));
+}
+
+void CallScheduler::Stop()
+{
+  queueMutex.Wait();
+  if (!stopping && activeSlots > 0) {
+    CallGen::Current().coutMutex.Wait();
+    cout << "Stopping " << activeSlots << " scheduled call slots." << endl;
+    CallGen::Current().coutMutex.Signal();
+  }
+  stopping = true;
+  queueMutex.Signal();
+
+  wakeup.Signal();
+}
+
+PBoolean CallScheduler::IsFinished() const
+{
+  for (size_t i = 0; i < workers.size(); i++) {
+    if (!workers[i]->IsTerminated())
+      return FALSE;
+  }
+  return TRUE;
+}
+
+void CallScheduler::Schedule(Slot & slot, const PTimeInterval & delay)
+{
+  PWaitAndSignal lock(queueMutex);
+
+  Event ev(PTimer::Tick() + delay, &slot);
+  // only wake a worker if the new event is due before everything else
+  bool first = queue.empty() || queue.top().due > ev.due;
+  queue.push(ev);
+  if (first)
+    wakeup.Signal();
+}
+
+void CallScheduler::RunWorker()
+{
+  FastRandom rand(PRandom::Number());
+
+  for (;;) {
+    queueMutex.Wait();
+
+    if (stopping && !queue.empty()) {
+      // clear the call of every waiting slot, like CallThread does when stopped
+      Slot * slot = queue.top().slot;
+      queue.pop();
+      queueMutex.Signal();
+      if (!slot->token.IsEmpty()) {
+        OUTPUT(slot->index, slot->token, "Clearing call");
+        CallGen::Current().Clear(slot->token);
+        slot->token = PString::Empty();
+      }
+      if (slot->oneShot)
+        delete slot;
+      continue;
+    }
+
+    if (stopping || activeSlots == 0) {
+      queueMutex.Signal();
+      wakeup.Signal(); // pass on to the next worker so all of them end
+      return;
+    }
+
+    if (queue.empty()) {
+      // all remaining slots are being processed by other workers
+      queueMutex.Signal();
+      wakeup.Wait();
+      continue;
+    }
+
+    Event ev = queue.top();
+    PTimeInterval now = PTimer::Tick();
+    if (ev.due > now) {
+      queueMutex.Signal();
+      wakeup.Wait(ev.due - now);
+      continue;
+    }
+
+    queue.pop();
+    // hand the next due event to another worker while this one is busy
+    bool moreDue = !queue.empty() && queue.top().due <= now;
+    queueMutex.Signal();
+    if (moreDue)
+      wakeup.Signal();
+
+    PTimeInterval delay;
+    if (Process(*ev.slot, rand, delay))
+      Schedule(*ev.slot, delay);
+    else {
+      if (ev.slot->oneShot)
+        delete ev.slot;
+      queueMutex.Wait();
+      activeSlots--;
+      queueMutex.Signal();
+    }
+  }
+}
+
+// Advance the slot through the same sequence CallThread::Main() runs,
+// return FALSE when the call set of this slot is complete
+PBoolean CallScheduler::Process(Slot & slot, FastRandom & rand, PTimeInterval & delay)
+{
+  CallGen & callgen = CallGen::Current();
+
+  switch (slot.state) {
+    case Slot::e_Arrivals :
+      return ProcessArrivals(rand, delay);
+
+    case Slot::e_Starting :
+    case Slot::e_Calling :
+    {
+      PString destination = slot.destinations[(slot.index-1 + slot.count-1) % slot.destinations.GetSize()];
+
+      if (slot.state == Slot::e_Starting && !slot.oneShot)
+        callgen.OnSlotStarted();
+
+      PTRACE(1, "CallGen\tMaking call to " << destination);
+      callgen.stats.Increment(CallStats::Attempts);
+      unsigned totalAttempts = callgen.stats.Get(CallStats::Attempts);
+      if (!callgen.Start(destination, slot.token)) {
+        PError << setw(3) << slot.index << ": Call creation to " << destination << " failed" << endl;
+        break;
+      }
+
+      delay = params.callTime.Generate(rand);
+
+      START_OUTPUT(slot.index, slot.token) << "Making call " << slot.count;
+      if (params.repeat)
+        cout << " of " << params.repeat;
+      cout << " (total=" << totalAttempts
+           << ") for " << delay << " seconds to "
+           << destination;
+      END_OUTPUT();
+
+      if (params.tmax_est > 0) {
+        OUTPUT(slot.index, slot.token, "Waiting " << params.tmax_est << " seconds for establishment");
+        slot.state = Slot::e_Establishing;
+        slot.holdTime = delay;
+        slot.establishDeadline = PTimer::Tick() + params.tmax_est;
+        delay = 100;
+      }
+      else
+        slot.state = Slot::e_Holding;
+      return TRUE;
+    }
+
+    case Slot::e_Establishing :
+      if (callgen.IsEstablished(slot.token)) {
+        slot.state = Slot::e_Holding;
+        delay = slot.holdTime;
+        PTRACE(1, "CallGen\tWaiting for " << delay);
+        return TRUE;
+      }
+      if (PTimer::Tick() < slot.establishDeadline && callgen.Exists(slot.token)) {
+        delay = 100;
+        return TRUE;
+      }
+      // not established in time or already gone, clear the call at once
+      // fall through
+
+    case Slot::e_Holding :
+      // end the call
+      OUTPUT(slot.index, slot.token, "Clearing call");
+      callgen.ClearNoWait(slot.token);
+      slot.token = PString::Empty();
+      break;
+  }
+
+  if (slot.oneShot)
+    return FALSE;
+
+  slot.count++;
+  if (params.repeat > 0 && slot.count > params.repeat) {
+    OUTPUT(slot.index, PString::Empty(), "Completed call set.");
+    return FALSE;
+  }
+
+  // wait for a random delay
+  slot.state = Slot::e_Calling;
+  delay = params.waitTime.Generate(rand);
+  OUTPUT(slot.index, PString::Empty(), "Delaying for " << delay << " seconds");
+  PTRACE(1, "CallGen\tDelaying for " << delay);
+  return TRUE;
+}
+
+// Start all open-loop calls that are due by now, independent of how many
+// calls are still active, return FALSE when the total has been reached
+PBoolean CallScheduler::ProcessArrivals(FastRandom & rand, PTimeInterval & delay)
+{
+  PTimeInterval now = PTimer::Tick();
+  double elapsed = (double)(now - arrivalStart).GetMilliSeconds();
+
+  PINDEX phase = profile.GetPhase(elapsed);
+  if (phase != currentPhase && phase != P_MAX_INDEX) {
+    currentPhase = phase;
+    CallGen::Current().coutMutex.Wait();
+    cout << "Phase " << phase+1 << ": " << profile.GetPhaseDescription(phase) << endl;
+    CallGen::Current().coutMutex.Signal();
+  }
+
+  while (nextArrival <= elapsed) {
+    if ((arrivalTotal > 0 && arrivalCount >= arrivalTotal) || phase == P_MAX_INDEX) {
+      ReportArrivals(now, false);
+      return FALSE;
+    }
+
+    Slot * slot = new Slot(++arrivalCount, arrivals->destinations, true);
+    queueMutex.Wait();
+    activeSlots++;
+    queueMutex.Signal();
+    Schedule(*slot, 0);
+
+    // unit or exponential step in expected arrivals
+    double step = poissonArrivals ? -log(rand.GetReal()) : 1;
+    if (!profile.Advance(nextArrival, step)) {
+      ReportArrivals(now, false);
+      return FALSE;
+    }
+  }
+
+  if (now - lastReport >= 10000)
+    ReportArrivals(now, false);
+
+  // wake up at least once a second to report phases and rates in time
+  delay = PMIN((PInt64)(nextArrival - elapsed) + 1, 1000);
+  return TRUE;
+}
+
+// Compare the offered arrival rate with the rate of calls actually attempted and established
+void CallScheduler::ReportArrivals(const PTimeInterval & now, bool final)
+{
+  CallGen & callgen = CallGen::Current();
+
+  double offered = profile.GetArrivals((double)(now - arrivalStart).GetMilliSeconds())
+                 - profile.GetArrivals((double)((final ? arrivalStart : lastReport) - arrivalStart).GetMilliSeconds());
+  unsigned count = arrivalCount - (final ? 0 : lastReportCount);
+  CallStats::Snapshot snapshot;
+  callgen.stats.GetSnapshot(snapshot);
+  unsigned attempts = snapshot.Get(CallStats::Attempts) - (final ? startAttempts : lastReportAttempts);
+  unsigned established = snapshot.Get(CallStats::Established) - (final ? startEstablished : lastReportEstablished);
+  double secs = (double)(now - (final ? arrivalStart : lastReport)).GetMilliSeconds() / 1000;
+
+  if (secs > 0) {
+    PStringStream line;
+    line << (final ? "Overall" : "Interval") << setprecision(1) << setiosflags(ios::fixed)
+         << ": offered " << offered/secs << " cps"
+         << ", launched " << count/secs << " cps"
+         << ", attempted " << attempts/secs << " cps"
+         << ", established " << established/secs << " cps";
+    callgen.coutMutex.Wait();
+    cout << line << endl;
+    callgen.coutMutex.Signal();
+  }
+
+  lastReport = now;
+  lastReportCount = arrivalCount;
+  lastReportAttempts = snapshot.Get(CallStats::Attempts);
+  lastReportEstablished = snapshot.Get(CallStats::Established);
+}
+
+CallScheduler::Worker::Worker(CallScheduler & _scheduler, unsigned _index)
+  : PThread(1000, NoAutoDeleteThread, NormalPriority, psprintf("Scheduler %u", _index)),
+    scheduler(_scheduler)
+{
+  Resume();
+}
+
+void CallScheduler::Worker::Main()
+{
+  PTRACE(2, "CallGen\tStarted scheduler thread");
+  scheduler.RunWorker();
+  PTRACE(2, "CallGen\tFinished scheduler thread");
+
+  CallGen::Current().threadEnded.Signal();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+PINDEX LatencyHistogram::GetBucket(PInt64 ms)
+{
+  if (ms < 2*SubBuckets)
+    return ms < 0 ? 0 : (PINDEX)ms;
+
+  // keep the 5 bits below the highest set bit as sub bucket
+  PINDEX magnitude = 0;
+  while ((ms >> magnitude) >= 2*SubBuckets)
+    magnitude++;
+  PINDEX bucket = (magnitude+1)*SubBuckets + (PINDEX)(ms >> magnitude) - SubBuckets;
+  return bucket < NumBuckets ? bucket : NumBuckets-1;
+}
+
+unsigned LatencyHistogram::GetBucketValue(PINDEX bucket)
+{
+  if (bucket < 2*SubBuckets)
+    return bucket;
+
+  PINDEX magnitude = bucket/SubBuckets - 1;
+  unsigned sub = bucket%SubBuckets + SubBuckets;
+  return ((sub+1) << magnitude) - 1;
+}
+
+void LatencyHistogram::GetSnapshot(Snapshot & snapshot) const
+{
+  for (PINDEX i = 0; i < NumBuckets; i++)
+    snapshot.counts[i] = (long)counts[i];
+}
+
+unsigned LatencyHistogram::Snapshot::GetCount() const
+{
+  unsigned total = 0;
+  for (PINDEX i = 0; i < NumBuckets; i++)
+    total += counts[i];
+  return total;
+}
+
+unsigned LatencyHistogram::Snapshot::GetPercentile(double percentile) const
+{
+  unsigned total = GetCount();
+  if (total == 0)
+    return 0;
+
+  // smallest value with at least percentile % of the values at or below it
+  double wanted = total * percentile / 100;
+  unsigned seen = 0;
+  for (PINDEX i = 0; i < NumBuckets; i++) {
+    seen += counts[i];
+    if (seen > 0 && seen >= wanted)
+      return GetBucketValue(i);
+  }
+  return GetMax();
+}
+
+unsigned LatencyHistogram::Snapshot::GetMax() const
+{
+  for (PINDEX i = NumBuckets-1; i >= 0; i--) {
+    if (counts[i] > 0)
+      return GetBucketValue(i);
+  }
+  return 0;
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Snapshot::operator-(const Snapshot & other) const
+{
+  Snapshot result;
+  for (PINDEX i = 0; i < NumBuckets; i++)
+    result.counts[i] = counts[i] - other.counts[i];
+  return result;
+}
+
+void LatencyHistogram::Snapshot::Add(const PTimeInterval & value)
+{
+  counts[GetBucket(value.GetMilliSeconds())]++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CallStats::Shard & CallStats::GetShard()
+{
+  // spread threads over the shards by their id
+  PUInt64 id = (PUInt64)PThread::GetCurrentThreadId();
+  return shards[(id * 0x9e3779b97f4a7c15ULL) >> 60 & (NumShards-1)];
+}
+
+void CallStats::OnCleared(H323Connection::CallEndReason reason, bool established)
+{
+  if (reason < H323Connection::NumCallEndReasons) {
+    Increment((Counters)(FirstCleared + reason));
+    if (!established)
+      Increment((Counters)(FirstFailed + reason));
+  }
+}
+
+void CallStats::RecordLatency(Latencies latency, const PTime & setupTime, const PTime & eventTime)
+{
+  if (setupTime.IsValid() && eventTime.IsValid())
+    latencies[latency].Record(eventTime - setupTime);
+}
+
+void CallStats::GetLatencies(LatencyHistogram::Snapshot snapshots[NumLatencies]) const
+{
+  for (int i = 0; i < NumLatencies; i++)
+    latencies[i].GetSnapshot(snapshots[i]);
+}
+
+void CallStats::RecordRTP(RTPReceiveStats::Media media, const RTPReceiveStats & stats, double mos)
+{
+  PWaitAndSignal lock(rtpMutex);
+
+  RTPTotals & totals = rtpTotals[media];
+  totals.sessions++;
+  totals.packets += stats.packets;
+  totals.octets += stats.octets;
+  totals.lost += stats.lost;
+  totals.outOfOrder += stats.outOfOrder;
+  totals.late += stats.late;
+  totals.avgJitter += stats.avgJitter;
+  totals.maxJitter.Add(PTimeInterval(stats.maxJitter));
+  if (mos > 0)
+    totals.mos.Add(mos);
+}
+
+void CallStats::GetRTPTotals(RTPTotals totals[RTPReceiveStats::NumMedia]) const
+{
+  PWaitAndSignal lock(rtpMutex);
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++)
+    totals[media] = rtpTotals[media];
+}
+
+void CallStats::PrintRTPTotals(ostream & strm, const RTPTotals totals[RTPReceiveStats::NumMedia])
+{
+  strm << "Received media  sessions    packets   lost%  out of order    late  avg jitter  max jitter p50/p99/max\n";
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    const RTPTotals & t = totals[media];
+    if (t.sessions == 0)
+      continue;
+    strm << "  " << setw(12) << left << (media == RTPReceiveStats::Audio ? "Audio" : "Video") << right
+         << setw(10) << t.sessions
+         << setw(11) << t.packets
+         << setw(8) << setprecision(2) << setiosflags(ios::fixed) << t.GetLossPercent() << resetiosflags(ios::fixed)
+         << setw(14) << t.outOfOrder
+         << setw(8) << t.late
+         << setw(10) << t.avgJitter/t.sessions << "ms"
+         << setw(8) << t.maxJitter.GetPercentile(50) << '/' << t.maxJitter.GetPercentile(99) << '/' << t.maxJitter.GetMax() << "ms\n";
+  }
+}
+
+CallStats::RTPTotals CallStats::RTPTotals::operator-(const RTPTotals & other) const
+{
+  RTPTotals result;
+  result.sessions = sessions - other.sessions;
+  result.packets = packets - other.packets;
+  result.octets = octets - other.octets;
+  result.lost = lost - other.lost;
+  result.outOfOrder = outOfOrder - other.outOfOrder;
+  result.late = late - other.late;
+  result.avgJitter = avgJitter - other.avgJitter;
+  result.maxJitter = maxJitter - other.maxJitter;
+  result.mos = mos - other.mos;
+  return result;
+}
+
+void CallStats::MOSDistribution::Add(double mos)
+{
+  int bucket = (int)((mos - 1.0)*100 + 0.5);
+  ++counts[PMAX(0, PMIN(bucket, NumBuckets-1))];
+}
+
+unsigned CallStats::MOSDistribution::GetCount() const
+{
+  unsigned count = 0;
+  for (int i = 0; i < NumBuckets; i++)
+    count += counts[i];
+  return count;
+}
+
+unsigned CallStats::MOSDistribution::GetCount(double from, double to) const
+{
+  unsigned count = 0;
+  for (int i = 0; i < NumBuckets; i++) {
+    double mos = 1.0 + i/100.0;
+    if (mos >= from - 0.001 && mos < to - 0.001)
+      count += counts[i];
+  }
+  return count;
+}
+
+double CallStats::MOSDistribution::GetMean() const
+{
+  double sum = 0;
+  unsigned count = 0;
+  for (int i = 0; i < NumBuckets; i++) {
+    sum += counts[i] * (1.0 + i/100.0);
+    count += counts[i];
+  }
+  return count > 0 ? sum/count : 0;
+}
+
+// lowest MOS that percentile % of the sessions reached or were below
+double CallStats::MOSDistribution::GetPercentile(double percentile) const
+{
+  unsigned count = GetCount();
+  if (count == 0)
+    return 0;
+
+  double target = count * percentile / 100;
+  unsigned sum = 0;
+  for (int i = 0; i < NumBuckets; i++) {
+    sum += counts[i];
+    if (sum >= target && sum > 0)
+      return 1.0 + i/100.0;
+  }
+  return 4.5;
+}
+
+CallStats::MOSDistribution CallStats::MOSDistribution::operator-(const MOSDistribution & other) const
+{
+  MOSDistribution result;
+  for (int i = 0; i < NumBuckets; i++)
+    result.counts[i] = counts[i] - other.counts[i];
+  return result;
+}
+
+// G.107 user satisfaction bands
+void CallStats::MOSDistribution::PrintOn(ostream & strm) const
+{
+  static const struct {
+    double from;
+    double to;
+    const char * description;
+  } bands[] = {
+    { 4.34, 4.51, "R 90-100 very satisfied" },
+    { 4.03, 4.34, "R 80-90  satisfied" },
+    { 3.60, 4.03, "R 70-80  some users dissatisfied" },
+    { 3.10, 3.60, "R 60-70  many users dissatisfied" },
+    { 2.58, 3.10, "R 50-60  nearly all users dissatisfied" },
+    { 1.00, 2.58, "R 0-50   not recommended" }
+  };
+
+  unsigned count = GetCount();
+  if (count == 0)
+    return;
+
+  strm << "Audio MOS  " << count << " sessions, mean " << setprecision(2) << setiosflags(ios::fixed) << GetMean()
+       << ", p5 " << GetPercentile(5) << ", p50 " << GetPercentile(50) << '\n';
+  for (unsigned i = 0; i < PARRAYSIZE(bands); i++) {
+    unsigned inBand = GetCount(bands[i].from, bands[i].to);
+    strm << "  " << setw(38) << left << bands[i].description << right
+         << setw(10) << inBand
+         << setw(8) << 100.0*inBand/count << "%\n";
+  }
+  strm << resetiosflags(ios::fixed);
+}
+
+void CallStats::RecordComparison(const AudioComparison::Result & result)
+{
+  PWaitAndSignal lock(rtpMutex);
+  comparisonTotals.calls++;
+  if (!result.aligned)
+    return;
+  comparisonTotals.aligned++;
+  comparisonTotals.snr += result.snr;
+  if (result.clipped > 0)
+    comparisonTotals.clipped++;
+  if (result.dropouts > 0)
+    comparisonTotals.dropouts++;
+  comparisonTotals.delay.Add(PTimeInterval(result.delay));
+}
+
+CallStats::ComparisonTotals CallStats::GetComparisonTotals() const
+{
+  PWaitAndSignal lock(rtpMutex);
+  return comparisonTotals;
+}
+
+CallStats::ComparisonTotals CallStats::ComparisonTotals::operator-(const ComparisonTotals & other) const
+{
+  ComparisonTotals result;
+  result.calls = calls - other.calls;
+  result.aligned = aligned - other.aligned;
+  result.snr = snr - other.snr;
+  result.clipped = clipped - other.clipped;
+  result.dropouts = dropouts - other.dropouts;
+  result.delay = delay - other.delay;
+  return result;
+}
+
+void CallStats::ComparisonTotals::PrintOn(ostream & strm) const
+{
+  if (calls == 0)
+    return;
+
+  strm << "Compared audio  " << calls << " calls, outgoing message found in " << aligned << '\n';
+  if (aligned == 0)
+    return;
+
+  strm << "  delay p50 " << delay.GetPercentile(50) << "ms, p99 " << delay.GetPercentile(99) << "ms, max " << delay.GetMax() << "ms\n"
+       << "  SNR average " << setprecision(1) << setiosflags(ios::fixed) << snr/aligned << "dB\n"
+       << resetiosflags(ios::fixed)
+       << "  calls with clipping " << clipped << ", with dropouts " << dropouts << '\n';
+}
+
+double CallStats::RTPTotals::GetLossPercent() const
+{
+  PUInt64 expected = packets + lost;
+  return expected > 0 ? 100.0*lost/expected : 0;
+}
+
+void CallStats::PrintLatencies(ostream & strm, const LatencyHistogram::Snapshot snapshots[NumLatencies])
+{
+  static const char * const names[NumLatencies] = {
+    "ALERTING",
+    "CONNECT",
+    "Transmit media open",
+    "Receive media open",
+    "First media received"
+  };
+
+  strm << "Latency from setup (ms)   count     p50     p90     p99   p99.9     max\n";
+  for (int i = 0; i < NumLatencies; i++) {
+    const LatencyHistogram::Snapshot & s = snapshots[i];
+    strm << "  " << setw(21) << left << names[i] << right
+         << setw(8) << s.GetCount()
+         << setw(8) << s.GetPercentile(50)
+         << setw(8) << s.GetPercentile(90)
+         << setw(8) << s.GetPercentile(99)
+         << setw(8) << s.GetPercentile(99.9)
+         << setw(8) << s.GetMax() << '\n';
+  }
+}
+
+unsigned CallStats::Get(Counters counter) const
+{
+  unsigned total = 0;
+  for (int i = 0; i < NumShards; i++)
+    total += (long)shards[i].counters[counter];
+  return total;
+}
+
+void CallStats::GetSnapshot(Snapshot & snapshot) const
+{
+  for (int c = 0; c < NumCounters; c++) {
+    unsigned total = 0;
+    for (int i = 0; i < NumShards; i++)
+      total += (long)shards[i].counters[c];
+    snapshot.counters[c] = total;
+  }
+}
+
+CallStats::Snapshot CallStats::Snapshot::operator-(const Snapshot & other) const
+{
+  Snapshot result;
+  for (int c = 0; c < NumCounters; c++)
+    result.counters[c] = counters[c] - other.counters[c];
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool RTPReceiveStats::GetMedia(unsigned sessionID, Media & media)
+{
+  switch (sessionID) {
+    case RTP_Session::DefaultAudioSessionID :
+      media = Audio;
+      return true;
+    case RTP_Session::DefaultVideoSessionID :
+      media = Video;
+      return true;
+    default :
+      return false;   // eg. H.239
+  }
+}
+
+void RTPReceiveStats::Update(const RTP_Session & session)
+{
+  valid = true;
+  packets = session.GetPacketsReceived();
+  octets = session.GetOctetsReceived();
+  lost = session.GetPacketsLost();
+  outOfOrder = session.GetPacketsOutOfOrder();
+  late = session.GetPacketsTooLate();
+  avgJitter = session.GetAvgJitterTime();
+  maxJitter = session.GetMaxJitterTime();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+EModel::EModel(const PString & codec)
+{
+  // ITU-T G.113 Appendix I, checked in order so G.722.1 doesn't match G.722
+  static const struct {
+    const char * name;
+    double       ie;
+    double       bpl;
+    unsigned     packetTime;
+  } codecs[] = {
+    { "G.711",     0,  4.3, 20 },   // no packet loss concealment
+    { "G.729",    11, 19.0, 20 },
+    { "G.723",    15, 16.1, 30 },
+    { "G.728",     7, 10.0, 20 },
+    { "G.726",     7, 10.0, 20 },
+    { "GSM-AMR",   5, 10.0, 20 },
+    { "GSM",      20, 10.0, 20 },
+    { "iLBC",     11, 32.0, 30 },
+    { "G.722.1",   0, 10.0, 20 },   // wideband codecs rated as the best narrowband ones
+    { "G.722",     0, 10.0, 20 },
+    { "Speex",    11, 10.0, 20 }
+  };
+
+  ie = 0;
+  bpl = 10.0;
+  packetTime = 20;
+  for (unsigned i = 0; i < PARRAYSIZE(codecs); i++) {
+    if (codec.Find(codecs[i].name) != P_MAX_INDEX) {
+      ie = codecs[i].ie;
+      bpl = codecs[i].bpl;
+      packetTime = codecs[i].packetTime;
+      return;
+    }
+  }
+  PTRACE(4, "CallGen\tNo E-model values for codec " << codec << ", using defaults");
+}
+
+// R = Ro - Is - Id - Ie,eff + A with the G.107 defaults (Ro - Is = 93.2, A = 0)
+double EModel::GetRFactor(const RTPReceiveStats & stats) const
+{
+  // late packets are discarded, so they count as lost
+  double expected = (double)stats.packets + stats.lost;
+  double ppl = expected > 0 ? 100.0*((double)stats.lost + stats.late)/expected : 0;
+  double ieEff = ie + (95 - ie) * ppl / (ppl + bpl);
+
+  // one way delay of packetization and jitter buffer, the network delay is
+  // not known; Id after the Cole & Rosenbluth simplification of G.107
+  double ta = packetTime + PMAX(2.0*stats.avgJitter, 20.0);
+  double id = 0.024*ta + (ta > 177.3 ? 0.11*(ta - 177.3) : 0);
+
+  double r = 93.2 - id - ieEff;
+  return PMAX(0.0, PMIN(r, 100.0));
+}
+
+double EModel::GetMOS(double r)
+{
+  if (r <= 0)
+    return 1.0;
+  if (r >= 100)
+    return 4.5;
+  return 1 + 0.035*r + r*(r - 60)*(100 - r)*7e-6;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void CallDetail::Drop(H323Connection & connection)
+{
+  CallGen & callgen = CallGen::Current();
+
+  // calls that were never established only had their ALERTING recorded now
+  if (!recordedAlerting) {
+    recordedAlerting = true;
+    callgen.stats.RecordLatency(CallStats::AlertingLatency, connection.GetSetupUpTime(), connection.GetAlertingTime());
+  }
+
+  double rFactor = -1, mos = -1;
+  if (received[RTPReceiveStats::Audio].valid && !audioCodec.IsEmpty()) {
+    rFactor = EModel(audioCodec).GetRFactor(received[RTPReceiveStats::Audio]);
+    mos = EModel::GetMOS(rFactor);
+  }
+
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    if (received[media].valid)
+      callgen.stats.RecordRTP((RTPReceiveStats::Media)media, received[media], media == RTPReceiveStats::Audio ? mos : -1);
+  }
+
+  if (audioComparison.compared) {
+    callgen.stats.RecordComparison(audioComparison);
+    if (audioComparison.aligned) {
+      PStringStream info;
+      info << "Compared audio: delay=" << audioComparison.delay << "ms"
+              " correlation=" << setprecision(2) << setiosflags(ios::fixed) << audioComparison.correlation <<
+              " SNR=" << setprecision(1) << audioComparison.snr << "dB"
+              " clipped=" << audioComparison.clipped <<
+              " dropouts=" << audioComparison.dropouts << " (" << audioComparison.dropoutTime << "ms)";
+      OUTPUT("", connection.GetCallToken(), info);
+    }
+    else {
+      OUTPUT("", connection.GetCallToken(), "Compared audio: outgoing message not found");
+    }
+  }
+
+  if (callgen.cdrWriter == NULL && !callgen.cdrToParent)
+    return;
+
+  PTime setupTime = connection.GetSetupUpTime();
+
+  CDRRecord record;
+  record.setupTime = setupTime.GetTimeInSeconds()*1000 + setupTime.GetMicrosecond()/1000;
+  record.duration = (connection.GetConnectionEndTime() - setupTime).GetMilliSeconds();
+  if (openedTransmitMedia.IsValid())
+    record.transmitMediaOpen = (openedTransmitMedia - setupTime).GetMilliSeconds();
+  if (openedReceiveMedia.IsValid())
+    record.receiveMediaOpen = (openedReceiveMedia - setupTime).GetMilliSeconds();
+  if (receivedMedia.IsValid())
+    record.mediaReceived = (receivedMedia - setupTime).GetMilliSeconds();
+  if (connection.GetAlertingTime().IsValid())
+    record.alerting = (connection.GetAlertingTime() - setupTime).GetMilliSeconds();
+  if (connection.GetConnectionStartTime().IsValid())
+    record.connect = (connection.GetConnectionStartTime() - setupTime).GetMilliSeconds();
+  record.endReason = connection.GetCallEndReason();
+  record.remoteParty = connection.GetRemotePartyName();
+  record.signalingGateway = connection.GetRemotePartyAddress();
+  record.mediaGateway = mediaGateway;
+  record.callId = connection.GetCallIdentifier().AsString();
+  record.callToken = connection.GetCallToken();
+
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++)
+    record.received[media] = received[media];
+  record.rFactor = rFactor;
+  record.mos = mos;
+
+  callgen.WriteCDR(record);
+}
+
+void CallDetail::OnEstablished(const H323Connection & connection)
+{
+  CallStats & stats = CallGen::Current().stats;
+  stats.RecordLatency(CallStats::ConnectLatency, connection.GetSetupUpTime(), connection.GetConnectionStartTime());
+  if (!recordedAlerting) {
+    recordedAlerting = true;
+    stats.RecordLatency(CallStats::AlertingLatency, connection.GetSetupUpTime(), connection.GetAlertingTime());
+  }
+}
+
+void CallDetail::OnRTPStatistics(const RTP_Session & session, const H323Connection & connection)
+{
+  const PString & token = connection.GetCallToken();
+
+  RTPReceiveStats::Media media;
+  if (RTPReceiveStats::GetMedia(session.GetSessionID(), media) && session.GetPacketsReceived() > 0)
+    received[media].Update(session);
+
+  if (session.GetSessionID() == 1 && !receivedAudio) {
+    receivedAudio = true;
+    CallGen::Current().stats.Increment(CallStats::ReceivedAudio);
+    OUTPUT("", token, "Received audio");
+  }
+  if (session.GetSessionID() == 2 && !receivedVideo) {
+    receivedVideo = true;
+    CallGen::Current().stats.Increment(CallStats::ReceivedVideo);
+    OUTPUT("", token, "Received video");
+  }
+  if (receivedMedia.GetTimeInSeconds() == 0 && session.GetPacketsReceived() > 0) {
+    receivedMedia = PTime();
+    CallGen::Current().stats.RecordLatency(CallStats::FirstMediaLatency, connection.GetSetupUpTime(), receivedMedia);
+
+    const RTP_UDP * udpSess = dynamic_cast<const RTP_UDP *>(&session);
+    if (udpSess != NULL)
+      mediaGateway = H323TransportAddress(udpSess->GetRemoteAddress(), udpSess->GetRemoteDataPort());
+  }
+}
+
+// the first packet of a channel without an RTP session, eg. video that isn't decoded
+void CallDetail::OnMediaReceived(RTPReceiveStats::Media media, const H323TransportAddress & from, const H323Connection & connection)
+{
+  const PString & token = connection.GetCallToken();
+
+  if (media == RTPReceiveStats::Audio && !receivedAudio) {
+    receivedAudio = true;
+    CallGen::Current().stats.Increment(CallStats::ReceivedAudio);
+    OUTPUT("", token, "Received audio");
+  }
+  if (media == RTPReceiveStats::Video && !receivedVideo) {
+    receivedVideo = true;
+    CallGen::Current().stats.Increment(CallStats::ReceivedVideo);
+    OUTPUT("", token, "Received video");
+  }
+  if (receivedMedia.GetTimeInSeconds() == 0) {
+    receivedMedia = PTime();
+    CallGen::Current().stats.RecordLatency(CallStats::FirstMediaLatency, connection.GetSetupUpTime(), receivedMedia);
+    mediaGateway = from;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// file header and record layout of --cdr-format binary, all little endian
+struct BinaryCDRHeader
+{
+  char     magic[8];
+  PUInt32l version;
+  PUInt32l recordSize;
+};
+
+struct BinaryCDR
+{
+  PInt64l  setupTime;
+  PInt32l  duration;
+  PInt32l  transmitMediaOpen;
+  PInt32l  receiveMediaOpen;
+  PInt32l  mediaReceived;
+  PInt32l  alerting;
+  PInt32l  connect;
+  PUInt16l endReason;
+  PUInt16l flags;              // bit n set if media n was received
+  char     remoteParty[56];
+  char     signalingGateway[48];
+  char     mediaGateway[40];
+  char     callId[40];
+  char     callToken[36];
+  struct {
+    PUInt32l packets;
+    PUInt32l octets;
+    PUInt32l lost;
+    PUInt32l outOfOrder;
+    PUInt32l late;
+    PUInt32l avgJitter;
+    PUInt32l maxJitter;
+  }        received[RTPReceiveStats::NumMedia];
+  PUInt16l rFactor;            // of the received audio * 100, 0 if unknown
+  PUInt16l mos;                // * 100, 0 if unknown
+  BYTE     reserved[4];
+};
+
+typedef char BinaryCDRHeaderSizeCheck[sizeof(BinaryCDRHeader) == CDRRecord::BinaryHeaderSize ? 1 : -1];
+typedef char BinaryCDRSizeCheck[sizeof(BinaryCDR) == CDRRecord::BinaryRecordSize ? 1 : -1];
+
+static const char BinaryCDRMagic[8] = { 'C', 'G', '3', '2', '3', 'C', 'D', 'R' };
+static const unsigned BinaryCDRVersion = 2;
+
+static const char * const CDRFormatNames[CDRRecord::NumFormats] = { "csv", "json", "binary" };
+
+PBoolean CDRRecord::ParseFormat(const PString & name, Formats & format)
+{
+  for (int i = 0; i < NumFormats; i++) {
+    if (name *= CDRFormatNames[i]) {
+      format = (Formats)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+CDRRecord::CDRRecord()
+  : setupTime(0),
+    duration(0),
+    transmitMediaOpen(-1),
+    receiveMediaOpen(-1),
+    mediaReceived(-1),
+    alerting(-1),
+    connect(-1),
+    endReason(H323Connection::NumCallEndReasons),
+    rFactor(-1),
+    mos(-1)
+{
+}
+
+PBYTEArray CDRRecord::GetHeader(Formats format)
+{
+  switch (format) {
+    case CSV : {
+      static const char header[] = "Call Start Time,"
+                                   "Total duration,"
+                                   "Media open transmit time,"
+                                   "Media open received time,"
+                                   "Media received time,"
+                                   "ALERTING time,"
+                                   "CONNECT time,"
+                                   "Call End Reason,"
+                                   "Remote party,"
+                                   "Signaling gateway,"
+                                   "Media gateway,"
+                                   "Call Id,"
+                                   "Call Token,"
+                                   "Audio packets,"
+                                   "Audio octets,"
+                                   "Audio lost,"
+                                   "Audio out of order,"
+                                   "Audio late,"
+                                   "Audio average jitter,"
+                                   "Audio maximum jitter,"
+                                   "Video packets,"
+                                   "Video octets,"
+                                   "Video lost,"
+                                   "Video out of order,"
+                                   "Video late,"
+                                   "Video average jitter,"
+                                   "Video maximum jitter,"
+                                   "Audio R-factor,"
+                                   "Audio MOS\n";
+      return PBYTEArray((const BYTE *)header, sizeof(header)-1);
+    }
+
+    case Binary : {
+      BinaryCDRHeader header;
+      memcpy(header.magic, BinaryCDRMagic, sizeof(header.magic));
+      header.version = BinaryCDRVersion;
+      header.recordSize = BinaryRecordSize;
+      return PBYTEArray((const BYTE *)&header, sizeof(header));
+    }
+
+    default :
+      return PBYTEArray();
+  }
+}
+
+void CDRRecord::Encode(Formats format, PBYTEArray & data) const
+{
+  if (format == Binary) {
+    AsBinary(data.GetPointer(BinaryRecordSize));
+    return;
+  }
+
+  PString line = format == JSON ? AsJSON() : AsCSV();
+  PINDEX length = line.GetLength();
+  BYTE * ptr = data.GetPointer(length+1);
+  memcpy(ptr, (const char *)line, length);
+  ptr[length] = '\n';
+}
+
+static void PrintCSVTime(ostream & strm, PInt64 ms)
+{
+  if (ms >= 0)
+    strm << PTimeInterval(ms);
+  strm << ',';
+}
+
+PString CDRRecord::AsCSV() const
+{
+  PStringStream line;
+  line << PTime((time_t)(setupTime/1000), (long)(setupTime%1000)*1000).AsString("yyyy/M/d hh:mm:ss") << ','
+       << setprecision(1) << PTimeInterval(duration) << ',';
+  PrintCSVTime(line, transmitMediaOpen);
+  PrintCSVTime(line, receiveMediaOpen);
+  PrintCSVTime(line, mediaReceived);
+  PrintCSVTime(line, alerting);
+  PrintCSVTime(line, connect);
+  line << (H323Connection::CallEndReason)endReason << ','
+       << remoteParty << ','
+       << signalingGateway << ','
+       << mediaGateway << ','
+       << callId << ','
+       << callToken;
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    const RTPReceiveStats & stats = received[media];
+    if (stats.valid)
+      line << ',' << stats.packets << ',' << stats.octets << ',' << stats.lost << ',' << stats.outOfOrder
+           << ',' << stats.late << ',' << stats.avgJitter << ',' << stats.maxJitter;
+    else
+      line << ",,,,,,,";
+  }
+  line << setprecision(2) << setiosflags(ios::fixed) << ',';
+  if (rFactor >= 0)
+    line << rFactor;
+  line << ',';
+  if (mos >= 0)
+    line << mos;
+  return line;
+}
+
+static void PrintJSONString(ostream & strm, const char * key, const PString & value)
+{
+  strm << ",\"" << key << "\":\"";
+  for (const char * ptr = value; *ptr != '\0'; ptr++) {
+    switch (*ptr) {
+      case '"' :
+        strm << "\\\"";
+        break;
+      case '\\' :
+        strm << "\\\\";
+        break;
+      default :
+        if ((unsigned char)*ptr < ' ')
+          strm << psprintf("\\u%04x", (unsigned char)*ptr);
+        else
+          strm << *ptr;
+    }
+  }
+  strm << '"';
+}
+
+static void PrintJSONTime(ostream & strm, const char * key, PInt64 ms)
+{
+  strm << ",\"" << key << "\":";
+  if (ms >= 0)
+    strm << ms;
+  else
+    strm << "null";
+}
+
+PString CDRRecord::AsJSON() const
+{
+  PStringStream reason;
+  reason << (H323Connection::CallEndReason)endReason;
+
+  PStringStream line;
+  line << "{\"start\":" << setupTime
+       << ",\"duration\":" << duration;
+  PrintJSONTime(line, "transmit_media_open", transmitMediaOpen);
+  PrintJSONTime(line, "receive_media_open", receiveMediaOpen);
+  PrintJSONTime(line, "media_received", mediaReceived);
+  PrintJSONTime(line, "alerting", alerting);
+  PrintJSONTime(line, "connect", connect);
+  line << ",\"end_code\":" << endReason;
+  PrintJSONString(line, "end_reason", reason);
+  PrintJSONString(line, "remote_party", remoteParty);
+  PrintJSONString(line, "signaling_gateway", signalingGateway);
+  PrintJSONString(line, "media_gateway", mediaGateway);
+  PrintJSONString(line, "call_id", callId);
+  PrintJSONString(line, "call_token", callToken);
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    const RTPReceiveStats & stats = received[media];
+    const char * name = media == RTPReceiveStats::Audio ? "audio" : "video";
+    if (stats.valid)
+      line << ",\"" << name << "_packets\":" << stats.packets
+           << ",\"" << name << "_octets\":" << stats.octets
+           << ",\"" << name << "_lost\":" << stats.lost
+           << ",\"" << name << "_out_of_order\":" << stats.outOfOrder
+           << ",\"" << name << "_late\":" << stats.late
+           << ",\"" << name << "_jitter_avg\":" << stats.avgJitter
+           << ",\"" << name << "_jitter_max\":" << stats.maxJitter;
+  }
+  if (rFactor >= 0)
+    line << setprecision(2) << setiosflags(ios::fixed)
+         << ",\"audio_r\":" << rFactor << ",\"audio_mos\":" << mos;
+  line << '}';
+  return line;
+}
+
+static void SetBinaryString(char * field, size_t size, const PString & value)
+{
+  memset(field, 0, size);
+  strncpy(field, value, size-1);
+}
+
+static int GetBinaryTime(PInt64 ms)
+{
+  return ms < 0 ? -1 : (ms > 0x7fffffff ? 0x7fffffff : (int)ms);
+}
+
+void CDRRecord::AsBinary(BYTE * data) const
+{
+  BinaryCDR & cdr = *(BinaryCDR *)data;
+  cdr.setupTime = setupTime;
+  cdr.duration = GetBinaryTime(duration);
+  cdr.transmitMediaOpen = GetBinaryTime(transmitMediaOpen);
+  cdr.receiveMediaOpen = GetBinaryTime(receiveMediaOpen);
+  cdr.mediaReceived = GetBinaryTime(mediaReceived);
+  cdr.alerting = GetBinaryTime(alerting);
+  cdr.connect = GetBinaryTime(connect);
+  cdr.endReason = (WORD)endReason;
+  cdr.flags = 0;
+  SetBinaryString(cdr.remoteParty, sizeof(cdr.remoteParty), remoteParty);
+  SetBinaryString(cdr.signalingGateway, sizeof(cdr.signalingGateway), signalingGateway);
+  SetBinaryString(cdr.mediaGateway, sizeof(cdr.mediaGateway), mediaGateway);
+  SetBinaryString(cdr.callId, sizeof(cdr.callId), callId);
+  SetBinaryString(cdr.callToken, sizeof(cdr.callToken), callToken);
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    const RTPReceiveStats & stats = received[media];
+    if (stats.valid)
+      cdr.flags = cdr.flags | (1 << media);
+    cdr.received[media].packets = stats.packets;
+    cdr.received[media].octets = stats.octets;
+    cdr.received[media].lost = stats.lost;
+    cdr.received[media].outOfOrder = stats.outOfOrder;
+    cdr.received[media].late = stats.late;
+    cdr.received[media].avgJitter = stats.avgJitter;
+    cdr.received[media].maxJitter = stats.maxJitter;
+  }
+  cdr.rFactor = rFactor > 0 ? (WORD)(rFactor*100 + 0.5) : 0;
+  cdr.mos = mos > 0 ? (WORD)(mos*100 + 0.5) : 0;
+  memset(cdr.reserved, 0, sizeof(cdr.reserved));
+}
+
+void CDRRecord::FromBinary(const BYTE * data)
+{
+  const BinaryCDR & cdr = *(const BinaryCDR *)data;
+  setupTime = cdr.setupTime;
+  duration = (int)cdr.duration;
+  transmitMediaOpen = (int)cdr.transmitMediaOpen;
+  receiveMediaOpen = (int)cdr.receiveMediaOpen;
+  mediaReceived = (int)cdr.mediaReceived;
+  alerting = (int)cdr.alerting;
+  connect = (int)cdr.connect;
+  endReason = cdr.endReason;
+  remoteParty = PString(cdr.remoteParty, strnlen(cdr.remoteParty, sizeof(cdr.remoteParty)));
+  signalingGateway = PString(cdr.signalingGateway, strnlen(cdr.signalingGateway, sizeof(cdr.signalingGateway)));
+  mediaGateway = PString(cdr.mediaGateway, strnlen(cdr.mediaGateway, sizeof(cdr.mediaGateway)));
+  callId = PString(cdr.callId, strnlen(cdr.callId, sizeof(cdr.callId)));
+  callToken = PString(cdr.callToken, strnlen(cdr.callToken, sizeof(cdr.callToken)));
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    RTPReceiveStats & stats = received[media];
+    stats.valid = (cdr.flags & (1 << media)) != 0;
+    stats.packets = cdr.received[media].packets;
+    stats.octets = cdr.received[media].octets;
+    stats.lost = cdr.received[media].lost;
+    stats.outOfOrder = cdr.received[media].outOfOrder;
+    stats.late = cdr.received[media].late;
+    stats.avgJitter = cdr.received[media].avgJitter;
+    stats.maxJitter = cdr.received[media].maxJitter;
+  }
+  rFactor = cdr.rFactor > 0 ? cdr.rFactor / 100.0 : -1;
+  mos = cdr.mos > 0 ? cdr.mos / 100.0 : -1;
+}
+
+PBoolean CDRRecord::IsBinaryHeader(const BYTE * data)
+{
+  const BinaryCDRHeader & header = *(const BinaryCDRHeader *)data;
+  return memcmp(header.magic, BinaryCDRMagic, sizeof(header.magic)) == 0 &&
+         header.version == BinaryCDRVersion &&
+         header.recordSize == BinaryRecordSize;
+}
+
+// CSV times are printed as [[h:]m]:s.s
+static PInt64 ParseCSVTime(const PString & field)
+{
+  if (field.IsEmpty())
+    return -1;
+
+  double seconds = 0;
+  PStringArray parts = field.Tokenise(":");
+  for (PINDEX i = 0; i < parts.GetSize(); i++)
+    seconds = seconds*60 + parts[i].AsReal();
+  return (PInt64)(seconds*1000 + 0.5);
+}
+
+static PBoolean ParseCallEndReason(const PString & name, unsigned & reason)
+{
+  static PStringToOrdinal reasons;
+  static PMutex mutex;
+  PWaitAndSignal lock(mutex);
+
+  if (reasons.IsEmpty()) {
+    for (int r = 0; r < H323Connection::NumCallEndReasons; r++) {
+      PStringStream str;
+      str << (H323Connection::CallEndReason)r;
+      reasons.SetAt(str, r);
+    }
+  }
+
+  if (!reasons.Contains(name))
+    return FALSE;
+  reason = (unsigned)reasons[name];
+  return TRUE;
+}
+
+PBoolean CDRRecord::FromCSV(const PString & line)
+{
+  static const PINDEX ReceivedFields = 7*RTPReceiveStats::NumMedia;
+  static const PINDEX QualityFields = 2;
+
+  PStringArray fields = line.Tokenise(",", TRUE);
+  if (fields.GetSize() < 13 + ReceivedFields + QualityFields)
+    return FALSE;
+
+  PTime time(fields[0]);
+  if (!time.IsValid())
+    return FALSE;
+
+  setupTime = time.GetTimeInSeconds()*1000;
+  duration = ParseCSVTime(fields[1]);
+  transmitMediaOpen = ParseCSVTime(fields[2]);
+  receiveMediaOpen = ParseCSVTime(fields[3]);
+  mediaReceived = ParseCSVTime(fields[4]);
+  alerting = ParseCSVTime(fields[5]);
+  connect = ParseCSVTime(fields[6]);
+  if (!ParseCallEndReason(fields[7], endReason))
+    return FALSE;
+
+  // the remote party name may contain commas, so take the rest from the end
+  PINDEX quality = fields.GetSize() - QualityFields;
+  rFactor = fields[quality].IsEmpty() ? -1 : fields[quality].AsReal();
+  mos = fields[quality+1].IsEmpty() ? -1 : fields[quality+1].AsReal();
+
+  PINDEX first = quality - ReceivedFields;
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    RTPReceiveStats & stats = received[media];
+    PINDEX f = first + 7*media;
+    stats.valid = !fields[f].IsEmpty();
+    stats.packets = fields[f].AsUnsigned();
+    stats.octets = fields[f+1].AsUnsigned();
+    stats.lost = fields[f+2].AsUnsigned();
+    stats.outOfOrder = fields[f+3].AsUnsigned();
+    stats.late = fields[f+4].AsUnsigned();
+    stats.avgJitter = fields[f+5].AsUnsigned();
+    stats.maxJitter = fields[f+6].AsUnsigned();
+  }
+
+  PINDEX last = first-1;
+  callToken = fields[last];
+  callId = fields[last-1];
+  mediaGateway = fields[last-2];
+  signalingGateway = fields[last-3];
+  remoteParty = PString::Empty();
+  for (PINDEX i = 8; i < last-3; i++) {
+    if (i > 8)
+      remoteParty += ',';
+    remoteParty += fields[i];
+  }
+  return TRUE;
+}
+
+// value of a key in a flat JSON object as written by AsJSON()
+static const char * FindJSONValue(const char * line, const char * key)
+{
+  size_t keyLength = strlen(key);
+  for (const char * ptr = strchr(line, '"'); ptr != NULL; ptr = strchr(ptr+1, '"')) {
+    if (strncmp(ptr+1, key, keyLength) == 0 && ptr[keyLength+1] == '"' && ptr[keyLength+2] == ':')
+      return ptr + keyLength + 3;
+  }
+  return NULL;
+}
+
+static PBoolean GetJSONTime(const char * line, const char * key, PInt64 & value)
+{
+  const char * ptr = FindJSONValue(line, key);
+  if (ptr == NULL)
+    return FALSE;
+  value = *ptr == 'n' ? -1 : strtoll(ptr, NULL, 10);
+  return TRUE;
+}
+
+static double GetJSONReal(const char * line, const char * key)
+{
+  const char * ptr = FindJSONValue(line, key);
+  if (ptr == NULL || *ptr == 'n')
+    return -1;
+  return strtod(ptr, NULL);
+}
+
+static PString GetJSONString(const char * line, const char * key)
+{
+  const char * ptr = FindJSONValue(line, key);
+  if (ptr == NULL || *ptr++ != '"')
+    return PString::Empty();
+
+  PString value;
+  while (*ptr != '\0' && *ptr != '"') {
+    if (*ptr == '\\' && ptr[1] != '\0') {
+      ptr++;
+      if (*ptr == 'u' && strlen(ptr) >= 5) {
+        value += (char)strtoul(PString(ptr+1, 4), NULL, 16);
+        ptr += 4;
+      }
+      else if (*ptr == 'n')
+        value += '\n';
+      else if (*ptr == 't')
+        value += '\t';
+      else
+        value += *ptr;
+    }
+    else
+      value += *ptr;
+    ptr++;
+  }
+  return value;
+}
+
+PBoolean CDRRecord::FromJSON(const PString & line)
+{
+  PInt64 code;
+  if (!GetJSONTime(line, "start", setupTime) ||
+      !GetJSONTime(line, "duration", duration) ||
+      !GetJSONTime(line, "transmit_media_open", transmitMediaOpen) ||
+      !GetJSONTime(line, "receive_media_open", receiveMediaOpen) ||
+      !GetJSONTime(line, "media_received", mediaReceived) ||
+      !GetJSONTime(line, "alerting", alerting) ||
+      !GetJSONTime(line, "connect", connect) ||
+      !GetJSONTime(line, "end_code", code))
+    return FALSE;
+
+  endReason = (unsigned)code;
+  remoteParty = GetJSONString(line, "remote_party");
+  signalingGateway = GetJSONString(line, "signaling_gateway");
+  mediaGateway = GetJSONString(line, "media_gateway");
+  callId = GetJSONString(line, "call_id");
+  callToken = GetJSONString(line, "call_token");
+
+  for (int media = 0; media < RTPReceiveStats::NumMedia; media++) {
+    RTPReceiveStats & stats = received[media];
+    PString name = media == RTPReceiveStats::Audio ? "audio" : "video";
+    PInt64 values[7];
+    stats.valid = GetJSONTime(line, name + "_packets", values[0]) &&
+                  GetJSONTime(line, name + "_octets", values[1]) &&
+                  GetJSONTime(line, name + "_lost", values[2]) &&
+                  GetJSONTime(line, name + "_out_of_order", values[3]) &&
+                  GetJSONTime(line, name + "_late", values[4]) &&
+                  GetJSONTime(line, name + "_jitter_avg", values[5]) &&
+                  GetJSONTime(line, name + "_jitter_max", values[6]);
+    if (stats.valid) {
+      stats.packets = (DWORD)values[0];
+      stats.octets = (DWORD)values[1];
+      stats.lost = (DWORD)values[2];
+      stats.outOfOrder = (DWORD)values[3];
+      stats.late = (DWORD)values[4];
+      stats.avgJitter = (DWORD)values[5];
+      stats.maxJitter = (DWORD)values[6];
+    }
+  }
+
+  rFactor = GetJSONReal(line, "audio_r");
+  mos = GetJSONReal(line, "audio_mos");
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+CDRAnalyzer::CDRAnalyzer()
+  : records(0),
+    established(0),
+    invalid(0),
+    totalDuration(0),
+    firstSetup(0),
+    lastSetup(0)
+{
+  memset(cleared, 0, sizeof(cleared));
+  memset(failed, 0, sizeof(failed));
+}
+
+PBoolean CDRAnalyzer::Analyze(const PFilePath & filename, PString & error)
+{
+  PFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    error = file.GetErrorText();
+    return FALSE;
+  }
+
+  BinaryCDRHeader header;
+  if (file.Read(&header, sizeof(header)) && file.GetLastReadCount() == sizeof(header) && CDRRecord::IsBinaryHeader((const BYTE *)&header))
+    return AnalyzeBinary(file, error);
+
+  file.Close();
+
+  PTextFile text;
+  if (!text.Open(filename, PFile::ReadOnly)) {
+    error = text.GetErrorText();
+    return FALSE;
+  }
+  return AnalyzeText(text, error);
+}
+
+PBoolean CDRAnalyzer::AnalyzeBinary(PFile & file, PString & error)
+{
+  // large reads, records are decoded straight from the buffer
+  static const PINDEX RecordsPerRead = 4096;
+  PBYTEArray buffer(RecordsPerRead*CDRRecord::BinaryRecordSize);
+
+  CDRRecord record;
+  for (;;) {
+    if (!file.Read(buffer.GetPointer(), buffer.GetSize())) {
+      if (file.GetErrorCode(PChannel::LastReadError) != PChannel::NoError) {
+        error = file.GetErrorText(PChannel::LastReadError);
+        return FALSE;
+      }
+    }
+
+    PINDEX count = file.GetLastReadCount() / CDRRecord::BinaryRecordSize;
+    for (PINDEX i = 0; i < count; i++) {
+      record.FromBinary(buffer.GetPointer() + i*CDRRecord::BinaryRecordSize);
+      Add(record);
+    }
+
+    if (file.GetLastReadCount() < buffer.GetSize()) {
+      if (file.GetLastReadCount() % CDRRecord::BinaryRecordSize != 0)
+        invalid++;   // incomplete last record
+      return TRUE;
+    }
+  }
+}
+
+PBoolean CDRAnalyzer::AnalyzeText(PTextFile & file, PString & error)
+{
+  CDRRecord record;
+  PString line;
+  while (file.ReadLine(line)) {
+    if (line.IsEmpty() || line.NumCompare("Call Start Time,") == PObject::EqualTo)
+      continue;
+
+    if (line[0] == '{' ? record.FromJSON(line) : record.FromCSV(line))
+      Add(record);
+    else
+      invalid++;
+  }
+
+  if (file.GetErrorCode(PChannel::LastReadError) != PChannel::NoError) {
+    error = file.GetErrorText(PChannel::LastReadError);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void CDRAnalyzer::Add(const CDRRecord & record)
+{
+  records++;
+
+  PTime setup((time_t)(record.setupTime/1000), (long)(record.setupTime%1000)*1000);
+  if (records == 1 || setup < firstSetup)
+    firstSetup = setup;
+  if (records == 1 || setup > lastSetup)
+    lastSetup = setup;
+
+  if (record.connect >= 0) {
+    established++;
+    totalDuration += record.duration - record.connect;
+  }
+
+  if (record.endReason < H323Connection::NumCallEndReasons) {
+    cleared[record.endReason]++;
+    if (record.connect < 0)
+      failed[record.endReason]++;
+  }
+
+  if (record.alerting >= 0)
+    latencies[CallStats::AlertingLatency].Add(PTimeInterval(record.alerting));
+  if (record.connect >= 0)
+    latencies[CallStats::ConnectLatency].Add(PTimeInterval(record.connect));
+  if (record.transmitMediaOpen >= 0)
+    latencies[CallStats::TransmitMediaLatency].Add(PTimeInterval(record.transmitMediaOpen));
+  if (record.receiveMediaOpen >= 0)
+    latencies[CallStats::ReceiveMediaLatency].Add(PTimeInterval(record.receiveMediaOpen));
+  if (record.mediaReceived >= 0)
+    latencies[CallStats::FirstMediaLatency].Add(PTimeInterval(record.mediaReceived));
+  if (record.mos > 0)
+    mos.Add(record.mos);
+}
+
+void CDRAnalyzer::PrintOn(ostream & strm) const
+{
+  strm << "Records: " << records;
+  if (invalid > 0)
+    strm << " (" << invalid << " invalid skipped)";
+  strm << '\n';
+  if (records == 0)
+    return;
+
+  strm << "First call: " << firstSetup.AsString("yyyy/M/d hh:mm:ss") << '\n'
+       << "Last call:  " << lastSetup.AsString("yyyy/M/d hh:mm:ss") << '\n'
+       << "Established: " << established
+       << " ASR=" << setprecision(2) << setiosflags(ios::fixed) << 100.0*established/records << '%';
+  if (established > 0)
+    strm << " average duration=" << PTimeInterval((PInt64)(totalDuration/established));
+  strm << resetiosflags(ios::fixed) << setprecision(6) << '\n';
+
+  strm << "Call end reasons           cleared  failed\n";
+  for (int r = 0; r < H323Connection::NumCallEndReasons; r++) {
+    if (cleared[r] == 0)
+      continue;
+    PStringStream name;
+    name << (H323Connection::CallEndReason)r;
+    strm << "  " << setw(24) << left << name << right
+         << setw(8) << cleared[r]
+         << setw(8) << failed[r] << '\n';
+  }
+
+  CallStats::PrintLatencies(strm, latencies);
+  mos.PrintOn(strm);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MyH323EndPoint::MyH323EndPoint()
+{
+  // load plugins for H.460.17, .18 etc.
+  LoadBaseFeatureSet();
+
+  useJitterBuffer = false; // save a little processing time
+
+  AddAllCapabilities(0, P_MAX_INDEX, "*");
+  AddAllUserInputCapabilities(0, P_MAX_INDEX);
+  SetPerCallBandwidth(384);
+  SetFrameRate(30);
+  m_maxFrameSize = H323Capability::i1080MPI;
+  SetFuzzing(false);
+  SetReplay(false);
+  SetSignalingOnly(false);
+  m_fuzzSeed = 0;
+  m_fuzzSeeded = false;
+  SetFuzzCapture(PString(), 100);
+  SetPercentBadRTPHeader(50);
+  SetPercentBadRTPMedia(0);
+  SetPercentBadRTCP(5);
+#ifdef H323_VIDEO
+  SetVideoDecode(1);
+#endif
+  SetStartH239(false);
+  SetH239Delay(1);
+  SetH239Duration(-1);
+}
+
+PBoolean MyH323EndPoint::SetVideoFrameSize(H323Capability::CapabilityFrameSize frameSize, int frameUnits)
+{
+  m_maxFrameSize = frameSize;
+  return H323EndPoint::SetVideoFrameSize(frameSize, frameUnits);
+}
+
+MyH323EndPoint::~MyH323EndPoint()
+{
+  for (map<PString, EncodedMedia *>::iterator it = m_encodedMessages.begin(); it != m_encodedMessages.end(); ++it)
+    delete it->second;
+#ifdef H323_VIDEO
+  for (map<PString, EncodedVideo *>::iterator it = m_encodedVideos.begin(); it != m_encodedVideos.end(); ++it)
+    delete it->second;
+#endif
+}
+
+// the address of the first listener, for the media of the external RTP channels
+PIPSocket::Address MyH323EndPoint::GetListenerAddress() const
+{
+  PIPSocket::Address myip;
+  const H323ListenerList & listeners = GetListeners();
+  if (listeners.GetSize() > 0)
+    listeners[0].GetTransportAddress().GetIpAddress(myip);
+  return myip;
+}
+
+// the first call with a codec encodes the message, all others share it
+const EncodedMedia * MyH323EndPoint::GetEncodedMessage(const H323Capability & capability)
+{
+  PWaitAndSignal lock(m_encodedMutex);
+
+  PString name = capability.GetFormatName();
+  map<PString, EncodedMedia *>::iterator it = m_encodedMessages.find(name);
+  if (it != m_encodedMessages.end())
+    return it->second;
+
+  EncodedMedia * media = new EncodedMedia;
+  if (!media->Encode(capability, CallGen::Current().outgoingMessage)) {
+    PTRACE(2, "CallGen\tCannot replay " << name << ", encoding every call");
+    delete media;
+    media = NULL;
+  }
+  m_encodedMessages[name] = media;
+  return media;
+}
+
+#ifdef H323_VIDEO
+// the largest stream for the codec that is not larger than --maxframe,
+// loaded by the first call and shared by all others
+const EncodedVideo * MyH323EndPoint::GetEncodedVideo(const H323Capability & capability)
+{
+  static const struct {
+    const char * name;
+    H323Capability::CapabilityFrameSize size;
+  } frameSizes[] = {
+    { "1080i", H323Capability::i1080MPI },
+    { "720p",  H323Capability::p720MPI },
+    { "480i",  H323Capability::i480MPI },
+    { "16cif", H323Capability::cif16MPI },
+    { "4cif",  H323Capability::cif4MPI },
+    { "cif",   H323Capability::cifMPI },
+    { "qcif",  H323Capability::qcifMPI }
+  };
+
+  EncodedVideo::Packetization packetization;
+  if (!EncodedVideo::GetPacketization(capability.GetFormatName(), packetization))
+    return NULL;
+
+  PFilePath filename;
+  for (unsigned i = 0; i < PARRAYSIZE(frameSizes); i++) {
+    if (frameSizes[i].size <= m_maxFrameSize) {
+      PFilePath candidate = m_videoReplayDir + EncodedVideo::GetFileName(packetization, frameSizes[i].name);
+      if (PFile::Exists(candidate)) {
+        filename = candidate;
+        break;
+      }
+    }
+  }
+  if (filename.IsEmpty()) {
+    PTRACE(2, "CallGen\tNo pre-encoded video for " << capability.GetFormatName() << ", encoding every call");
+    return NULL;
+  }
+
+  PWaitAndSignal lock(m_encodedMutex);
+
+  // the RFC 2190 and RFC 4629 packetizations of the same file are different
+  PString key = filename + psprintf("#%u", packetization);
+  map<PString, EncodedVideo *>::iterator it = m_encodedVideos.find(key);
+  if (it != m_encodedVideos.end())
+    return it->second;
+
+  EncodedVideo * video = new EncodedVideo;
+  PString error;
+  if (!video->Load(filename, packetization, error)) {
+    PTRACE(1, "CallGen\tPre-encoded video \"" << filename << "\" " << error << ", encoding every call");
+    delete video;
+    video = NULL;
+  }
+  m_encodedVideos[key] = video;
+  return video;
+}
+
+// with --video-decode n only every n-th incoming video channel gets a codec
+bool MyH323EndPoint::IsVideoDecode()
+{
+  if (m_videoDecode == 0)
+    return false;
+  return ++m_videoReceivers % m_videoDecode == 0;
+}
+#endif
+
+H323Connection * MyH323EndPoint::CreateConnection(unsigned callReference)
+{
+  return new MyH323Connection(*this, callReference);
+}
+
+static PString TidyRemotePartyName(const H323Connection & connection)
+{
+  PString name = connection.GetRemotePartyName();
+
+  PINDEX bracket = name.FindLast('[');
+  if (bracket == 0 || bracket == P_MAX_INDEX)
+    return name;
+
+  return name.Left(bracket).Trim();
+}
+
+void MyH323EndPoint::OnConnectionEstablished(H323Connection & connection, const PString & token)
+{
+  CallStats & stats = CallGen::Current().stats;
+  stats.Increment(CallStats::Established);
+  ((MyH323Connection&)connection).details.OnEstablished(connection);
+  OUTPUT("", token, "Established \"" << TidyRemotePartyName(connection) << "\""
+                    " " << connection.GetControlChannel().GetRemoteAddress() <<
+                    " active=" << connectionsActive.GetSize() <<
+                    " total=" << stats.Get(CallStats::Established));
+}
+
+void MyH323EndPoint::OnConnectionCleared(H323Connection & connection, const PString & token)
+{
+  CallGen::Current().stats.OnCleared(connection.GetCallEndReason(), connection.GetConnectionStartTime().IsValid());
+  OUTPUT("", token, "Cleared \"" << TidyRemotePartyName(connection) << "\""
+                    " " << connection.GetControlChannel().GetRemoteAddress() <<
+                    " reason=" << connection.GetCallEndReason());
+  ((MyH323Connection&)connection).details.Drop(connection);
+}
+
+PBoolean MyH323EndPoint::OnStartLogicalChannel(H323Connection & connection, H323Channel & channel)
+{
+  bool transmitter = channel.GetDirection() == H323Channel::IsTransmitter;
+  PTime & opened = transmitter ? ((MyH323Connection&)connection).details.openedTransmitMedia
+                               : ((MyH323Connection&)connection).details.openedReceiveMedia;
+  bool first = !opened.IsValid();
+  opened = PTime();
+  if (first)
+    CallGen::Current().stats.RecordLatency(transmitter ? CallStats::TransmitMediaLatency : CallStats::ReceiveMediaLatency,
+                                           connection.GetSetupUpTime(), opened);
+
+  if (!transmitter && channel.GetSessionID() == RTP_Session::DefaultAudioSessionID)
+    ((MyH323Connection&)connection).details.audioCodec = channel.GetCapability().GetFormatName();
+
+  OUTPUT("", connection.GetCallToken(),
+         "Opened " << (channel.GetDirection() == H323Channel::IsTransmitter ? "transmitter" : "receiver")
+                   << " for " << channel.GetCapability());
+
+  return H323EndPoint::OnStartLogicalChannel(connection, channel);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MyH323Connection::MyH323Connection(MyH323EndPoint & ep, unsigned callRef)
+  : H323Connection(ep, callRef)
+  , endpoint(ep)
+  , m_callNumber(ep.GetNextCallNumber())
+  , videoChannelIn(NULL)
+  , videoChannelOut(NULL)
+  , m_isH239ready(false)
+  , m_haveStartedH239(false)
+{
+    detectInBandDTMF = FALSE; // turn off in-band DTMF detection (uses a huge amount of CPU)
+}
+
+MyH323Connection::~MyH323Connection()
+{
+    delete videoChannelIn;
+    delete videoChannelOut;
+}
+
+PBoolean MyH323Connection::OnSendSignalSetup(H323SignalPDU & setupPDU)
+{
+    // set outgoing bearer capability to unrestricted information transfer + transfer rate
+	PBYTEArray caps;
+	caps.SetSize(4);
+	caps[0] = 0x88;
+	caps[1] = 0x18;
+	caps[2] = 0x80 | endpoint.GetRateMultiplier();
+	caps[3] = 0xa5;
+	setupPDU.GetQ931().SetIE(Q931::BearerCapabilityIE, caps);
+
+    return H323Connection::OnSendSignalSetup(setupPDU);
+}
+
+H323Channel * MyH323Connection::CreateRealTimeLogicalChannel(const H323Capability & capability, H323Channel::Directions dir,
+                                                unsigned sessionID, const H245_H2250LogicalChannelParameters * param, RTP_QOS * rtpqos)
+{
+    if (endpoint.IsSignalingOnly())
+        return new SignalingOnlyChannel(endpoint, *this, capability, dir, sessionID, GetSessionPort(sessionID));
+
     if (endpoint.IsFuzzing()) {
-        WORD rtpPort = 0;
-        map<unsigned, WORD>::const_iterator iter = m_sessionPorts.find(sessionID);
-        if (iter != m_sessionPorts.end()) {
-            rtpPort = iter->second;
+        WORD rtpPort = GetSessionPort(sessionID);
+        return new RTPFuzzingChannel(endpoint, *this, capability, dir, sessionID, rtpPort, rtpPort+1);
+    }
+
+#ifdef H323_VIDEO
+    if (endpoint.IsVideoReplay() && dir == H323Channel::IsTransmitter && sessionID == RTP_Session::DefaultVideoSessionID) {
+        const EncodedVideo * video = endpoint.GetEncodedVideo(capability);
+        if (video != NULL) {
+            WORD rtpPort = endpoint.GetRtpIpPortPair();
+            return new VideoReplayChannel(endpoint, *this, capability, sessionID, *video, endpoint.GetFrameRate(), rtpPort, rtpPort+1);
+        }
+    }
+
+    if (dir == H323Channel::IsReceiver && sessionID == RTP_Session::DefaultVideoSessionID && !endpoint.IsVideoDecode())
+        return new VideoCountingChannel(endpoint, *this, capability, sessionID, GetSessionPort(sessionID));
+#endif
+
+    if (endpoint.IsReplay() && dir == H323Channel::IsTransmitter && sessionID == RTP_Session::DefaultAudioSessionID) {
+        const EncodedMedia * media = endpoint.GetEncodedMessage(capability);
+        if (media != NULL) {
+            WORD rtpPort = endpoint.GetRtpIpPortPair();
+            return new RTPReplayChannel(endpoint, *this, capability, sessionID, *media, rtpPort, rtpPort+1);
+        }
+    }
+
+    // call super class
+    return H323Connection::CreateRealTimeLogicalChannel(capability, dir, sessionID, param, rtpqos);
+}
+
+WORD MyH323Connection::GetSessionPort(unsigned sessionID)
+{
+    map<unsigned, WORD>::const_iterator iter = m_sessionPorts.find(sessionID);
+    if (iter != m_sessionPorts.end())
+        return iter->second;
+
+    WORD rtpPort = endpoint.GetRtpIpPortPair();
+    m_sessionPorts[sessionID] = rtpPort;
+    return rtpPort;
+}
+
+void MyH323Connection::OnRTPStatistics(const RTP_Session & session) const
+{
+  ((MyH323Connection *)this)->details.OnRTPStatistics(session, *this);
+}
+
+// statistics are only reported every so many packets, get the final ones
+void MyH323Connection::OnClosedLogicalChannel(const H323Channel & channel)
+{
+  RTPReceiveStats::Media media;
+  if (channel.GetDirection() == H323Channel::IsReceiver && RTPReceiveStats::GetMedia(channel.GetSessionID(), media)) {
+    RTP_Session * session = GetSession(channel.GetSessionID());
+    if (session != NULL && session->GetPacketsReceived() > 0)
+      details.received[media].Update(*session);
+  }
+
+  H323Connection::OnClosedLogicalChannel(channel);
+}
+
+PBoolean MyH323Connection::OpenAudioChannel(PBoolean isEncoding, unsigned bufferSize, H323AudioCodec & codec)
+{
+  unsigned frameDelay = bufferSize / 16; // assume 16 bit PCM
+
+  PIndirectChannel * channel;
+  if (isEncoding)
+    channel = new PlayMessage(CallGen::Current().outgoingMessage, frameDelay);
+  else {
+    PString name;
+    if (CallGen::Current().recorder != NULL) {
+      name = GetCallToken();
+      name.Replace("/", "_", TRUE);
+    }
+    channel = new RecordMessage(name, frameDelay, bufferSize,
+                                CallGen::Current().audioReference.IsEmpty() ? NULL : &details);
+  }
+
+  codec.AttachChannel(channel);
+
+  return TRUE;
+}
+
+#ifdef H323_VIDEO
+PBoolean MyH323Connection::OpenVideoChannel(PBoolean isEncoding, H323VideoCodec & codec)
+{
+  bool isH239 = false;
+#if (H323PLUS_VER >= 1271)
+  isH239 = codec.GetRTPSessionID() > 2;
+#endif
+  PString deviceName = isEncoding ? endpoint.GetVideoPattern(isH239) : "NULL";
+
+  PVideoDevice * device = isEncoding ? (PVideoDevice *)PVideoInputDevice::CreateDeviceByName(deviceName)
+                                     : (PVideoDevice *)PVideoOutputDevice::CreateDeviceByName(deviceName);
+
+  // codec needs a list of possible formats, otherwise the frame size isn't negotiated properly
+  if (isEncoding) {
+#if PTLIB_VER >= 2110
+      PVideoInputDevice::Capabilities videoCaps;
+      if (((PVideoInputDevice *)device)->GetDeviceCapabilities(deviceName, deviceDriver, &videoCaps)) {
+          codec.SetSupportedFormats(videoCaps.framesizes);
+      } else
+#endif // PTLIB_VER
+    {
+      // set fixed list of resolutions for PTLib < 2.11 and for drivers that don't provide a list
+      PVideoInputDevice::Capabilities caps;
+      PVideoFrameInfo cap;
+      cap.SetColourFormat("YUV420P");
+      cap.SetFrameRate(endpoint.GetFrameRate());
+      // sizes must be from largest to smallest
+      if (endpoint.GetMaxFrameSize() >= H323Capability::i1080MPI) {
+        cap.SetFrameSize(1920, 1080);
+        caps.framesizes.push_back(cap);
+      }
+      if (endpoint.GetMaxFrameSize() >= H323Capability::p720MPI) {
+        cap.SetFrameSize(1280, 720);
+        caps.framesizes.push_back(cap);
+      }
+      if (endpoint.GetMaxFrameSize() >= H323Capability::cif4MPI) {
+        cap.SetFrameSize(704, 576);
+        caps.framesizes.push_back(cap);
+      }
+      if (endpoint.GetMaxFrameSize() >= H323Capability::i480MPI) {
+        cap.SetFrameSize(640, 400);
+        caps.framesizes.push_back(cap);
+      }
+      cap.SetFrameSize(352, 288);
+      caps.framesizes.push_back(cap);
+      codec.SetSupportedFormats(caps.framesizes);
+    }
+  }
+
+  unsigned frameWidth = codec.GetWidth();
+  unsigned frameHeight = codec.GetHeight();
+  PTRACE(1, "Codec says:" << (isEncoding ? " OUT " : " IN ") << frameWidth << "x" << frameHeight);
+
+  if (!device ||
+	  !device->SetFrameSize(codec.GetWidth(), codec.GetHeight()) ||
+      !device->SetColourFormatConverter("YUV420P") ||
+      !device->SetFrameRate(endpoint.GetFrameRate()) ||
+      !device->Open(deviceName, TRUE)) {
+    PTRACE(1, "Failed to open or configure the video device \"" << deviceName << '"');
+    return FALSE;
+  }
+
+  device->GetFrameSize(frameWidth, frameHeight);
+  PTRACE(1, "Device says:" << (isEncoding ? " OUT " : " IN ") << frameWidth << "x" << frameHeight);
+
+  if (isEncoding && VideoPatternCache::IsCacheable(deviceName)) {
+    // all calls send the same frames, render them only once
+    const VideoPatternCache::Frames * frames =
+              endpoint.GetVideoPatternCache().GetFrames(deviceName, frameWidth, frameHeight, endpoint.GetFrameRate());
+    if (frames != NULL) {
+      videoChannelOut = new PatternVideoChannel(*frames, endpoint.GetFrameRate());
+      videoChannelOut->AttachVideoReader((PVideoInputDevice *)device);
+      return codec.AttachChannel(videoChannelOut, false);
+    }
+  }
+
+  if (isEncoding) {
+    videoChannelOut = new PVideoChannel();
+    videoChannelOut->AttachVideoReader((PVideoInputDevice *)device);
+    return codec.AttachChannel(videoChannelOut, false);
+  } else {
+    videoChannelIn = new PVideoChannel();
+    videoChannelIn->AttachVideoPlayer((PVideoOutputDevice *)device);
+    return codec.AttachChannel(videoChannelIn, false);
+  }
+}
+
+#ifdef H323_H239
+void MyH323Connection::StartH239Transmission()
+{
+    if (endpoint.IsStartH239() && !m_haveStartedH239) {
+        PTRACE(1, "Starting H.239");
+        if (OpenH239Channel()) {
+            PTRACE(1, "H.239 channel open");
+            m_haveStartedH239 = true;
+            int duration = endpoint.GetH239Duration();
+            if (duration > 0) {
+                m_h239StopTimer.SetInterval(0, duration); // stop H239 transmission after 10 sec
+                m_h239StopTimer.SetNotifier(PCREATE_NOTIFIER(StopH239TransmissionTrigger));
+            }
         } else {
-            rtpPort = endpoint.GetRtpIpPortPair();
-            m_sessionPorts[sessionID] = rtpPort;
+            PTRACE(1, "H.239 channel failed");
+        }
+    }
+}
+
+void MyH323Connection::StopH239Transmission()
+{
+  if (endpoint.IsStartH239()) {
+    PTRACE(1, "Stopping H.239");
+    CloseH239Channel();
+  }
+}
+
+void MyH323Connection::StartH239TransmissionTrigger(PTimer &, H323_INT)
+{
+    m_h239StartTimer.Stop();
+    if (m_isH239ready) {
+      StartH239Transmission();
+    }
+}
+
+void MyH323Connection::StopH239TransmissionTrigger(PTimer &, H323_INT)
+{
+    StopH239Transmission();
+}
+
+void MyH323Connection::OnEstablished()
+{
+    H323Connection::OnEstablished(); // call super class, so endpoint method OnConnectionEstablished() runs, too
+    // set a timer to start the H.239 channel if the other side didn't send a H.239 OLC by then
+    if (endpoint.IsStartH239()) {
+      int delay = endpoint.GetH239Delay();
+      m_h239StartTimer.SetInterval(0, delay); // start after 'delay' sec
+      m_h239StartTimer.SetNotifier(PCREATE_NOTIFIER(StartH239TransmissionTrigger));
+    }
+}
+
+PBoolean MyH323Connection::OnInitialFlowRestriction(H323Channel & channel)
+{
+    // start the H.239 channel after the other side has sent an OLC for H.239 and received the OLCAck
+    // TODO: this works with Polycom endpoints that open the channel at the beginning, but not with
+    //       Cisco and Radvision endpoints that only open the H.239 channel when needed
+    //       replace with other check if other endpoint supports H.239
+    if ((channel.GetCapability().GetMainType() == H323Capability::e_Video)
+        && (channel.GetCapability().GetSubType() == H245_VideoCapability::e_extendedVideoCapability)
+        && (channel.GetDirection() == H323Channel::IsReceiver)) {
+      m_isH239ready = true;
+    }
+    return true;
+}
+
+PBoolean MyH323Connection::OpenExtendedVideoChannel(PBoolean isEncoding, H323VideoCodec & codec)
+{
+    // send same test pattern as regular video channel
+    return OpenVideoChannel(isEncoding, codec);
+}
+#endif // H323_H239
+
+#endif // H323_VIDEO
+
+///////////////////////////////////////////////////////////////////////////////
+
+SignalingOnlyChannel::SignalingOnlyChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, Directions direction, unsigned sessionID, WORD rtpPort)
+    : H323_ExternalRTPChannel(connection, capability, direction, sessionID)
+{
+    // advertised in the logical channel signaling, but nothing listens there
+    PIPSocket::Address myip = ep.GetListenerAddress();
+    SetExternalAddress(H323TransportAddress(myip, rtpPort), H323TransportAddress(myip, rtpPort+1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void FuzzMutator::Mutate(BYTE * data, PINDEX size, unsigned percent)
+{
+  if (percent == 0)
+    return;
+
+  if (percent >= 100) {
+    for (PINDEX i = 0; i < size; i += 8) {
+      PUInt64 values = random.Generate();
+      for (PINDEX j = i; j < size && j < i + 8; j++, values >>= 8)
+        data[j] = (BYTE)values;
+    }
+    return;
+  }
+
+  // a byte is selected if its 32 bit random number is below the threshold
+  DWORD threshold = (DWORD)(((PUInt64)percent << 32) / 100);
+
+  DWORD selectors[BlockSize];
+  BYTE values[BlockSize];
+  for (PINDEX block = 0; block < size; block += BlockSize) {
+    for (unsigned i = 0; i < BlockSize; i += 2) {
+      PUInt64 r = random.Generate();
+      selectors[i] = (DWORD)r;
+      selectors[i+1] = (DWORD)(r >> 32);
+    }
+    for (unsigned i = 0; i < BlockSize; i += 8) {
+      PUInt64 r = random.Generate();
+      memcpy(values + i, &r, 8);
+    }
+
+    BYTE * bytes = data + block;
+    unsigned count = (unsigned)PMIN(size - block, (PINDEX)BlockSize);
+    for (unsigned i = 0; i < count; i++) {
+      BYTE mask = (BYTE)-(selectors[i] < threshold);
+      bytes[i] = (BYTE)((bytes[i] & ~mask) | (values[i] & mask));
+    }
+  }
+}
+
+static const char * const MutationNames[FuzzWeights::NumMutations] = {
+  "bytes", "flags", "csrc", "extension", "padding", "sequence", "timestamp", "payload-type",
+  "rtcp-bytes", "rtcp-length", "rtcp-order", "rtcp-reports"
+};
+
+FuzzWeights::FuzzWeights()
+{
+  for (unsigned i = 0; i < NumMutations; i++)
+    weights[i] = 0;
+  weights[RTPBytes] = 1;
+  weights[RTCPBytes] = 1;
+}
+
+// eg. "bytes=2,extension=1,rtcp-reports=1", mutations that aren't listed
+// are not used, byte overwrites if none of RTP or RTCP are listed
+PBoolean FuzzWeights::Parse(const PString & spec, PString & error)
+{
+  for (unsigned i = 0; i < NumMutations; i++)
+    weights[i] = 0;
+
+  PStringArray items = spec.Tokenise(",", FALSE);
+  for (PINDEX i = 0; i < items.GetSize(); i++) {
+    PString item = items[i].Trim();
+    PCaselessString name = item;
+    unsigned weight = 1;
+    PINDEX equals = item.Find('=');
+    if (equals != P_MAX_INDEX) {
+      name = item.Left(equals).Trim();
+      weight = item.Mid(equals+1).AsUnsigned();
+    }
+    unsigned mutation = 0;
+    while (mutation < NumMutations && name != MutationNames[mutation])
+      mutation++;
+    if (mutation == NumMutations) {
+      error = "unknown mutation " + name;
+      return FALSE;
+    }
+    weights[mutation] = weight;
+  }
+
+  unsigned rtp = 0, rtcp = 0;
+  for (unsigned i = 0; i < NumMutations; i++)
+    (i < RTCPBytes ? rtp : rtcp) += weights[i];
+  if (rtp == 0)
+    weights[RTPBytes] = 1;
+  if (rtcp == 0)
+    weights[RTCPBytes] = 1;
+  return TRUE;
+}
+
+FuzzWeights::Mutations FuzzWeights::Pick(FastRandom & random, bool rtcp) const
+{
+  unsigned first = rtcp ? RTCPBytes : RTPBytes;
+  unsigned last = rtcp ? NumMutations : RTCPBytes;
+
+  unsigned total = 0;
+  for (unsigned i = first; i < last; i++)
+    total += weights[i];
+
+  unsigned pick = random.Generate(total);
+  for (unsigned i = first; i < last; i++) {
+    if (pick < weights[i])
+      return (Mutations)i;
+    pick -= weights[i];
+  }
+  return (Mutations)first;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+FuzzCapture::FuzzCapture(PINDEX _maxPackets)
+  : maxPackets(_maxPackets),
+    next(0)
+{
+}
+
+void FuzzCapture::Add(const BYTE * data, PINDEX size, bool rtcp)
+{
+  PWaitAndSignal lock(mutex);
+
+  Packet * packet;
+  if (maxPackets == 0 || (PINDEX)packets.size() < maxPackets) {
+    packets.push_back(Packet());
+    packet = &packets.back();
+  }
+  else {
+    packet = &packets[next];
+    next = (next + 1) % maxPackets;
+  }
+
+  PTime now;
+  packet->time = now.GetTimeInSeconds()*1000000 + now.GetMicrosecond();
+  packet->rtcp = rtcp;
+  packet->size = size;
+  memcpy(packet->data.GetPointer(size), data, size);
+}
+
+// pcap file and record headers, little endian
+struct PcapHeader
+{
+  PUInt32l magic;
+  PUInt16l versionMajor;
+  PUInt16l versionMinor;
+  PInt32l  timeZone;
+  PUInt32l accuracy;
+  PUInt32l snapLength;
+  PUInt32l linkType;
+};
+
+struct PcapRecord
+{
+  PUInt32l seconds;
+  PUInt32l microseconds;
+  PUInt32l capturedLength;
+  PUInt32l length;
+};
+
+static const DWORD PcapMagic = 0xa1b2c3d4;
+static const DWORD PcapEthernet = 1;
+static const DWORD PcapRawIP = 101;
+
+// an IPv4 or IPv6 and UDP header for a packet of the capture
+static PINDEX MakeUDPHeader(BYTE * header, const H323TransportAddress & from, const H323TransportAddress & to, PINDEX size)
+{
+  PIPSocket::Address fromIP, toIP;
+  WORD fromPort = 0, toPort = 0;
+  from.GetIpAndPort(fromIP, fromPort);
+  to.GetIpAndPort(toIP, toPort);
+  bool ipv6 = toIP.GetVersion() == 6;
+  if (fromIP.GetVersion() != toIP.GetVersion())
+    fromIP = ipv6 ? PIPSocket::Address("::") : PIPSocket::Address(0, 0, 0, 0);
+
+  PINDEX ipSize = ipv6 ? 40 : 20;
+  PINDEX udpSize = 8 + size;
+  memset(header, 0, ipSize + 8);
+  if (ipv6) {
+    header[0] = 0x60;
+    header[4] = (BYTE)(udpSize >> 8);
+    header[5] = (BYTE)udpSize;
+    header[6] = 17;   // UDP
+    header[7] = 64;
+    for (PINDEX i = 0; i < 16; i++) {
+      header[8+i] = (BYTE)fromIP[i];
+      header[24+i] = (BYTE)toIP[i];
+    }
+  }
+  else {
+    PINDEX totalSize = ipSize + udpSize;
+    header[0] = 0x45;
+    header[2] = (BYTE)(totalSize >> 8);
+    header[3] = (BYTE)totalSize;
+    header[8] = 64;
+    header[9] = 17;   // UDP
+    for (PINDEX i = 0; i < 4; i++) {
+      header[12+i] = (BYTE)fromIP[i];
+      header[16+i] = (BYTE)toIP[i];
+    }
+    DWORD checksum = 0;
+    for (PINDEX i = 0; i < ipSize; i += 2)
+      checksum += (header[i] << 8) | header[i+1];
+    while (checksum > 0xffff)
+      checksum = (checksum & 0xffff) + (checksum >> 16);
+    header[10] = (BYTE)(~checksum >> 8);
+    header[11] = (BYTE)~checksum;
+  }
+
+  // no UDP checksum, the payload is only for reading
+  BYTE * udp = header + ipSize;
+  udp[0] = (BYTE)(fromPort >> 8);
+  udp[1] = (BYTE)fromPort;
+  udp[2] = (BYTE)(toPort >> 8);
+  udp[3] = (BYTE)toPort;
+  udp[4] = (BYTE)(udpSize >> 8);
+  udp[5] = (BYTE)udpSize;
+  return ipSize + 8;
+}
+
+PBoolean FuzzCapture::Write(const PFilePath & filename, const H323TransportAddress & localRTP, const H323TransportAddress & localRTCP,
+                            const H323TransportAddress & remoteRTP, const H323TransportAddress & remoteRTCP, PString & error) const
+{
+  PFile file;
+  if (!file.Open(filename, PFile::WriteOnly, PFile::Create | PFile::Truncate)) {
+    error = "could not be created";
+    return FALSE;
+  }
+
+  PcapHeader header;
+  header.magic = PcapMagic;
+  header.versionMajor = 2;
+  header.versionMinor = 4;
+  header.timeZone = 0;
+  header.accuracy = 0;
+  header.snapLength = 65535;
+  header.linkType = PcapRawIP;
+  if (!file.Write(&header, sizeof(header))) {
+    error = "could not be written";
+    return FALSE;
+  }
+
+  PWaitAndSignal lock(((FuzzCapture *)this)->mutex);
+
+  PBYTEArray data;
+  for (PINDEX i = 0; i < GetSize(); i++) {
+    const Packet & packet = (*this)[i];
+    BYTE * buffer = data.GetPointer(sizeof(PcapRecord) + 48 + packet.size);
+    PINDEX headerSize = packet.rtcp ? MakeUDPHeader(buffer + sizeof(PcapRecord), localRTCP, remoteRTCP, packet.size)
+                                    : MakeUDPHeader(buffer + sizeof(PcapRecord), localRTP, remoteRTP, packet.size);
+    memcpy(buffer + sizeof(PcapRecord) + headerSize, packet.data, packet.size);
+
+    PcapRecord record;
+    record.seconds = (DWORD)(packet.time / 1000000);
+    record.microseconds = (DWORD)(packet.time % 1000000);
+    record.capturedLength = record.length = headerSize + packet.size;
+    memcpy(buffer, &record, sizeof(record));
+
+    if (!file.Write(buffer, sizeof(record) + headerSize + packet.size)) {
+      error = "could not be written";
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+// Reads the UDP packets of a pcap file from Ethernet or raw IP, packets to
+// an odd port are taken as RTCP
+PBoolean FuzzCapture::Read(const PFilePath & filename, PString & error)
+{
+  PFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    error = "could not be opened";
+    return FALSE;
+  }
+
+  PcapHeader header;
+  if (!file.Read(&header, sizeof(header)) || file.GetLastReadCount() != sizeof(header) || header.magic != PcapMagic) {
+    error = "is not a little endian pcap file";
+    return FALSE;
+  }
+  if (header.linkType != PcapEthernet && header.linkType != PcapRawIP) {
+    error = "has no Ethernet or raw IP packets";
+    return FALSE;
+  }
+
+  packets.clear();
+  next = 0;
+  PBYTEArray buffer;
+  PcapRecord record;
+  while (file.Read(&record, sizeof(record)) && file.GetLastReadCount() == sizeof(record)) {
+    PINDEX length = record.capturedLength;
+    if (length > 262144 || !file.Read(buffer.GetPointer(length), length) || file.GetLastReadCount() != length) {
+      error = "is truncated";
+      return FALSE;
+    }
+
+    const BYTE * ip = buffer;
+    if (header.linkType == PcapEthernet) {
+      if (length < 14)
+        continue;
+      ip += 14;
+      length -= 14;
+    }
+
+    PINDEX udp;
+    if (length >= 20 && (ip[0] >> 4) == 4 && ip[9] == 17)
+      udp = (ip[0] & 0x0f)*4;
+    else if (length >= 40 && (ip[0] >> 4) == 6 && ip[6] == 17)
+      udp = 40;
+    else
+      continue;   // not UDP
+    if (udp + 8 > length)
+      continue;
+
+    Packet packet;
+    packet.time = (PInt64)record.seconds*1000000 + record.microseconds;
+    packet.rtcp = (ip[udp+3] & 1) != 0;
+    packet.size = length - udp - 8;
+    packet.data = PBYTEArray(ip + udp + 8, packet.size);
+    packets.push_back(packet);
+  }
+
+  if (packets.empty()) {
+    error = "has no UDP packets";
+    return FALSE;
+  }
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// incremented by SIGUSR1, every channel writes its capture once per request
+static volatile sig_atomic_t FuzzCaptureRequests = 0;
+
+void RTPFuzzingChannel::RequestCaptures()
+{
+    FuzzCaptureRequests++;
+}
+
+RTPFuzzingChannel::RTPFuzzingChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, Directions direction, unsigned sessionID, WORD rtpPort, WORD rtcpPort)
+    : H323_ExternalRTPChannel(connection, capability, direction, sessionID),
+      m_rtpMutator(PRandom::Number()),
+      m_rtcpMutator(PRandom::Number()),
+      m_capture(NULL),
+      m_captureRequests(FuzzCaptureRequests),
+      m_peerGone(false),
+      m_replay(NULL),
+      m_replayIndex(0)
+{
+    unsigned callNumber = ((MyH323Connection &)connection).GetCallNumber();
+    PUInt64 seed;
+    if (ep.GetFuzzSeed(seed)) {
+        // the same session of the same call always gets the same mutations
+        seed = (seed*31 + callNumber)*31 + sessionID;
+        m_rtpMutator.SetSeed(seed);
+        m_rtcpMutator.SetSeed(~seed);
+        PTRACE(2, "Fuzzing call " << callNumber << " session " << sessionID << " with seed " << seed);
+    }
+
+    if (direction == IsTransmitter) {
+        if (!ep.GetFuzzCaptureDir().IsEmpty()) {
+            m_capture = new FuzzCapture(ep.GetFuzzCaptureSize());
+            m_captureFile = ep.GetFuzzCaptureDir() + psprintf("fuzz-%u-%u.pcap", callNumber, sessionID);
+        }
+        m_replay = ep.GetFuzzReplay();
+    }
+
+    m_percentBadRTPHeader = ep.GetPercentBadRTPHeader();
+    m_percentBadRTPMedia = ep.GetPercentBadRTPMedia();
+    m_percentBadRTCP = ep.GetPercentBadRTCP();
+    m_weights = ep.GetFuzzWeights();
+    PIPSocket::Address myip = ep.GetListenerAddress();
+
+    // set the local RTP address and port
+    SetExternalAddress(H323TransportAddress(myip, rtpPort), H323TransportAddress(myip, rtcpPort));
+    // for now we ignore everything sent to these ports
+    m_rtpSocket.Listen(5, rtpPort);
+    m_rtcpSocket.Listen(5, rtcpPort);
+
+    // get the payload code
+    OpalMediaFormat format(capability.GetFormatName(), false);
+    m_payloadType = format.GetPayloadType();
+    if (m_payloadType > RTP_DataFrame::MaxPayloadType)
+        m_payloadType = RTP_DataFrame::DynamicBase;
+    m_syncSource = m_rtpMutator.GetRandom().Generate(65000);
+    m_rtpPacket.SetPayloadSize(format.GetFrameTime() * format.GetFrameSize()); // G.711: 20 ms * 8 byte
+    if (m_rtpPacket.GetPayloadSize() == 0)
+        m_rtpPacket.SetPayloadSize(1400); // eg. for video there is no fixed size
+    memset(m_rtpPacket.GetPayloadPtr(), 0, m_rtpPacket.GetPayloadSize()); // silence
+
+    m_frameTime = format.GetFrameTime();
+    if (m_frameTime == 0)
+        m_frameTime = 100;
+    m_frameTimeUnits = m_frameTime * format.GetTimeUnits();
+    if (m_frameTimeUnits == 0)
+        m_frameTimeUnits = m_frameTime * 8;
+    m_timestamp = 0;
+    PTRACE(2, "New fuzzing transmit channel: PT=" << (int)m_payloadType << " frame time=" << m_frameTime
+           << " frame size=" << m_rtpPacket.GetPayloadSize());
+}
+
+RTPFuzzingChannel::~RTPFuzzingChannel()
+{
+    m_rtpTransmitTimer.Stop();
+    m_rtcpTransmitTimer.Stop();
+    m_replayTimer.Stop();
+    m_rtpSocket.Close();
+    m_rtcpSocket.Close();
+    delete m_capture;
+}
+
+PBoolean RTPFuzzingChannel::Start()
+{
+    if (!H323_ExternalRTPChannel::Start())
+        return false;
+
+    if (GetDirection() == IsTransmitter && m_replay != NULL) {
+        PIPSocket::Address ip;
+        WORD port = 0;
+        remoteMediaAddress.GetIpAndPort(ip, port);
+        m_rtpSocket.SetSendAddress(ip, port);
+        remoteMediaControlAddress.GetIpAndPort(ip, port);
+        m_rtcpSocket.SetSendAddress(ip, port);
+        // the capture is replayed in the audio session, the others stay silent
+        if (GetSessionID() == RTP_Session::DefaultAudioSessionID) {
+            m_replayStart = PTimer::Tick();
+            m_replayTimer.SetNotifier(PCREATE_NOTIFIER(TransmitReplay));
+            m_replayTimer = PTimeInterval(1);
+        }
+    }
+    else if (GetDirection() == IsTransmitter) {
+        m_rtpTransmitTimer.RunContinuous(m_frameTime);
+        m_rtpTransmitTimer.SetNotifier(PCREATE_NOTIFIER(TransmitRTP));
+        m_rtcpTransmitTimer.RunContinuous(m_frameTime); // way more often than regular RTCP, but we want to get a lot of test cases through
+        m_rtcpTransmitTimer.SetNotifier(PCREATE_NOTIFIER(TransmitRTCP));
+        PIPSocket::Address ip;
+        WORD port = 0;
+        remoteMediaAddress.GetIpAndPort(ip, port);
+        m_rtpSocket.SetSendAddress(ip, port);
+        remoteMediaControlAddress.GetIpAndPort(ip, port);
+        m_rtcpSocket.SetSendAddress(ip, port);
+    }
+    return true;
+}
+
+void RTPFuzzingChannel::TransmitRTP(PTimer &, H323_INT)
+{
+    // start from a plain header, the mutated CSRC count or extension bit of
+    // the last packet would move the payload beyond the end of the buffer
+    m_rtpPacket[0] = 0x80;
+    m_rtpPacket.SetMarker(false);
+    m_rtpPacket.SetPayloadType(m_payloadType);
+    m_rtpPacket.SetSyncSource(m_syncSource);
+    m_timestamp += m_frameTimeUnits;
+    m_rtpPacket.SetTimestamp(m_timestamp);
+    m_rtpPacket.SetSequenceNumber(m_rtpPacket.GetSequenceNumber() + 1);
+
+    // random RTP media
+    BYTE * header = m_rtpPacket.GetPointer();
+    PINDEX payloadSize = m_rtpPacket.GetPayloadSize();
+    m_rtpMutator.Mutate(header + RTP_DataFrame::MinHeaderSize, payloadSize, m_percentBadRTPMedia);
+
+    FuzzWeights::Mutations mutation = m_weights.Pick(m_rtpMutator.GetRandom(), false);
+    PTRACE(2, "Sending fuzzed RTP to " << remoteMediaControlAddress << " payload type=" << m_rtpPacket.GetPayloadType()
+           << " mutation=" << MutationNames[mutation]);
+    if (mutation == FuzzWeights::RTPBytes) {
+        // overwrite n% of the bytes with random values
+        m_rtpMutator.Mutate(header, RTP_DataFrame::MinHeaderSize, m_percentBadRTPHeader);
+        Send(header, RTP_DataFrame::MinHeaderSize + payloadSize, false);
+    }
+    else {
+        PINDEX size = MutateRTP(mutation, payloadSize);
+        Send(m_rtpBuffer, size, false);
+    }
+}
+
+static void PutWord(BYTE * data, unsigned value)
+{
+    data[0] = (BYTE)(value >> 8);
+    data[1] = (BYTE)value;
+}
+
+static void PutDWord(BYTE * data, DWORD value)
+{
+    PutWord(data, value >> 16);
+    PutWord(data + 2, value);
+}
+
+// a false length or count in one of four packets
+static unsigned MaybeFalse(FastRandom & random, unsigned value, unsigned range)
+{
+    return random.Generate(4) == 0 ? random.Generate(range) : value;
+}
+
+// The plain header and payload of m_rtpPacket with one field changed, into m_rtpBuffer
+PINDEX RTPFuzzingChannel::MutateRTP(FuzzWeights::Mutations mutation, PINDEX payloadSize)
+{
+    FastRandom & random = m_rtpMutator.GetRandom();
+    const BYTE * header = m_rtpPacket.GetPointer();
+    // 15 CSRCs, 255 words of extension and 255 bytes padding at most
+    BYTE * packet = m_rtpBuffer.GetPointer(RTP_DataFrame::MinHeaderSize + 60 + 4 + 4*255 + payloadSize + 255);
+    memcpy(packet, header, RTP_DataFrame::MinHeaderSize);
+    PINDEX size = RTP_DataFrame::MinHeaderSize;
+
+    switch (mutation) {
+        case FuzzWeights::RTPFlags :
+            // mostly version 2, so the other bits get looked at
+            packet[0] = (BYTE)random.Generate(256);
+            if (random.Generate(4) != 0)
+                packet[0] = (BYTE)((packet[0] & 0x3f) | 0x80);
+            break;
+
+        case FuzzWeights::RTPCSRC :
+        {
+            unsigned count = random.Generate(16);
+            packet[0] = (BYTE)(0x80 | MaybeFalse(random, count, 16));
+            for (unsigned i = 0; i < count; i++, size += 4)
+                PutDWord(packet + size, (DWORD)random.Generate());
+            break;
+        }
+
+        case FuzzWeights::RTPExtension :
+        {
+            // RFC 8285 one or two byte elements or any profile, the elements are random
+            static const unsigned Profiles[] = { 0xbede, 0x1000, 0 };
+            unsigned profile = Profiles[random.Generate(PARRAYSIZE(Profiles))];
+            if (profile == 0x1000)
+                profile |= random.Generate(16);
+            else if (profile == 0)
+                profile = random.Generate(65536);
+            unsigned words = random.Generate(random.Generate(8) == 0 ? 256 : 16);
+            packet[0] |= 0x10;
+            PutWord(packet + size, profile);
+            PutWord(packet + size + 2, MaybeFalse(random, words, 65536));
+            size += 4;
+            for (unsigned i = 0; i < words; i++, size += 4)
+                PutDWord(packet + size, (DWORD)random.Generate());
+            break;
+        }
+
+        case FuzzWeights::RTPPadding :
+            break;   // after the payload
+
+        case FuzzWeights::RTPSequence :
+        {
+            // duplicates and reordering, losses or anywhere
+            WORD sequence = m_rtpPacket.GetSequenceNumber();
+            switch (random.Generate(3)) {
+                case 0 :  sequence -= (WORD)random.Generate(16); break;
+                case 1 :  sequence += (WORD)(2 + random.Generate(1000)); break;
+                default : sequence = (WORD)random.Generate(65536);
+            }
+            m_rtpPacket.SetSequenceNumber(sequence);
+            PutWord(packet + 2, sequence);
+            break;
+        }
+
+        case FuzzWeights::RTPTimestamp :
+        {
+            // back, far ahead or anywhere, the following packets continue from there
+            switch (random.Generate(3)) {
+                case 0 :  m_timestamp -= random.Generate(100*m_frameTimeUnits + 1); break;
+                case 1 :  m_timestamp += random.Generate(0x80000000U); break;
+                default : m_timestamp = (DWORD)random.Generate();
+            }
+            m_rtpPacket.SetTimestamp(m_timestamp);
+            PutDWord(packet + 4, m_timestamp);
+            break;
+        }
+
+        case FuzzWeights::RTPPayloadType :
+            // includes 72-76, which RFC 5761 reserves to tell RTCP from RTP
+            packet[1] = (BYTE)random.Generate(256);
+            break;
+
+        default :
+            break;
+    }
+
+    memcpy(packet + size, header + RTP_DataFrame::MinHeaderSize, payloadSize);
+    size += payloadSize;
+
+    if (mutation == FuzzWeights::RTPPadding) {
+        unsigned padding = 1 + random.Generate(255);
+        memset(packet + size, 0, padding);
+        size += padding;
+        packet[0] |= 0x20;
+        packet[size-1] = (BYTE)MaybeFalse(random, padding, 256);
+    }
+
+    return size;
+}
+
+static const unsigned SecondsFrom1900to1970 = (70*365+17)*24*60*60U;
+
+void RTPFuzzingChannel::TransmitRTCP(PTimer &, H323_INT)
+{
+    FuzzWeights::Mutations mutation = m_weights.Pick(m_rtcpMutator.GetRandom(), true);
+    if (mutation != FuzzWeights::RTCPBytes) {
+        PINDEX size = MutateRTCP(mutation);
+        PTRACE(2, "Sending fuzzed RTCP to " << remoteMediaControlAddress << " mutation=" << MutationNames[mutation]);
+        Send(m_rtcpBuffer, size, true);
+        return;
+    }
+
+    RTP_ControlFrame m_rtcpPacket;
+
+    m_rtcpPacket.SetPayloadType(RTP_ControlFrame::e_SenderReport);
+    m_rtcpPacket.SetPayloadSize(sizeof(RTP_ControlFrame::SenderReport));
+
+    RTP_ControlFrame::SenderReport * sender = (RTP_ControlFrame::SenderReport *)m_rtcpPacket.GetPayloadPtr();
+    sender->ssrc = m_syncSource;
+    PTime now;
+    sender->ntp_sec = now.GetTimeInSeconds() + SecondsFrom1900to1970; // Convert from 1970 to 1900
+    sender->ntp_frac = now.GetMicrosecond() * 4294; // Scale microseconds to "fraction" from 0 to 2^32
+    sender->rtp_ts = m_timestamp;
+    sender->psent = m_rtpPacket.GetSequenceNumber();
+    sender->osent = m_rtpPacket.GetSequenceNumber() * m_rtpPacket.GetPayloadSize();
+    // receiver report blocks are sent by the rtcp-reports mutation
+    m_rtcpPacket.WriteNextCompound();
+    (void)m_rtcpPacket.AddSourceDescription(m_syncSource);
+
+    // send random RTCP packet every time
+    m_rtcpMutator.Mutate(m_rtcpPacket.GetPointer(), m_rtcpPacket.GetCompoundSize(), m_percentBadRTCP);
+
+    PTRACE(2, "Sending fuzzed RTCP to " << remoteMediaControlAddress);
+    Send(m_rtcpPacket.GetPointer(), m_rtcpPacket.GetCompoundSize(), true);
+}
+
+// A compound RTCP packet with one mutation into m_rtcpBuffer
+PINDEX RTPFuzzingChannel::MutateRTCP(FuzzWeights::Mutations mutation)
+{
+    FastRandom & random = m_rtcpMutator.GetRandom();
+    vector<PBYTEArray> packets;
+
+    // SR, or RR with report blocks about random sources
+    unsigned blocks = mutation == FuzzWeights::RTCPReports ? 1 + random.Generate(31) : 0;
+    bool sender = mutation != FuzzWeights::RTCPReports || random.Generate(2) == 0;
+    PINDEX size = 8 + (sender ? 20 : 0) + blocks*24;
+    PBYTEArray report(size);
+    report[0] = (BYTE)(0x80 | (blocks > 0 ? MaybeFalse(random, blocks, 32) : 0));
+    report[1] = (BYTE)(sender ? RTP_ControlFrame::e_SenderReport : RTP_ControlFrame::e_ReceiverReport);
+    PutWord(report.GetPointer() + 2, size/4 - 1);
+    PutDWord(report.GetPointer() + 4, m_syncSource);
+    BYTE * block = report.GetPointer() + 8;
+    if (sender) {
+        PTime now;
+        PutDWord(block, now.GetTimeInSeconds() + SecondsFrom1900to1970);
+        PutDWord(block + 4, now.GetMicrosecond() * 4294);
+        PutDWord(block + 8, m_timestamp);
+        PutDWord(block + 12, m_rtpPacket.GetSequenceNumber());
+        PutDWord(block + 16, m_rtpPacket.GetSequenceNumber() * m_rtpPacket.GetPayloadSize());
+        block += 20;
+    }
+    for (unsigned i = 0; i < blocks; i++, block += 24) {
+        // SSRC, fraction and cumulative lost, highest sequence, jitter, LSR and DLSR
+        for (unsigned j = 0; j < 24; j += 4)
+            PutDWord(block + j, (DWORD)random.Generate());
+    }
+    packets.push_back(report);
+
+    // SDES with the CNAME
+    static const char CName[] = "callgen323";
+    PBYTEArray sdes((8 + 2 + sizeof(CName)-1 + 1 + 3) & ~3);
+    sdes[0] = 0x81;
+    sdes[1] = (BYTE)RTP_ControlFrame::e_SourceDescription;
+    PutWord(sdes.GetPointer() + 2, sdes.GetSize()/4 - 1);
+    PutDWord(sdes.GetPointer() + 4, m_syncSource);
+    sdes[8] = 1;   // CNAME
+    sdes[9] = (BYTE)(sizeof(CName)-1);
+    memcpy(sdes.GetPointer() + 10, CName, sizeof(CName)-1);
+    packets.push_back(sdes);
+
+    if (mutation == FuzzWeights::RTCPOrder) {
+        // BYE with a reason and APP, then all in any order, maybe twice
+        static const char Reason[] = "fuzzing";
+        PBYTEArray bye((8 + 1 + sizeof(Reason)-1 + 3) & ~3);
+        bye[0] = 0x81;
+        bye[1] = (BYTE)RTP_ControlFrame::e_Goodbye;
+        PutWord(bye.GetPointer() + 2, bye.GetSize()/4 - 1);
+        PutDWord(bye.GetPointer() + 4, m_syncSource);
+        bye[8] = (BYTE)(sizeof(Reason)-1);
+        memcpy(bye.GetPointer() + 9, Reason, sizeof(Reason)-1);
+        packets.push_back(bye);
+
+        PINDEX appSize = 12 + 4*random.Generate(16);
+        PBYTEArray app(appSize);
+        app[0] = (BYTE)(0x80 | random.Generate(32));
+        app[1] = (BYTE)RTP_ControlFrame::e_ApplDefined;
+        PutWord(app.GetPointer() + 2, appSize/4 - 1);
+        PutDWord(app.GetPointer() + 4, m_syncSource);
+        for (PINDEX i = 8; i < appSize; i += 4)
+            PutDWord(app.GetPointer() + i, (DWORD)random.Generate());
+        packets.push_back(app);
+
+        if (random.Generate(2) == 0) {
+            PBYTEArray duplicate = packets[random.Generate(packets.size())];
+            packets.push_back(duplicate);
+        }
+        for (size_t i = packets.size() - 1; i > 0; i--)
+            swap(packets[i], packets[random.Generate(i + 1)]);
+    }
+
+    if (mutation == FuzzWeights::RTCPLength) {
+        // too short, too long by a little or a lot, or zero
+        PBYTEArray & packet = packets[random.Generate(packets.size())];
+        unsigned length = packet.GetSize()/4 - 1;
+        switch (random.Generate(4)) {
+            case 0 :  length = length > 0 ? length - 1 : 0xffff; break;
+            case 1 :  length++; break;
+            case 2 :  length = 0; break;
+            default : length = random.Generate(65536);
+        }
+        PutWord(packet.GetPointer() + 2, length);
+    }
+
+    size = 0;
+    for (size_t i = 0; i < packets.size(); i++)
+        size += packets[i].GetSize();
+    BYTE * compound = m_rtcpBuffer.GetPointer(size);
+    for (size_t i = 0; i < packets.size(); i++) {
+        memcpy(compound, packets[i], packets[i].GetSize());
+        compound += packets[i].GetSize();
+    }
+    return size;
+}
+
+// resend the captured packets with the gaps they were captured with
+void RTPFuzzingChannel::TransmitReplay(PTimer &, H323_INT)
+{
+    PInt64 elapsed = (PTimer::Tick() - m_replayStart).GetMilliSeconds();
+    PInt64 start = (*m_replay)[0].time;
+
+    while (m_replayIndex < m_replay->GetSize()) {
+        const FuzzCapture::Packet & packet = (*m_replay)[m_replayIndex];
+        PInt64 offset = (packet.time - start)/1000;
+        if (offset > elapsed) {
+            m_replayTimer = PTimeInterval(offset - elapsed);
+            return;
+        }
+        Send(packet.data, packet.size, packet.rtcp);
+        m_replayIndex++;
+    }
+
+    OUTPUT("", connection.GetCallToken(), "Replayed " << m_replayIndex << " captured packets");
+}
+
+void RTPFuzzingChannel::Send(const BYTE * data, PINDEX size, bool rtcp)
+{
+    PUDPSocket & socket = rtcp ? m_rtcpSocket : m_rtpSocket;
+    if (m_capture != NULL)
+        m_capture->Add(data, size, rtcp);
+
+    if (!socket.Write(data, size) && !m_peerGone) {
+        m_peerGone = true;
+        WriteCapture("the peer is unreachable");
+    }
+    else if (m_captureRequests != FuzzCaptureRequests) {
+        m_captureRequests = FuzzCaptureRequests;
+        WriteCapture("requested");
+    }
+}
+
+void RTPFuzzingChannel::Close()
+{
+    m_rtpTransmitTimer.Stop();
+    m_rtcpTransmitTimer.Stop();
+    m_replayTimer.Stop();
+
+    // the peer probably crashed if the signaling connection broke
+    H323Connection::CallEndReason reason = connection.GetCallEndReason();
+    if (!m_peerGone && (reason == H323Connection::EndedByTransportFail || reason == H323Connection::EndedByConnectFail)) {
+        m_peerGone = true;
+        WriteCapture("the call failed");
+    }
+
+    H323_ExternalRTPChannel::Close();
+}
+
+void RTPFuzzingChannel::WriteCapture(const char * reason)
+{
+    if (m_capture == NULL)
+        return;
+
+    PString error;
+    if (m_capture->Write(m_captureFile, externalMediaAddress, externalMediaControlAddress, remoteMediaAddress, remoteMediaControlAddress, error)) {
+        OUTPUT("", connection.GetCallToken(), "Wrote the last " << m_capture->GetSize() << " fuzzed packets to " << m_captureFile << ", " << reason);
+    }
+    else
+        PTRACE(1, "Fuzzing capture \"" << m_captureFile << "\" " << error);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+MediaPacer::MediaPacer()
+  : PThread(1000, NoAutoDeleteThread, HighestPriority, "MediaPacer"),
+    currentTick(0),
+    running(true)
+{
+  Resume();
+}
+
+MediaPacer::~MediaPacer()
+{
+  Stop();
+}
+
+void MediaPacer::Add(Client & client, unsigned period, unsigned divisor)
+{
+  PWaitAndSignal lock(mutex);
+
+  if (client.m_pacePeriod != 0)
+    return;
+
+  client.m_pacePeriod = PMAX(period, 1U);
+  client.m_paceDivisor = PMAX(divisor, 1U);
+  client.m_paceStart = currentTick*TickTime;
+  client.m_paceCount = 0;
+  Schedule(client);
+}
+
+// the tick nearest to the exact time of the next call, at least the next one
+void MediaPacer::Schedule(Client & client)
+{
+  PUInt64 due = client.m_paceStart + (client.m_paceCount + 1)*client.m_pacePeriod/client.m_paceDivisor;
+  client.m_paceDue = PMAX((due + TickTime/2) / TickTime, currentTick + 1);
+  wheel[client.m_paceDue % WheelSize].push_back(&client);
+}
+
+// once this returns the client is not called any more
+void MediaPacer::Remove(Client & client)
+{
+  PWaitAndSignal lock(mutex);
+
+  if (client.m_pacePeriod == 0)
+    return;
+
+  client.m_pacePeriod = 0;
+  vector<Client *> & slot = wheel[client.m_paceDue % WheelSize];
+  vector<Client *>::iterator it = find(slot.begin(), slot.end(), &client);
+  if (it != slot.end())
+    slot.erase(it);
+}
+
+void MediaPacer::Stop()
+{
+  mutex.Wait();
+  bool wasRunning = running;
+  running = false;
+  mutex.Signal();
+
+  if (wasRunning)
+    WaitForTermination();
+}
+
+MediaPacer::Stats MediaPacer::GetStats() const
+{
+  PWaitAndSignal lock(mutex);
+  return total;
+}
+
+MediaPacer::Stats MediaPacer::GetIntervalStats()
+{
+  PWaitAndSignal lock(mutex);
+  Stats stats = interval;
+  interval = Stats();
+  return stats;
+}
+
+void MediaPacer::Main()
+{
+  PTimeInterval nextTick = PTimer::Tick();
+  for (;;) {
+    nextTick += TickTime;
+    PTimeInterval now = PTimer::Tick();
+    if (nextTick > now)
+      PThread::Sleep(nextTick - now);
+
+    PTimeInterval start = PTimer::Tick();
+
+    PWaitAndSignal lock(mutex);
+    if (!running)
+      break;
+
+    ProcessTick();
+
+    unsigned late = start > nextTick ? (unsigned)(start - nextTick).GetMilliSeconds() : 0;
+    unsigned busy = (unsigned)(PTimer::Tick() - start).GetMilliSeconds();
+    total.ticks++;
+    interval.ticks++;
+    if (late + busy >= TickTime) {
+      total.overruns++;
+      interval.overruns++;
+      PTRACE(5, "CallGen\tMedia pacing tick " << currentTick << " overran: " << late << "ms late, " << busy << "ms busy");
+    }
+    total.maxLate = PMAX(total.maxLate, late);
+    interval.maxLate = PMAX(interval.maxLate, late);
+    total.maxBusy = PMAX(total.maxBusy, busy);
+    interval.maxBusy = PMAX(interval.maxBusy, busy);
+  }
+}
+
+void MediaPacer::ProcessTick()
+{
+  currentTick++;
+
+  vector<Client *> due;
+  due.swap(wheel[currentTick % WheelSize]);
+
+  for (size_t i = 0; i < due.size(); i++) {
+    Client & client = *due[i];
+    if (client.m_pacePeriod == 0)
+      continue;   // removed by an earlier client of this tick
+
+    if (client.m_paceDue != currentTick) {
+      // due in a later turn of the wheel
+      wheel[currentTick % WheelSize].push_back(&client);
+      continue;
+    }
+
+    client.OnPace();
+
+    // unless it removed itself
+    if (client.m_pacePeriod != 0) {
+      client.m_paceCount++;
+      Schedule(client);
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// the outgoing message as raw audio for the encoder, without delay,
+// padded with silence at its end
+class MessageReader : public PChannel
+{
+    PCLASSINFO(MessageReader, PChannel);
+  public:
+    MessageReader(const OutgoingMessage & message)
+      : m_message(message), m_offset(0) { }
+
+    virtual PBoolean IsOpen() const { return TRUE; }
+
+    virtual PBoolean Read(void * buf, PINDEX len)
+    {
+      PINDEX count = PMIN(len, m_message.GetSize() - m_offset);
+      memcpy(buf, m_message.GetData() + m_offset, count);
+      memset((BYTE *)buf + count, 0, len - count);
+      m_offset += count;
+      lastReadCount = len;
+      return TRUE;
+    }
+
+    PBoolean IsAtEnd() const { return m_offset >= m_message.GetSize(); }
+
+  protected:
+    const OutgoingMessage & m_message;
+    PINDEX m_offset;
+};
+
+EncodedMedia::EncodedMedia()
+  : duration(0),
+    packetTime(0),
+    payloadType(RTP_DataFrame::IllegalPayloadType)
+{
+}
+
+PBoolean EncodedMedia::Encode(const H323Capability & capability, const OutgoingMessage & message)
+{
+  if (message.IsEmpty())
+    return FALSE;
+
+  OpalMediaFormat format(capability.GetFormatName(), false);
+  payloadType = format.GetPayloadType();
+
+  H323Codec * codec = capability.CreateCodec(H323Codec::Encoder);
+  H323AudioCodec * audioCodec = dynamic_cast<H323AudioCodec *>(codec);
+  if (audioCodec == NULL) {
+    delete codec;
+    return FALSE;
+  }
+
+  // every frame must be sent to keep the timestamps right
+  audioCodec->SetSilenceDetectionMode(H323AudioCodec::NoSilenceDetection);
+  MessageReader * reader = new MessageReader(message);
+  audioCodec->AttachChannel(reader);
+
+  unsigned framesInPacket = capability.GetTxFramesInPacket();
+  if (framesInPacket == 0)
+    framesInPacket = 1;
+  unsigned maxFrameSize = format.GetFrameSize();
+  if (maxFrameSize == 0)
+    maxFrameSize = 1400;
+  unsigned frameTime = format.GetFrameTime();
+  if (frameTime == 0)
+    frameTime = audioCodec->GetFrameRate();
+
+  RTP_DataFrame frame(maxFrameSize*framesInPacket);
+  PBYTEArray buffer(maxFrameSize*framesInPacket);
+  DWORD timestamp = 0;
+  while (!reader->IsAtEnd()) {
+    Packet packet;
+    packet.timestamp = timestamp;
+
+    PINDEX size = 0;
+    for (unsigned i = 0; i < framesInPacket; i++) {
+      unsigned length = maxFrameSize;
+      if (!audioCodec->Read(buffer.GetPointer() + size, length, frame)) {
+        PTRACE(2, "CallGen\tEncoding outgoing message with " << capability.GetFormatName() << " failed");
+        delete codec;
+        return FALSE;
+      }
+      size += length;
+      timestamp += frameTime;
+    }
+
+    packet.payload = PBYTEArray(buffer, size);
+    packets.push_back(packet);
+  }
+
+  duration = timestamp;
+  packetTime = frameTime*framesInPacket / (format.GetTimeUnits() > 0 ? format.GetTimeUnits() : 8);
+  if (packetTime == 0)
+    packetTime = 20;
+
+  delete codec;
+
+  PTRACE(2, "CallGen\tEncoded outgoing message with " << capability.GetFormatName() << ": "
+         << packets.size() << " packets of " << packetTime << "ms");
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+RTPReplayChannel::RTPReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID, const EncodedMedia & media, WORD rtpPort, WORD rtcpPort)
+    : H323_ExternalRTPChannel(connection, capability, IsTransmitter, sessionID),
+      m_media(&media),
+      m_packetTime(media.GetPacketTime()),
+      m_packetTimeDivisor(1),
+      m_index(0),
+      m_packetsSent(0),
+      m_octetsSent(0)
+{
+    OpenSockets(ep, rtpPort, rtcpPort);
+    m_payloadType = media.GetPayloadType();
+}
+
+RTPReplayChannel::RTPReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID,
+                                   RTP_DataFrame::PayloadTypes payloadType, unsigned packetTime, unsigned divisor, WORD rtpPort, WORD rtcpPort)
+    : H323_ExternalRTPChannel(connection, capability, IsTransmitter, sessionID),
+      m_media(NULL),
+      m_packetTime(packetTime),
+      m_packetTimeDivisor(divisor),
+      m_index(0),
+      m_packetsSent(0),
+      m_octetsSent(0)
+{
+    OpenSockets(ep, rtpPort, rtcpPort);
+    m_payloadType = payloadType;
+}
+
+void RTPReplayChannel::OpenSockets(MyH323EndPoint & ep, WORD rtpPort, WORD rtcpPort)
+{
+    PIPSocket::Address myip = ep.GetListenerAddress();
+
+    // set the local RTP address and port
+    SetExternalAddress(H323TransportAddress(myip, rtpPort), H323TransportAddress(myip, rtcpPort));
+    // we send from these ports and ignore everything sent to them
+    m_rtpSocket.Listen(5, rtpPort);
+    m_rtcpSocket.Listen(5, rtcpPort);
+
+    m_syncSource = PRandom::Number();
+    m_timestampBase = PRandom::Number();
+    m_rtpPacket.SetSequenceNumber((WORD)PRandom::Number(65535));
+}
+
+RTPReplayChannel::~RTPReplayChannel()
+{
+    CallGen::Current().pacer->Remove(*this);
+    m_rtcpTransmitTimer.Stop();
+    m_rtpSocket.Close();
+    m_rtcpSocket.Close();
+}
+
+PBoolean RTPReplayChannel::Start()
+{
+    if (!H323_ExternalRTPChannel::Start())
+        return false;
+
+    // use the payload type negotiated for this call
+    if (GetDynamicRTPPayloadType() != RTP_DataFrame::IllegalPayloadType)
+        m_payloadType = GetDynamicRTPPayloadType();
+    if (m_payloadType > RTP_DataFrame::MaxPayloadType)
+        m_payloadType = RTP_DataFrame::DynamicBase;
+
+    PIPSocket::Address ip;
+    WORD port = 0;
+    remoteMediaAddress.GetIpAndPort(ip, port);
+    m_rtpSocket.SetSendAddress(ip, port);
+    remoteMediaControlAddress.GetIpAndPort(ip, port);
+    m_rtcpSocket.SetSendAddress(ip, port);
+
+    PTRACE(3, "Replaying encoded message to " << remoteMediaAddress << " PT=" << (int)m_payloadType);
+
+    CallGen::Current().pacer->Add(*this, m_packetTime, m_packetTimeDivisor);
+    m_rtcpTransmitTimer.SetNotifier(PCREATE_NOTIFIER(TransmitRTCP));
+    m_rtcpTransmitTimer.RunContinuous(5000);
+    return true;
+}
+
+void RTPReplayChannel::Close()
+{
+    CallGen::Current().pacer->Remove(*this);
+    m_rtcpTransmitTimer.Stop();
+    H323_ExternalRTPChannel::Close();
+}
+
+void RTPReplayChannel::SendRTP(const PBYTEArray & payload, DWORD timestamp, bool marker)
+{
+    m_rtpPacket.SetPayloadType(m_payloadType);
+    m_rtpPacket.SetSyncSource(m_syncSource);
+    m_rtpPacket.SetTimestamp(timestamp);
+    m_rtpPacket.SetSequenceNumber(m_rtpPacket.GetSequenceNumber() + 1);
+    m_rtpPacket.SetMarker(marker);
+    m_rtpPacket.SetPayloadSize(payload.GetSize());
+    memcpy(m_rtpPacket.GetPayloadPtr(), payload, payload.GetSize());
+
+    m_rtpSocket.Write(m_rtpPacket, m_rtpPacket.GetHeaderSize() + m_rtpPacket.GetPayloadSize());
+    m_packetsSent++;
+    m_octetsSent += payload.GetSize();
+}
+
+void RTPReplayChannel::OnPace()
+{
+    const EncodedMedia::Packet & packet = (*m_media)[m_index];
+
+    // the marker starts the talk spurt
+    SendRTP(packet.payload, m_timestampBase + packet.timestamp, m_packetsSent == 0);
+
+    // loop through the message with continuous timestamps
+    if (++m_index >= m_media->GetSize()) {
+        m_index = 0;
+        m_timestampBase += m_media->GetDuration();
+    }
+}
+
+void RTPReplayChannel::TransmitRTCP(PTimer &, H323_INT)
+{
+    const unsigned SecondsFrom1900to1970 = (70*365+17)*24*60*60U;
+    RTP_ControlFrame rtcpPacket;
+
+    rtcpPacket.SetPayloadType(RTP_ControlFrame::e_SenderReport);
+    rtcpPacket.SetPayloadSize(sizeof(RTP_ControlFrame::SenderReport));
+
+    RTP_ControlFrame::SenderReport * sender = (RTP_ControlFrame::SenderReport *)rtcpPacket.GetPayloadPtr();
+    sender->ssrc = m_syncSource;
+    PTime now;
+    sender->ntp_sec = now.GetTimeInSeconds() + SecondsFrom1900to1970; // Convert from 1970 to 1900
+    sender->ntp_frac = now.GetMicrosecond() * 4294; // Scale microseconds to "fraction" from 0 to 2^32
+    sender->rtp_ts = m_rtpPacket.GetTimestamp();
+    sender->psent = m_packetsSent;
+    sender->osent = m_octetsSent;
+
+    rtcpPacket.WriteNextCompound();
+    (void)rtcpPacket.AddSourceDescription(m_syncSource);
+
+    m_rtcpSocket.Write(rtcpPacket, rtcpPacket.GetCompoundSize());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef H323_VIDEO
+
+// RTP payloads stay below a typical MTU
+static const PINDEX MaxVideoPayload = 1200;
+
+PBoolean EncodedVideo::GetPacketization(const PString & formatName, Packetization & packetization)
+{
+  if (formatName.Find("H.264") != P_MAX_INDEX)
+    packetization = H264;
+  else if (formatName.Find("H.263") != P_MAX_INDEX)
+    packetization = formatName.Find("1998") != P_MAX_INDEX || formatName.Find("+") != P_MAX_INDEX ||
+                    formatName.Find("H.263p") != P_MAX_INDEX ? H263Plus : H263;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+// eg. h264-720p.264
+PString EncodedVideo::GetFileName(Packetization packetization, const char * frameSize)
+{
+  return packetization == H264 ? psprintf("h264-%s.264", frameSize) : psprintf("h263-%s.263", frameSize);
+}
+
+PBoolean EncodedVideo::Load(const PFilePath & filename, Packetization packetization, PString & error)
+{
+  PFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    error = "could not be opened";
+    return FALSE;
+  }
+
+  PBYTEArray data;
+  PINDEX size = (PINDEX)file.GetLength();
+  if (!file.Read(data.GetPointer(size), size) || file.GetLastReadCount() != size) {
+    error = "could not be read";
+    return FALSE;
+  }
+
+  if (packetization == H264)
+    AddH264(data, size);
+  else
+    AddH263(data, size, packetization == H263Plus);
+
+  if (frames.empty() || !frames[0].keyFrame) {
+    error = "does not start with a key frame";
+    return FALSE;
+  }
+
+  PTRACE(2, "CallGen\tLoaded pre-encoded video \"" << filename << "\", " << frames.size() << " frames");
+  return TRUE;
+}
+
+// Annex B byte stream, an access unit ends before the first slice of the next
+// picture or the parameter sets, SEI or delimiter that precede it
+void EncodedVideo::AddH264(const BYTE * data, PINDEX size)
+{
+  vector<PINDEX> starts;   // of the NAL units, after their start codes
+  for (PINDEX i = 0; i + 3 <= size; i++) {
+    if (data[i] == 0 && data[i+1] == 0 && data[i+2] == 1) {
+      starts.push_back(i + 3);
+      i += 2;
+    }
+  }
+
+  bool hasSlice = false;
+  for (size_t n = 0; n < starts.size(); n++) {
+    const BYTE * nal = data + starts[n];
+    PINDEX length = (n + 1 < starts.size() ? starts[n+1] - 3 : size) - starts[n];
+    while (length > 0 && nal[length-1] == 0)   // zero_byte of the next start code or trailing zeros
+      length--;
+    if (length < 2)
+      continue;
+
+    BYTE type = nal[0] & 0x1f;
+    bool slice = type >= 1 && type <= 5;
+    // first_mb_in_slice is 0 when its Exp-Golomb code is the single bit 1
+    if (frames.empty() || (hasSlice && (!slice || (nal[1] & 0x80) != 0))) {
+      frames.push_back(Frame());
+      frames.back().keyFrame = false;
+      hasSlice = false;
+    }
+    Frame & frame = frames.back();
+    hasSlice |= slice;
+    if (type == 5)
+      frame.keyFrame = true;
+
+    if (length <= MaxVideoPayload) {
+      frame.packets.push_back(PBYTEArray(nal, length));
+      continue;
+    }
+
+    // FU-A fragments, the NAL header is split into their indicator and header
+    for (PINDEX offset = 1; offset < length; ) {
+      PINDEX count = PMIN(length - offset, MaxVideoPayload - 2);
+      PBYTEArray packet(count + 2);
+      packet[0] = (BYTE)((nal[0] & 0xe0) | 28);
+      packet[1] = (BYTE)(type | (offset == 1 ? 0x80 : 0) | (offset + count == length ? 0x40 : 0));
+      memcpy(packet.GetPointer() + 2, nal + offset, count);
+      frame.packets.push_back(packet);
+      offset += count;
+    }
+  }
+}
+
+static unsigned GetBits(const BYTE * data, PINDEX bit, unsigned count)
+{
+  unsigned value = 0;
+  for (unsigned i = 0; i < count; i++, bit++)
+    value = (value << 1) | ((data[bit/8] >> (7 - bit%8)) & 1);
+  return value;
+}
+
+// Packets start at byte aligned picture or GOB start codes and hold as many
+// GOBs as fit. RFC 2190 mode A cannot split a GOB, larger ones are sent whole.
+void EncodedVideo::AddH263(const BYTE * data, PINDEX size, bool plus)
+{
+  vector<PINDEX> starts;   // of the picture and GOB start codes
+  for (PINDEX i = 0; i + 3 <= size; i++) {
+    if (data[i] == 0 && data[i+1] == 0 && (data[i+2] & 0x80) != 0) {
+      starts.push_back(i);
+      i += 2;
+    }
+  }
+  starts.push_back(size);
+
+  BYTE modeA = 0;   // second byte of the RFC 2190 header of the current picture
+  for (size_t n = 0; n + 1 < starts.size(); ) {
+    const BYTE * segment = data + starts[n];
+    bool picture = (segment[2] & 0xfc) == 0x80;
+    if (picture) {
+      // PTYPE: source format, picture coding type, UMV, SAC and AP
+      if (starts[n] + 6 > size)
+        break;
+      unsigned sourceFormat = GetBits(segment, 35, 3);
+      bool inter = GetBits(segment, 38, 1) != 0;
+      modeA = (BYTE)((sourceFormat << 5) | (inter ? 0x10 : 0) | (GetBits(segment, 39, 3) << 1));
+      frames.push_back(Frame());
+      frames.back().keyFrame = !inter;
+    }
+    if (frames.empty()) {   // no picture header yet
+      n++;
+      continue;
+    }
+    Frame & frame = frames.back();
+
+    // GOBs up to the next picture that fit into one packet
+    size_t end = n + 1;
+    while (end + 1 < starts.size() && (data[starts[end]+2] & 0xfc) != 0x80 &&
+           starts[end+1] - starts[n] <= MaxVideoPayload)
+      end++;
+    PINDEX length = starts[end] - starts[n];
+
+    if (!plus) {
+      PBYTEArray packet(length + 4);
+      packet[1] = modeA;
+      memcpy(packet.GetPointer() + 4, segment, length);
+      frame.packets.push_back(packet);
+    }
+    else {
+      // the P bit replaces the two zero bytes of the start code, larger GOBs are continued with P=0
+      for (PINDEX offset = 2; offset < length; ) {
+        PINDEX count = PMIN(length - offset, MaxVideoPayload - 2);
+        PBYTEArray packet(count + 2);
+        packet[0] = (BYTE)(offset == 2 ? 0x04 : 0);
+        memcpy(packet.GetPointer() + 2, segment + offset, count);
+        frame.packets.push_back(packet);
+        offset += count;
+      }
+    }
+    n = end;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+VideoReplayChannel::VideoReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID,
+                                       const EncodedVideo & video, unsigned frameRate, WORD rtpPort, WORD rtcpPort)
+    : RTPReplayChannel(ep, connection, capability, sessionID, OpalMediaFormat(capability.GetFormatName(), false).GetPayloadType(),
+                       1000, PMAX(frameRate, 1U), rtpPort, rtcpPort),
+      m_video(video),
+      m_frameTime(90000/PMAX(frameRate, 1U))
+{
+}
+
+void VideoReplayChannel::OnPace()
+{
+    const EncodedVideo::Frame & frame = m_video[m_index];
+
+    DWORD timestamp = m_timestampBase + m_index*m_frameTime;
+    for (size_t i = 0; i < frame.packets.size(); i++)
+        SendRTP(frame.packets[i], timestamp, i + 1 == frame.packets.size());
+
+    // loop through the stream with continuous timestamps
+    if (++m_index >= (PINDEX)m_video.GetSize()) {
+        m_index = 0;
+        m_timestampBase += m_video.GetSize()*m_frameTime;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+VideoCountingChannel::VideoCountingChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID, WORD rtpPort)
+    : H323_ExternalRTPChannel(connection, capability, IsReceiver, sessionID),
+      m_receiver(NULL),
+      m_invalid(0),
+      m_frames(0),
+      m_keyFrames(0),
+      m_gaps(0),
+      m_lastSequence(0),
+      m_lastTimestamp(0),
+      m_frameIsKey(false),
+      m_firstArrival(0),
+      m_lastArrival(0),
+      m_lastKeyFrame(0),
+      m_keyFrameIntervals(0),
+      m_jitter(0),
+      m_lastTransit(0),
+      m_jitterSum(0)
+{
+    m_knownPacketization = EncodedVideo::GetPacketization(capability.GetFormatName(), m_packetization) != FALSE;
+
+    PIPSocket::Address myip = ep.GetListenerAddress();
+    SetExternalAddress(H323TransportAddress(myip, rtpPort), H323TransportAddress(myip, rtpPort+1));
+    m_rtpSocket.Listen(5, rtpPort);
+    m_rtcpSocket.Listen(5, rtpPort+1);
+    // so the receiver notices a closed socket
+    m_rtpSocket.SetReadTimeout(500);
+}
+
+VideoCountingChannel::~VideoCountingChannel()
+{
+    StopReceiver();
+    m_rtcpSocket.Close();
+}
+
+PBoolean VideoCountingChannel::Start()
+{
+    if (!H323_ExternalRTPChannel::Start())
+        return false;
+
+    PWaitAndSignal lock(m_mutex);
+    if (m_receiver == NULL)
+        m_receiver = new Receiver(*this);
+    return true;
+}
+
+void VideoCountingChannel::Close()
+{
+    if (StopReceiver())
+        Report();
+    H323_ExternalRTPChannel::Close();
+}
+
+bool VideoCountingChannel::StopReceiver()
+{
+    Receiver * receiver;
+    {
+        PWaitAndSignal lock(m_mutex);
+        receiver = m_receiver;
+        m_receiver = NULL;
+    }
+    if (receiver == NULL)
+        return false;
+
+    m_rtpSocket.Close();
+    receiver->WaitForTermination();
+    delete receiver;
+    return true;
+}
+
+void VideoCountingChannel::OnPacket(const BYTE * data, PINDEX size, const PIPSocket::Address & from, WORD port)
+{
+    // RTP version 2, skip CSRCs, header extension and padding
+    if (size < 12 || (data[0] & 0xc0) != 0x80) {
+        m_invalid++;
+        return;
+    }
+    PINDEX offset = 12 + 4*(data[0] & 0x0f);
+    if ((data[0] & 0x10) != 0 && offset + 4 <= size)
+        offset += 4 + 4*((data[offset+2] << 8) | data[offset+3]);
+    if ((data[0] & 0x20) != 0)
+        size -= data[size-1];
+    if (offset > size) {
+        m_invalid++;
+        return;
+    }
+
+    WORD sequence = (WORD)((data[2] << 8) | data[3]);
+    DWORD timestamp = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    PInt64 arrival = PTimer::Tick().GetMilliSeconds();
+
+    if (m_stats.packets == 0) {
+        m_firstArrival = arrival;
+        ((MyH323Connection &)connection).details.OnMediaReceived(RTPReceiveStats::Video, H323TransportAddress(from, port), connection);
+    }
+    else {
+        short delta = (short)(sequence - m_lastSequence);
+        if (delta <= 0) {
+            // late or duplicate, only counted
+            m_stats.outOfOrder++;
+            m_stats.packets++;
+            m_stats.octets += size - offset;
+            return;
         }
-        return new RTPFuzzingChannel(endpoint, *this, capability, dir, sessionID, rtpPort, rtpPort+1);
-    } else {
-        // call super class
-        return H323Connection::CreateRealTimeLogicalChannel(capability, dir, sessionID, param, rtpqos);
+        if (delta > 1) {
+            m_gaps++;
+            m_stats.lost += delta - 1;
+        }
+    }
+
+    // RFC 3550 interarrival jitter with the 90kHz video clock
+    PInt64 transit = arrival*90 - timestamp;
+    if (m_stats.packets > 0) {
+        PInt64 difference = transit - m_lastTransit;
+        if (difference < 0)
+            difference = -difference;
+        m_jitter += (difference - m_jitter)/16;
+        m_jitterSum += m_jitter;
+        if (m_jitter/90 > m_stats.maxJitter)
+            m_stats.maxJitter = (DWORD)(m_jitter/90);
+    }
+    m_lastTransit = transit;
+
+    if (m_stats.packets == 0 || timestamp != m_lastTimestamp) {
+        m_frames++;
+        m_frameIsKey = false;
+    }
+    if (!m_frameIsKey && IsKeyFrame(data + offset, size - offset)) {
+        m_frameIsKey = true;
+        if (m_keyFrames++ > 0)
+            m_keyFrameIntervals += arrival - m_lastKeyFrame;
+        m_lastKeyFrame = arrival;
     }
+
+    m_stats.packets++;
+    m_stats.octets += size - offset;
+    m_lastSequence = sequence;
+    m_lastTimestamp = timestamp;
+    m_lastArrival = arrival;
 }
 
-void MyH323Connection::OnRTPStatistics(const RTP_Session & session) const
+bool VideoCountingChannel::IsKeyFrame(const BYTE * payload, PINDEX size) const
 {
-  ((MyH323Connection *)this)->details.OnRTPStatistics(session, GetCallToken());
+    if (!m_knownPacketization || size < 2)
+        return false;
+
+    switch (m_packetization) {
+        case EncodedVideo::H264 :
+            switch (payload[0] & 0x1f) {
+                case 5 :    // IDR slice
+                    return true;
+                case 24 :   // STAP-A
+                    for (PINDEX i = 1; i + 2 < size; i += 2 + ((payload[i] << 8) | payload[i+1])) {
+                        if ((payload[i+2] & 0x1f) == 5)
+                            return true;
+                    }
+                    return false;
+                case 28 :   // FU-A, the first fragment
+                    return (payload[1] & 0x80) != 0 && (payload[1] & 0x1f) == 5;
+                default :
+                    return false;
+            }
+
+        case EncodedVideo::H263 :
+            // RFC 2190 I bit, set for inter coded pictures
+            if ((payload[0] & 0x80) == 0)
+                return (payload[1] & 0x10) == 0;
+            return size > 4 && (payload[4] & 0x80) == 0;
+
+        case EncodedVideo::H263Plus :
+        {
+            // RFC 4629, a picture start code without its two zero bytes
+            if ((payload[0] & 0x04) == 0)
+                return false;
+            PINDEX start = 2 + ((payload[0] & 0x02) != 0 ? 1 : 0) + (((payload[0] & 0x01) << 5) | (payload[1] >> 3));
+            if (start + 8 > size)
+                return false;
+            const BYTE * picture = payload + start;
+            if (GetBits(picture, 0, 6) != 0x20)
+                return false;   // a GOB
+            if (GetBits(picture, 19, 3) != 7)
+                return GetBits(picture, 22, 1) == 0;
+            // PLUSPTYPE, the picture type is in MPPTYPE after the optional OPPTYPE
+            unsigned ufep = GetBits(picture, 22, 3);
+            return GetBits(picture, ufep == 1 ? 43 : 25, 3) == 0;
+        }
+    }
+    return false;
 }
 
-PBoolean MyH323Connection::OpenAudioChannel(PBoolean isEncoding, unsigned bufferSize, H323AudioCodec & codec)
+void VideoCountingChannel::Report()
 {
-  unsigned frameDelay = bufferSize / 16; // assume 16 bit PCM
+    if (m_stats.packets == 0)
+        return;
 
-  PIndirectChannel * channel;
-  if (isEncoding)
-    channel = new PlayMessage(CallGen::Current().outgoingMessageFile, frameDelay, bufferSize);
-  else {
-    PString wavFileName;
-    if (!CallGen::Current().incomingAudioDirectory) {
-      PString token = GetCallToken();
-      token.Replace("/", "_", TRUE);
-      wavFileName = CallGen::Current().incomingAudioDirectory + token;
+    m_stats.valid = true;
+    m_stats.avgJitter = (DWORD)(m_jitterSum/m_stats.packets/90);
+    ((MyH323Connection &)connection).details.received[RTPReceiveStats::Video] = m_stats;
+
+    PInt64 duration = PMAX(m_lastArrival - m_firstArrival, (PInt64)1);
+    PStringStream info;
+    info << "Video received: frames=" << m_frames
+         << " fps=" << setprecision(1) << fixed << m_frames*1000.0/duration;
+    if (m_knownPacketization) {
+        info << " keyframes=" << m_keyFrames;
+        if (m_keyFrames > 1)
+            info << " interval=" << m_keyFrameIntervals/(m_keyFrames-1) << "ms";
     }
-    channel = new RecordMessage(wavFileName, frameDelay, bufferSize);
+    info << " gaps=" << m_gaps << " lost=" << m_stats.lost
+         << " bitrate=" << m_stats.octets*8.0/duration << "kbit/s";
+    if (m_invalid > 0)
+        info << " invalid=" << m_invalid;
+    OUTPUT("", connection.GetCallToken(), info);
+}
+
+VideoCountingChannel::Receiver::Receiver(VideoCountingChannel & _channel)
+  : PThread(1000, NoAutoDeleteThread, NormalPriority, "VideoCount"),
+    channel(_channel)
+{
+  Resume();
+}
+
+void VideoCountingChannel::Receiver::Main()
+{
+  BYTE buffer[2048];
+  while (channel.m_rtpSocket.IsOpen()) {
+    PIPSocket::Address from;
+    WORD port;
+    if (channel.m_rtpSocket.ReadFrom(buffer, sizeof(buffer), from, port))
+      channel.OnPacket(buffer, channel.m_rtpSocket.GetLastReadCount(), from, port);
+    else if (channel.m_rtpSocket.GetErrorCode(PChannel::LastReadError) != PChannel::Timeout)
+      break;
   }
+}
 
-  codec.AttachChannel(channel);
+#endif // H323_VIDEO
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+PBoolean OutgoingMessage::Load(const PString & filename, PString & error)
+{
+  if (!PFile::Exists(filename)) {
+    error = "does not exist";
+    return FALSE;
+  }
+
+  PWAVFile wavFile;
+  if (!wavFile.Open(filename, PFile::ReadOnly)) {
+    error = "could not be opened";
+    return FALSE;
+  }
+
+  if (wavFile.GetFormat() != PWAVFile::fmt_PCM
+      || wavFile.GetChannels() != 1
+      || wavFile.GetSampleRate() != 8000
+      || wavFile.GetSampleSize() != 16) {
+    error = "is not 8kHz 16 bit mono PCM";
+    return FALSE;
+  }
 
+  static const PINDEX BlockSize = 16384;
+  PBYTEArray data;
+  PINDEX total = 0;
+  while (wavFile.Read(data.GetPointer(total+BlockSize)+total, BlockSize) && wavFile.GetLastReadCount() > 0)
+    total += wavFile.GetLastReadCount();
+  data.SetSize(total & ~1);
+
+  if (data.IsEmpty()) {
+    error = "has no audio";
+    return FALSE;
+  }
+
+  samples = data;
+  PTRACE(2, "CallGen\tLoaded outgoing message file \"" << filename << "\", " << samples.GetSize() << " bytes");
   return TRUE;
 }
 
-#ifdef H323_VIDEO
-PBoolean MyH323Connection::OpenVideoChannel(PBoolean isEncoding, H323VideoCodec & codec)
+///////////////////////////////////////////////////////////////////////////////
+
+// 8 independent partial sums, which the compiler keeps in SIMD registers
+static double DotProduct(const float * a, const float * b, unsigned count)
 {
-  bool isH239 = false;
-#if (H323PLUS_VER >= 1271)
-  isH239 = codec.GetRTPSessionID() > 2;
-#endif
-  PString deviceName = isEncoding ? endpoint.GetVideoPattern(isH239) : "NULL";
+  float lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  unsigned i = 0;
+  for (; i + 8 <= count; i += 8) {
+    for (unsigned j = 0; j < 8; j++)
+      lanes[j] += a[i+j]*b[i+j];
+  }
 
-  PVideoDevice * device = isEncoding ? (PVideoDevice *)PVideoInputDevice::CreateDeviceByName(deviceName)
-                                     : (PVideoDevice *)PVideoOutputDevice::CreateDeviceByName(deviceName);
+  double sum = 0;
+  for (; i < count; i++)
+    sum += a[i]*b[i];
+  for (unsigned j = 0; j < 8; j++)
+    sum += lanes[j];
+  return sum;
+}
 
-  // codec needs a list of possible formats, otherwise the frame size isn't negotiated properly
-  if (isEncoding) {
-#if PTLIB_VER >= 2110
-      PVideoInputDevice::Capabilities videoCaps;
-      if (((PVideoInputDevice *)device)->GetDeviceCapabilities(deviceName, deviceDriver, &videoCaps)) {
-          codec.SetSupportedFormats(videoCaps.framesizes);
-      } else
-#endif // PTLIB_VER
-    {
-      // set fixed list of resolutions for PTLib < 2.11 and for drivers that don't provide a list
-      PVideoInputDevice::Capabilities caps;
-      PVideoFrameInfo cap;
-      cap.SetColourFormat("YUV420P");
-      cap.SetFrameRate(endpoint.GetFrameRate());
-      // sizes must be from largest to smallest
-      if (endpoint.GetMaxFrameSize() >= H323Capability::i1080MPI) {
-        cap.SetFrameSize(1920, 1080);
-        caps.framesizes.push_back(cap);
-      }
-      if (endpoint.GetMaxFrameSize() >= H323Capability::p720MPI) {
-        cap.SetFrameSize(1280, 720);
-        caps.framesizes.push_back(cap);
-      }
-      if (endpoint.GetMaxFrameSize() >= H323Capability::cif4MPI) {
-        cap.SetFrameSize(704, 576);
-        caps.framesizes.push_back(cap);
-      }
-      if (endpoint.GetMaxFrameSize() >= H323Capability::i480MPI) {
-        cap.SetFrameSize(640, 400);
-        caps.framesizes.push_back(cap);
-      }
-      cap.SetFrameSize(352, 288);
-      caps.framesizes.push_back(cap);
-      codec.SetSupportedFormats(caps.framesizes);
+// energy of a - gain*b
+static double ErrorEnergy(const float * a, const float * b, float gain, unsigned count)
+{
+  float lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  unsigned i = 0;
+  for (; i + 8 <= count; i += 8) {
+    for (unsigned j = 0; j < 8; j++) {
+      float error = a[i+j] - gain*b[i+j];
+      lanes[j] += error*error;
     }
   }
 
-  unsigned frameWidth = codec.GetWidth();
-  unsigned frameHeight = codec.GetHeight();
-  PTRACE(1, "Codec says:" << (isEncoding ? " OUT " : " IN ") << frameWidth << "x" << frameHeight);
+  double sum = 0;
+  for (; i < count; i++) {
+    float error = a[i] - gain*b[i];
+    sum += error*error;
+  }
+  for (unsigned j = 0; j < 8; j++)
+    sum += lanes[j];
+  return sum;
+}
 
-  if (!device ||
-	  !device->SetFrameSize(codec.GetWidth(), codec.GetHeight()) ||
-      !device->SetColourFormatConverter("YUV420P") ||
-      !device->SetFrameRate(endpoint.GetFrameRate()) ||
-      !device->Open(deviceName, TRUE)) {
-    PTRACE(1, "Failed to open or configure the video device \"" << deviceName << '"');
+// sum of each Decimation samples, a crude but sufficient low pass for the alignment
+static void Decimate(const float * in, unsigned count, float * out)
+{
+  for (unsigned i = 0; i < count; i++) {
+    const float * ptr = in + i*AudioComparison::Decimation;
+    float sum = 0;
+    for (unsigned j = 0; j < AudioComparison::Decimation; j++)
+      sum += ptr[j];
+    out[i] = sum;
+  }
+}
+
+PBoolean AudioComparison::Reference::Prepare(const OutgoingMessage & message, unsigned seconds)
+{
+  // with less than a second the alignment is not reliable
+  length = message.GetSize()/2;
+  capacity = seconds*8000;
+  if (length < 8000 || capacity < 8000) {
+    length = 0;
     return FALSE;
   }
 
-  device->GetFrameSize(frameWidth, frameHeight);
-  PTRACE(1, "Device says:" << (isEncoding ? " OUT " : " IN ") << frameWidth << "x" << frameHeight);
+  const short * pcm = (const short *)message.GetData();
+  samples.resize(length + capacity);
+  for (unsigned i = 0; i < length + capacity; i++)
+    samples[i] = pcm[i % length];
+
+  unsigned decimated = (length + capacity)/Decimation;
+  fftSize = 1;
+  while (fftSize < decimated)
+    fftSize *= 2;
+
+  static const double Pi = 3.14159265358979323846;
+  twiddleRe.resize(fftSize);
+  twiddleIm.resize(fftSize);
+  for (unsigned half = 1; half < fftSize; half *= 2) {
+    for (unsigned k = 0; k < half; k++) {
+      double angle = Pi*k/half;
+      twiddleRe[half+k] = (float)cos(angle);
+      twiddleIm[half+k] = (float)-sin(angle);
+    }
+  }
 
-  if (isEncoding) {
-    videoChannelOut = new PVideoChannel();
-    videoChannelOut->AttachVideoReader((PVideoInputDevice *)device);
-    return codec.AttachChannel(videoChannelOut, false);
-  } else {
-    videoChannelIn = new PVideoChannel();
-    videoChannelIn->AttachVideoPlayer((PVideoOutputDevice *)device);
-    return codec.AttachChannel(videoChannelIn, false);
+  spectrumRe.assign(fftSize, 0);
+  spectrumIm.assign(fftSize, 0);
+  Decimate(&samples[0], decimated, &spectrumRe[0]);
+  AudioComparison::FFT(*this, &spectrumRe[0], &spectrumIm[0], false);
+
+  PTRACE(2, "CallGen\tPrepared audio comparison, " << length << " samples, FFT size " << fftSize);
+  return TRUE;
+}
+
+// in place radix 2, the inverse is not scaled
+void AudioComparison::FFT(const Reference & reference, float * re, float * im, bool inverse)
+{
+  unsigned n = reference.fftSize;
+
+  for (unsigned i = 1, j = 0; i < n; i++) {
+    unsigned bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      swap(re[i], re[j]);
+      swap(im[i], im[j]);
+    }
+  }
+
+  float sign = inverse ? -1.0f : 1.0f;
+  for (unsigned half = 1; half < n; half *= 2) {
+    const float * wr = &reference.twiddleRe[half];
+    const float * wi = &reference.twiddleIm[half];
+    for (unsigned start = 0; start < n; start += 2*half) {
+      float * ar = re + start;
+      float * ai = im + start;
+      float * br = ar + half;
+      float * bi = ai + half;
+      for (unsigned k = 0; k < half; k++) {
+        float tr = br[k]*wr[k] - bi[k]*wi[k]*sign;
+        float ti = br[k]*wi[k]*sign + bi[k]*wr[k];
+        br[k] = ar[k] - tr;
+        bi[k] = ai[k] - ti;
+        ar[k] += tr;
+        ai[k] += ti;
+      }
+    }
   }
 }
 
-#ifdef H323_H239
-void MyH323Connection::StartH239Transmission()
+AudioComparison::AudioComparison(const Reference & _reference)
+  : reference(_reference),
+    started(0)
 {
-    if (endpoint.IsStartH239() && !m_haveStartedH239) {
-        PTRACE(1, "Starting H.239");
-        if (OpenH239Channel()) {
-            PTRACE(1, "H.239 channel open");
-            m_haveStartedH239 = true;
-            int duration = endpoint.GetH239Duration();
-            if (duration > 0) {
-                m_h239StopTimer.SetInterval(0, duration); // stop H239 transmission after 10 sec
-                m_h239StopTimer.SetNotifier(PCREATE_NOTIFIER(StopH239TransmissionTrigger));
-            }
-        } else {
-            PTRACE(1, "H.239 channel failed");
-        }
+  received.reserve(reference.capacity);
+}
+
+void AudioComparison::Add(const short * pcm, unsigned count)
+{
+  if (received.empty())
+    started = PTime();
+
+  count = PMIN(count, reference.capacity - (unsigned)received.size());
+  for (unsigned i = 0; i < count; i++)
+    received.push_back(pcm[i]);
+}
+
+AudioComparison::Result AudioComparison::Analyse(const PTime & referenceStart) const
+{
+  static const double MinCorrelation = 0.3;
+  static const float ClipLevel = 32700;
+  static const float SilenceLevel = 100*100;   // mean square of a block without speech
+
+  Result result;
+  unsigned count = received.size();
+  if (reference.IsEmpty() || count < 8000)
+    return result;
+  result.compared = true;
+
+  const float * samples = &received[0];
+  for (unsigned i = 0; i < count; i++) {
+    if (samples[i] >= ClipLevel || samples[i] <= -ClipLevel)
+      result.clipped++;
+  }
+
+  // coarse alignment: cross-correlation with the repeated message, conj(received) * message
+  vector<float> re(reference.fftSize), im(reference.fftSize);
+  Decimate(samples, count/Decimation, &re[0]);
+  FFT(reference, &re[0], &im[0], false);
+  const float * sr = &reference.spectrumRe[0];
+  const float * si = &reference.spectrumIm[0];
+  for (unsigned k = 0; k < reference.fftSize; k++) {
+    float r = re[k]*sr[k] + im[k]*si[k];
+    float i = re[k]*si[k] - im[k]*sr[k];
+    re[k] = r;
+    im[k] = i;
+  }
+  FFT(reference, &re[0], &im[0], true);
+
+  unsigned length = reference.length;
+  unsigned coarse = max_element(re.begin(), re.begin() + length/Decimation) - re.begin();
+
+  // fine alignment at 8kHz, received[i] is message[(i + offset) % length]
+  unsigned offset = 0;
+  double bestDot = 0;
+  for (int delta = -Decimation; delta <= Decimation; delta++) {
+    unsigned candidate = (coarse*Decimation + length + delta) % length;
+    double dot = DotProduct(samples, &reference.samples[candidate], count);
+    if (delta == -Decimation || dot > bestDot) {
+      bestDot = dot;
+      offset = candidate;
+    }
+  }
+
+  const float * message = &reference.samples[offset];
+  double receivedEnergy = DotProduct(samples, samples, count);
+  double messageEnergy = DotProduct(message, message, count);
+  if (receivedEnergy <= 0 || messageEnergy <= 0)
+    return result;
+
+  result.correlation = bestDot/sqrt(receivedEnergy*messageEnergy);
+  result.aligned = result.correlation >= MinCorrelation;
+  if (!result.aligned)
+    return result;
+
+  // the message starts this many samples into the received audio
+  unsigned first = (length - offset) % length;
+  PInt64 start = first;
+  if (referenceStart.IsValid())
+    start += (started - referenceStart).GetMilliSeconds()*8;
+  result.delay = (unsigned)(((start % length) + length) % length / 8);
+
+  // SNR over the blocks that arrived from the start of the message on,
+  // a dropout is 2 or more blocks missing where the message has audio
+  float gain = (float)(bestDot/messageEnergy);
+  double signal = 0, noise = 0;
+  unsigned gap = 0;
+  for (unsigned block = first; block + BlockSize <= count; block += BlockSize) {
+    double expected = gain*gain*DotProduct(message + block, message + block, BlockSize);
+    double got = DotProduct(samples + block, samples + block, BlockSize);
+    if (expected > BlockSize*SilenceLevel && got < expected/100) {
+      if (++gap == 2)
+        result.dropouts++;
+      continue;
     }
+
+    if (gap >= 2)
+      result.dropoutTime += gap*BlockSize/8;
+    gap = 0;
+    signal += expected;
+    noise += ErrorEnergy(samples + block, message + block, gain, BlockSize);
+  }
+  if (gap >= 2)
+    result.dropoutTime += gap*BlockSize/8;
+
+  if (signal > 0)
+    result.snr = noise > 0 ? PMIN(10*log10(signal/noise), 99.0) : 99.0;
+
+  return result;
 }
 
-void MyH323Connection::StopH239Transmission()
+///////////////////////////////////////////////////////////////////////////////
+
+PlayMessage::PlayMessage(const OutgoingMessage & _message, unsigned frameDelay)
+  : message(_message),
+    offset(0),
+    closed(FALSE)
 {
-  if (endpoint.IsStartH239()) {
-    PTRACE(1, "Stopping H.239");
-    CloseH239Channel();
+  CallGen::Current().pacer->Add(*this, frameDelay);
+}
+
+PlayMessage::~PlayMessage()
+{
+  CallGen::Current().pacer->Remove(*this);
+}
+
+PBoolean PlayMessage::Read(void * buf, PINDEX len)
+{
+  // wait for the time of the next frame
+  frameTime.Wait();
+
+  if (closed) {
+    lastReadCount = 0;
+    return FALSE;
+  }
+
+  if (message.IsEmpty()) {
+    // just play out silence
+    memset(buf, 0, len);
+  }
+  else {
+    // loop through the shared message, at its end start again
+    BYTE * ptr = (BYTE *)buf;
+    PINDEX left = len;
+    while (left > 0) {
+      PINDEX count = PMIN(left, message.GetSize() - offset);
+      memcpy(ptr, message.GetData() + offset, count);
+      ptr += count;
+      left -= count;
+      offset += count;
+      if (offset >= message.GetSize())
+        offset = 0;
+    }
+  }
+
+  lastReadCount = len;
+  return TRUE;
+}
+
+void PlayMessage::OnPace()
+{
+  frameTime.Signal();
+}
+
+PBoolean PlayMessage::Close()
+{
+  closed = TRUE;
+  CallGen::Current().pacer->Remove(*this);
+  frameTime.Signal();
+  return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef H323_VIDEO
+
+VideoPatternCache::~VideoPatternCache()
+{
+  for (map<PString, Frames *>::iterator it = cache.begin(); it != cache.end(); ++it)
+    delete it->second;
+}
+
+const VideoPatternCache::Frames * VideoPatternCache::GetFrames(const PString & pattern, unsigned width, unsigned height, unsigned frameRate)
+{
+  PString key = pattern + psprintf("@%ux%u", width, height);
+
+  // other calls wait while the first one renders, then they all share the frames
+  PWaitAndSignal lock(mutex);
+
+  map<PString, Frames *>::const_iterator it = cache.find(key);
+  if (it != cache.end())
+    return it->second;
+
+  PVideoInputDevice * device = PVideoInputDevice::CreateDeviceByName(pattern);
+  if (device == NULL ||
+      !device->SetFrameSize(width, height) ||
+      !device->SetColourFormatConverter("YUV420P") ||
+      !device->SetFrameRate(frameRate) ||
+      !device->Open(pattern, TRUE)) {
+    PTRACE(1, "CallGen\tCould not open video pattern \"" << pattern << "\" to render it");
+    delete device;
+    cache[key] = NULL;
+    return NULL;
+  }
+
+  Frames * frames = new Frames;
+  frames->width = width;
+  frames->height = height;
+  frames->frames.resize(PMAX(frameRate, 1U));
+  PINDEX frameSize = width*height*3/2;
+  for (size_t i = 0; i < frames->frames.size(); i++) {
+    PINDEX length = 0;
+    if (!device->GetFrameDataNoDelay(frames->frames[i].GetPointer(frameSize), &length) || length != frameSize) {
+      PTRACE(1, "CallGen\tCould not render video pattern \"" << pattern << '"');
+      delete device;
+      delete frames;
+      cache[key] = NULL;
+      return NULL;
+    }
   }
+  delete device;
+
+  PTRACE(2, "CallGen\tRendered " << frames->frames.size() << " frames of video pattern " << key);
+  cache[key] = frames;
+  return frames;
 }
 
-void MyH323Connection::StartH239TransmissionTrigger(PTimer &, H323_INT)
+///////////////////////////////////////////////////////////////////////////////
+
+PatternVideoChannel::PatternVideoChannel(const VideoPatternCache::Frames & _frames, unsigned frameRate)
+  : frames(_frames),
+    index(0),
+    closed(FALSE)
 {
-    m_h239StartTimer.Stop();
-    if (m_isH239ready) {
-      StartH239Transmission();
-    }
+  CallGen::Current().pacer->Add(*this, 1000, frameRate);
 }
 
-void MyH323Connection::StopH239TransmissionTrigger(PTimer &, H323_INT)
+PatternVideoChannel::~PatternVideoChannel()
 {
-    StopH239Transmission();
+  CallGen::Current().pacer->Remove(*this);
 }
 
-void MyH323Connection::OnEstablished()
+PBoolean PatternVideoChannel::Read(void * buf, PINDEX len)
 {
-    H323Connection::OnEstablished(); // call super class, so endpoint method OnConnectionEstablished() runs, too
-    // set a timer to start the H.239 channel if the other side didn't send a H.239 OLC by then
-    if (endpoint.IsStartH239()) {
-      int delay = endpoint.GetH239Delay();
-      m_h239StartTimer.SetInterval(0, delay); // start after 'delay' sec
-      m_h239StartTimer.SetNotifier(PCREATE_NOTIFIER(StartH239TransmissionTrigger));
-    }
+  // wait for the time of the next frame
+  frameTime.Wait();
+
+  if (closed) {
+    lastReadCount = 0;
+    return FALSE;
+  }
+
+  const PBYTEArray & frame = frames.frames[index];
+  index = (index + 1) % frames.frames.size();
+
+  lastReadCount = PMIN(len, frame.GetSize());
+  memcpy(buf, (const BYTE *)frame, lastReadCount);
+  return TRUE;
 }
 
-PBoolean MyH323Connection::OnInitialFlowRestriction(H323Channel & channel)
+void PatternVideoChannel::OnPace()
 {
-    // start the H.239 channel after the other side has sent an OLC for H.239 and received the OLCAck
-    // TODO: this works with Polycom endpoints that open the channel at the beginning, but not with
-    //       Cisco and Radvision endpoints that only open the H.239 channel when needed
-    //       replace with other check if other endpoint supports H.239
-    if ((channel.GetCapability().GetMainType() == H323Capability::e_Video)
-        && (channel.GetCapability().GetSubType() == H245_VideoCapability::e_extendedVideoCapability)
-        && (channel.GetDirection() == H323Channel::IsReceiver)) {
-      m_isH239ready = true;
-    }
-    return true;
+  frameTime.Signal();
 }
 
-PBoolean MyH323Connection::OpenExtendedVideoChannel(PBoolean isEncoding, H323VideoCodec & codec)
+PBoolean PatternVideoChannel::Close()
 {
-    // send same test pattern as regular video channel
-    return OpenVideoChannel(isEncoding, codec);
+  closed = TRUE;
+  CallGen::Current().pacer->Remove(*this);
+  frameTime.Signal();
+  return PVideoChannel::Close();
 }
-#endif // H323_H239
 
 #endif // H323_VIDEO
 
 ///////////////////////////////////////////////////////////////////////////////
 
-RTPFuzzingChannel::RTPFuzzingChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, Directions direction, unsigned sessionID, WORD rtpPort, WORD rtcpPort)
-    : H323_ExternalRTPChannel(connection, capability, direction, sessionID)
+RecordMessage::RecordMessage(const PString & name, unsigned frameDelay, unsigned frameSize, CallDetail * _details)
+  : PDelayChannel(PDelayChannel::DelayWritesOnly, frameDelay, frameSize),
+    details(_details)
 {
-    m_percentBadRTPHeader = ep.GetPercentBadRTPHeader();
-    m_percentBadRTPMedia = ep.GetPercentBadRTPMedia();
-    m_percentBadRTCP = ep.GetPercentBadRTCP();
-    PIPSocket::Address myip;
-    const H323ListenerList & listeners = ep.GetListeners();
-    if (listeners.GetSize() > 0) {
-        listeners[0].GetTransportAddress().GetIpAddress(myip);
-    }
+  reallyClose = FALSE;
+  comparison = details != NULL ? new AudioComparison(CallGen::Current().audioReference) : NULL;
+  recording = name.IsEmpty() ? NULL : CallGen::Current().recorder->Open(name);
+}
 
-    // set the local RTP address and port
-    SetExternalAddress(H323TransportAddress(myip, rtpPort), H323TransportAddress(myip, rtcpPort));
-    // for now we ignore everything sent to these ports
-    m_rtpSocket.Listen(5, rtpPort);
-    m_rtcpSocket.Listen(5, rtcpPort);
+RecordMessage::~RecordMessage()
+{
+  if (recording != NULL)
+    recording->Close();
+  delete comparison;
+}
 
-    // get the payload code
-    OpalMediaFormat format(capability.GetFormatName(), false);
-    m_payloadType = format.GetPayloadType();
-    if (m_payloadType > RTP_DataFrame::MaxPayloadType)
-        m_payloadType = RTP_DataFrame::DynamicBase;
-    m_syncSource = PRandom::Number(65000);
-    m_rtpPacket.SetPayloadSize(format.GetFrameTime() * format.GetFrameSize()); // G.711: 20 ms * 8 byte
-    if (m_rtpPacket.GetPayloadSize() == 0)
-        m_rtpPacket.SetPayloadSize(1400); // eg. for video there is no fixed size
-    memset(m_rtpPacket.GetPayloadPtr(), 0, m_rtpPacket.GetPayloadSize()); // silence
+PBoolean RecordMessage::Write(const void * buf, PINDEX len)
+{
+  if (comparison != NULL)
+    comparison->Add((const short *)buf, len/2);
 
-    m_frameTime = format.GetFrameTime();
-    if (m_frameTime == 0)
-        m_frameTime = 100;
-    m_frameTimeUnits = m_frameTime * format.GetTimeUnits();
-    if (m_frameTimeUnits == 0)
-        m_frameTimeUnits = m_frameTime * 8;
-    m_timestamp = 0;
-    PTRACE(2, "New fuzzing transmit channel: PT=" << (int)m_payloadType << " frame time=" << m_frameTime
-           << " frame size=" << m_rtpPacket.GetPayloadSize());
+  recordingMutex.Wait();
+  if (recording != NULL)
+    recording->Write(buf, len);
+  recordingMutex.Signal();
+
+  if (PDelayChannel::Write(buf, len))
+    return TRUE;
+
+  lastWriteCount = len;
+  return !reallyClose;
 }
 
-RTPFuzzingChannel::~RTPFuzzingChannel()
+PBoolean RecordMessage::Close()
 {
-    m_rtpSocket.Close();
-    m_rtcpSocket.Close();
+  reallyClose = TRUE;
+
+  recordingMutex.Wait();
+  if (recording != NULL) {
+    recording->Close();
+    recording = NULL;
+  }
+  recordingMutex.Signal();
+
+  // the call is not cleared before its channels are closed, so the result is there for its CDR
+  if (comparison != NULL && details != NULL) {
+    details->audioComparison = comparison->Analyse(details->openedTransmitMedia);
+    details = NULL;
+  }
+
+  return PDelayChannel::Close();
 }
 
-PBoolean RTPFuzzingChannel::Start()
+
+///////////////////////////////////////////////////////////////////////////////
+
+// recordings are written at least this often
+static const PTimeInterval RecordFlushInterval(500);
+// per call, 4 seconds of 8kHz 16 bit PCM
+static const PINDEX RecordRingSize = 65536;
+
+// layout of a --in-container file, all little endian: the header, the chunks
+// of all recordings as they were flushed, the index and the trailer
+struct RecordingHeader
 {
-    if (!H323_ExternalRTPChannel::Start())
-        return false;
+  char     magic[8];
+  PUInt32l version;
+  PUInt32l sampleRate;
+};
 
-    if (GetDirection() == IsTransmitter) {
-        m_rtpTransmitTimer.RunContinuous(m_frameTime);
-        m_rtpTransmitTimer.SetNotifier(PCREATE_NOTIFIER(TransmitRTP));
-        m_rtcpTransmitTimer.RunContinuous(m_frameTime); // way more often than regular RTCP, but we want to get a lot of test cases through
-        m_rtcpTransmitTimer.SetNotifier(PCREATE_NOTIFIER(TransmitRTCP));
-        PIPSocket::Address ip;
-        WORD port = 0;
-        remoteMediaAddress.GetIpAndPort(ip, port);
-        m_rtpSocket.SetSendAddress(ip, port);
-        remoteMediaControlAddress.GetIpAndPort(ip, port);
-        m_rtcpSocket.SetSendAddress(ip, port);
-    }
-    return true;
+struct RecordingChunk
+{
+  PUInt32l id;
+  PUInt32l size;               // of the PCM data that follows
+  PInt64l  previous;           // offset of the previous chunk of the recording, -1 for none
+};
+
+struct RecordingIndexEntry
+{
+  PUInt32l id;
+  PUInt32l dropped;            // bytes that did not fit into the ring buffer
+  PInt64l  started;            // ms since 1 Jan 1970
+  PInt64l  size;               // bytes of PCM data
+  PInt64l  lastChunk;          // -1 for none
+  char     name[64];           // NUL padded and truncated
+};
+
+struct RecordingTrailer
+{
+  char     magic[8];
+  PUInt32l count;              // of index entries
+  PUInt32l reserved;
+  PInt64l  indexOffset;
+};
+
+typedef char RecordingHeaderSizeCheck[sizeof(RecordingHeader) == 16 ? 1 : -1];
+typedef char RecordingChunkSizeCheck[sizeof(RecordingChunk) == 16 ? 1 : -1];
+typedef char RecordingIndexEntrySizeCheck[sizeof(RecordingIndexEntry) == 96 ? 1 : -1];
+typedef char RecordingTrailerSizeCheck[sizeof(RecordingTrailer) == 24 ? 1 : -1];
+
+static const char RecordingMagic[8] = { 'C', 'G', '3', '2', '3', 'R', 'E', 'C' };
+static const char RecordingIndexMagic[8] = { 'C', 'G', '3', '2', '3', 'I', 'D', 'X' };
+static const unsigned RecordingVersion = 1;
+
+AudioRecorder::Recording::Recording(const PString & _name, unsigned _id)
+  : name(_name),
+    id(_id),
+    ring(RecordRingSize),
+    head(0),
+    count(0),
+    closed(false),
+    dropped(0),
+    wavFile(NULL),
+    written(0),
+    lastChunk(-1)
+{
 }
 
-void RTPFuzzingChannel::TransmitRTP(PTimer &, H323_INT)
+AudioRecorder::Recording::~Recording()
 {
-    m_rtpPacket.SetPayloadType(m_payloadType);
-    m_rtpPacket.SetSyncSource(m_syncSource);
-    m_timestamp += m_frameTimeUnits;
-    m_rtpPacket.SetTimestamp(m_timestamp);
-    m_rtpPacket.SetSequenceNumber(m_rtpPacket.GetSequenceNumber() + 1);
+  delete wavFile;
+}
 
-    for (int i = 0; i < m_rtpPacket.GetHeaderSize(); i++) {
-        // overwrite n% of the bytes with random values
-        if (PRandom::Number(100) > (100 - m_percentBadRTPHeader)) {
-            m_rtpPacket[i] = PRandom::Number(255);
-        }
-    }
+void AudioRecorder::Recording::Write(const void * data, PINDEX length)
+{
+  PWaitAndSignal lock(mutex);
 
-    // random RTP media
-    for (int i = 0; i < m_rtpPacket.GetPayloadSize(); i++) {
-        if (PRandom::Number(100) > (100 - m_percentBadRTPMedia)) {
-            *(m_rtpPacket.GetPayloadPtr() + i) = PRandom::Number(255);
-        }
-    }
+  if (closed)
+    return;
 
-    PTRACE(2, "Sending fuzzed RTP to " << remoteMediaControlAddress << " payload type=" << m_rtpPacket.GetPayloadType());
-    m_rtpSocket.Write(m_rtpPacket, m_rtpPacket.GetHeaderSize() + m_rtpPacket.GetPayloadSize());
+  if (length > RecordRingSize - count) {
+    // the writers are behind, lose the frame rather than block the codec
+    dropped += length;
+    return;
+  }
+
+  PINDEX first = PMIN(length, RecordRingSize - head);
+  memcpy(ring.GetPointer() + head, data, first);
+  memcpy(ring.GetPointer(), (const BYTE *)data + first, length - first);
+  head = (head + length) % RecordRingSize;
+  count += length;
 }
 
-void RTPFuzzingChannel::TransmitRTCP(PTimer &, H323_INT)
+void AudioRecorder::Recording::Close()
 {
-    const unsigned SecondsFrom1900to1970 = (70*365+17)*24*60*60U;
-    RTP_ControlFrame m_rtcpPacket;
+  PWaitAndSignal lock(mutex);
+  closed = true;
+}
 
-    m_rtcpPacket.SetPayloadType(RTP_ControlFrame::e_SenderReport);
-    m_rtcpPacket.SetPayloadSize(sizeof(RTP_ControlFrame::SenderReport));
+PBoolean AudioRecorder::Recording::Drain(PBYTEArray & data)
+{
+  PWaitAndSignal lock(mutex);
 
-    RTP_ControlFrame::SenderReport * sender = (RTP_ControlFrame::SenderReport *)m_rtcpPacket.GetPayloadPtr();
-    sender->ssrc = m_syncSource;
-    PTime now;
-    sender->ntp_sec = now.GetTimeInSeconds() + SecondsFrom1900to1970; // Convert from 1970 to 1900
-    sender->ntp_frac = now.GetMicrosecond() * 4294; // Scale microseconds to "fraction" from 0 to 2^32
-    sender->rtp_ts = m_timestamp;
-    sender->psent = m_rtpPacket.GetSequenceNumber();
-    sender->osent = m_rtpPacket.GetSequenceNumber() * m_rtpPacket.GetPayloadSize();
-/*
-    // TODO: add Receiver report
-    // TODO: etPayloadType(RTP_ControlFrame::e_ReceiverReport)
-    m_rtcpPacket.SetPayloadSize(sizeof(RTP_ControlFrame::SenderReport) + sizeof(RTP_ControlFrame::ReceiverReport));
-    m_rtcpPacket.SetCount(1);
-    // TODO: insert ReceiverReport data, for now rely on the random data we insert
-    //AddReceiverReport(*(RTP_ControlFrame::ReceiverReport *)&sender[1]);
-*/
-    m_rtcpPacket.WriteNextCompound();
-    (void)m_rtcpPacket.AddSourceDescription(m_syncSource);
+  PINDEX tail = (head + RecordRingSize - count) % RecordRingSize;
+  PINDEX first = PMIN(count, RecordRingSize - tail);
+  BYTE * ptr = data.GetPointer(count);
+  memcpy(ptr, (const BYTE *)ring + tail, first);
+  memcpy(ptr + first, (const BYTE *)ring, count - first);
+  data.SetSize(count);
+  count = 0;
 
-    // send random RTCP packet every time
-    for (int i = 0; i < m_rtcpPacket.GetCompoundSize(); i++) {
-        // overwrite n% of the bytes with random values
-        if (PRandom::Number(100) > (100 - m_percentBadRTCP)) {
-            m_rtcpPacket[i] = PRandom::Number(255);
-        }
-    }
+  return closed;
+}
 
-    PTRACE(2, "Sending fuzzed RTCP to " << remoteMediaControlAddress);
-    m_rtcpSocket.Write(m_rtcpPacket, m_rtcpPacket.GetCompoundSize());
+AudioRecorder::Writer::Writer(AudioRecorder & _recorder, unsigned _index)
+  : PThread(1000, NoAutoDeleteThread, NormalPriority, psprintf("Recorder%u", _index)),
+    recorder(_recorder),
+    index(_index)
+{
+  Resume();
 }
 
-///////////////////////////////////////////////////////////////////////////////
+void AudioRecorder::Writer::Main()
+{
+  for (;;) {
+    wakeup.Wait(RecordFlushInterval);
 
+    recorder.mutex.Wait();
+    bool done = recorder.stopping;
+    recorder.mutex.Signal();
 
-PlayMessage::PlayMessage(const PString & filename, unsigned frameDelay, unsigned frameSize)
-  : PDelayChannel(PDelayChannel::DelayReadsOnly, frameDelay, frameSize)
-{
-  if (filename.IsEmpty())
-      PTRACE(2, "CallGen\tPlaying silence, no outgoing message file");
-  else {
-    if (wavFile.Open(filename, PFile::ReadOnly)) {
-      Open(wavFile);
-      if (wavFile.GetFormat() != PWAVFile::fmt_PCM
-          || wavFile.GetChannels() != 1
-          || wavFile.GetSampleRate() != 8000
-          || wavFile.GetSampleSize() != 16) {
-
-        wavFile.Close();
-        PTRACE(2, "CallGen\tWrong file format in outgoing message file \"" << wavFile.GetFilePath() << '"');
-      } else {
-        PTRACE(2, "CallGen\tPlaying outgoing message file \"" << wavFile.GetFilePath() << '"');
-      }
-    }
-    else {
-      PTRACE(2, "CallGen\tCould not open outgoing message file \"" << wavFile.GetFilePath() << '"');
-    }
+    recorder.Flush(index, done);
+    if (done)
+      break;
   }
 }
 
-PBoolean PlayMessage::Read(void * buf, PINDEX len)
+AudioRecorder::AudioRecorder(const PDirectory & _directory, const PFilePath & filename, unsigned threads)
+  : directory(_directory),
+    recordings(threads),
+    nextId(0),
+    stopping(false),
+    containerSize(0),
+    containerRecordings(0)
 {
-  if (!wavFile.IsOpen()) {
-    // just play out silence
-    memset(buf, 0, len);
-    lastReadCount = len;
-    if (mode != DelayWritesOnly)
-        Wait(lastReadCount, nextReadTick);  // supress outgoing packets flood
-    return TRUE;
-  }
+  if (!filename.IsEmpty()) {
+    if (!container.Open(filename, PFile::WriteOnly, PFile::Create | PFile::Truncate))
+      return;
 
-  if (PDelayChannel::Read(buf, len)) {
-    // at end of file, re-open and start reading again
-    if (lastReadCount < len) {
-        wavFile.Open(PFile::ReadOnly);
-        PDelayChannel::Read(buf, len);
-    }
-    return TRUE;
+    RecordingHeader header;
+    memcpy(header.magic, RecordingMagic, sizeof(header.magic));
+    header.version = RecordingVersion;
+    header.sampleRate = 8000;
+    container.Write(&header, sizeof(header));
+    containerSize = sizeof(header);
   }
-  return FALSE;
+
+  for (unsigned i = 0; i < threads; i++)
+    writers.push_back(new Writer(*this, i));
 }
 
+AudioRecorder::~AudioRecorder()
+{
+  Stop();
+}
 
-PBoolean PlayMessage::Close()
+AudioRecorder::Recording * AudioRecorder::Open(const PString & name)
 {
-  return PDelayChannel::Close();
+  PWaitAndSignal lock(mutex);
+
+  if (stopping || writers.empty())
+    return NULL;
+
+  Recording * recording = new Recording(name, ++nextId);
+  recordings[nextId % writers.size()].push_back(recording);
+  PTRACE(2, "CallGen\tRecording incoming audio of \"" << name << '"');
+  return recording;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+void AudioRecorder::Stop()
+{
+  mutex.Wait();
+  stopping = true;
+  mutex.Signal();
+
+  for (size_t i = 0; i < writers.size(); i++) {
+    writers[i]->wakeup.Signal();
+    writers[i]->WaitForTermination();
+    delete writers[i];
+  }
+  writers.clear();
+
+  if (!container.IsOpen())
+    return;
+
+  RecordingTrailer trailer;
+  memcpy(trailer.magic, RecordingIndexMagic, sizeof(trailer.magic));
+  trailer.count = containerRecordings;
+  trailer.reserved = 0;
+  trailer.indexOffset = containerSize;
+  container.Write(containerIndex, containerIndex.GetSize());
+  container.Write(&trailer, sizeof(trailer));
+  container.Close();
+}
 
-RecordMessage::RecordMessage(const PString & wavFileName, unsigned frameDelay, unsigned frameSize)
-  : PDelayChannel(PDelayChannel::DelayWritesOnly, frameDelay, frameSize)
+// everything the recordings of one writer have buffered, in one write per file
+void AudioRecorder::Flush(unsigned writer, bool final)
 {
-  reallyClose = FALSE;
+  mutex.Wait();
+  vector<Recording *> mine = recordings[writer];
+  mutex.Signal();
+
+  vector<PBYTEArray> data(mine.size());
+  vector<Recording *> finished;
+  for (size_t i = 0; i < mine.size(); i++) {
+    if (mine[i]->Drain(data[i]) || final)
+      finished.push_back(mine[i]);
+  }
+
+  if (container.IsOpen())
+    WriteContainer(mine, data);
+  else {
+    for (size_t i = 0; i < mine.size(); i++)
+      WriteWAV(*mine[i], data[i]);
+  }
+
+  if (finished.empty())
+    return;
+
+  for (size_t i = 0; i < finished.size(); i++)
+    Finish(*finished[i]);
+
+  mutex.Wait();
+  vector<Recording *> & list = recordings[writer];
+  for (size_t i = 0; i < finished.size(); i++)
+    list.erase(find(list.begin(), list.end(), finished[i]));
+  mutex.Signal();
+
+  for (size_t i = 0; i < finished.size(); i++)
+    delete finished[i];
+}
 
-  if (wavFileName.IsEmpty())
+void AudioRecorder::WriteWAV(Recording & recording, const PBYTEArray & data)
+{
+  if (data.IsEmpty())
     return;
 
-  PWAVFile * wavFile = new PWAVFile(wavFileName, PFile::WriteOnly);
-  if (wavFile->IsOpen()) {
-    Open(wavFile, TRUE);
-    PTRACE(2, "CallGen\tRecording to file \"" << wavFileName << '"');
+  if (recording.wavFile == NULL) {
+    PFilePath filename = directory + recording.name;
+    recording.wavFile = new PWAVFile(filename, PFile::WriteOnly);
+    if (!recording.wavFile->IsOpen())
+      PTRACE(1, "CallGen\tCould not create \"" << filename << '"');
   }
-  else
-    delete wavFile;
+
+  if (recording.wavFile->IsOpen() && recording.wavFile->Write(data, data.GetSize()))
+    recording.written += data.GetSize();
 }
 
-PBoolean RecordMessage::Write(const void * buf, PINDEX len)
+// the chunks of all recordings go into the container as one write
+void AudioRecorder::WriteContainer(const vector<Recording *> & mine, const vector<PBYTEArray> & data)
 {
-  if (PDelayChannel::Write(buf, len))
-    return TRUE;
+  PINDEX length = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    if (!data[i].IsEmpty())
+      length += sizeof(RecordingChunk) + data[i].GetSize();
+  }
+  if (length == 0)
+    return;
 
-  lastWriteCount = len;
-  return !reallyClose;
+  PWaitAndSignal lock(containerMutex);
+
+  PBYTEArray buffer(length);
+  BYTE * ptr = buffer.GetPointer();
+  for (size_t i = 0; i < data.size(); i++) {
+    if (data[i].IsEmpty())
+      continue;
+
+    RecordingChunk chunk;
+    chunk.id = mine[i]->id;
+    chunk.size = data[i].GetSize();
+    chunk.previous = mine[i]->lastChunk;
+    mine[i]->lastChunk = containerSize + (ptr - buffer.GetPointer());
+    mine[i]->written += data[i].GetSize();
+
+    memcpy(ptr, &chunk, sizeof(chunk));
+    memcpy(ptr + sizeof(chunk), (const BYTE *)data[i], data[i].GetSize());
+    ptr += sizeof(chunk) + data[i].GetSize();
+  }
+
+  if (!container.Write(buffer, length)) {
+    PTRACE(1, "CallGen\tError writing incoming audio container: " << container.GetErrorText(PChannel::LastWriteError));
+    return;
+  }
+  containerSize += length;
 }
 
-PBoolean RecordMessage::Close()
+void AudioRecorder::Finish(Recording & recording)
 {
-  reallyClose = TRUE;
-  return PDelayChannel::Close();
+  if (recording.dropped > 0)
+    PTRACE(2, "CallGen\tRecording of \"" << recording.name << "\" lost " << recording.dropped << " bytes, writers too slow");
+
+  if (!container.IsOpen())
+    return;
+
+  RecordingIndexEntry entry;
+  entry.id = recording.id;
+  entry.dropped = recording.dropped;
+  entry.started = recording.started.GetTimeInSeconds()*1000 + recording.started.GetMicrosecond()/1000;
+  entry.size = recording.written;
+  entry.lastChunk = recording.lastChunk;
+  memset(entry.name, 0, sizeof(entry.name));
+  strncpy(entry.name, recording.name, sizeof(entry.name)-1);
+
+  PWaitAndSignal lock(containerMutex);
+  PINDEX size = containerIndex.GetSize();
+  memcpy(containerIndex.GetPointer(size + sizeof(entry)) + size, &entry, sizeof(entry));
+  containerRecordings++;
 }
 
+// write every recording in the index of a container as a WAV file
+PBoolean AudioRecorder::Extract(const PFilePath & filename, const PDirectory & directory, PString & error)
+{
+  PFile file;
+  if (!file.Open(filename, PFile::ReadOnly)) {
+    error = "could not be opened";
+    return FALSE;
+  }
+
+  RecordingHeader header;
+  if (!file.Read(&header, sizeof(header)) || file.GetLastReadCount() != sizeof(header) ||
+      memcmp(header.magic, RecordingMagic, sizeof(header.magic)) != 0 || header.version != RecordingVersion) {
+    error = "is not an incoming audio container";
+    return FALSE;
+  }
+
+  RecordingTrailer trailer;
+  if (!file.SetPosition(file.GetLength() - sizeof(trailer)) ||
+      !file.Read(&trailer, sizeof(trailer)) || file.GetLastReadCount() != sizeof(trailer) ||
+      memcmp(trailer.magic, RecordingIndexMagic, sizeof(trailer.magic)) != 0) {
+    error = "has no index, callgen323 did not finish writing it";
+    return FALSE;
+  }
+
+  vector<RecordingIndexEntry> index(trailer.count);
+  PINDEX indexSize = trailer.count*sizeof(RecordingIndexEntry);
+  if (!file.SetPosition(trailer.indexOffset) ||
+      (indexSize > 0 && (!file.Read(&index[0], indexSize) || file.GetLastReadCount() != indexSize))) {
+    error = "has a damaged index";
+    return FALSE;
+  }
+
+  PBYTEArray data;
+  for (size_t i = 0; i < index.size(); i++) {
+    // the chunks are linked from the last one backwards
+    vector<PInt64> chunks;
+    for (PInt64 offset = index[i].lastChunk; offset >= 0; ) {
+      RecordingChunk chunk;
+      if (!file.SetPosition(offset) || !file.Read(&chunk, sizeof(chunk)) || chunk.id != index[i].id) {
+        error = psprintf("has a damaged chunk at offset %lld", (long long)offset);
+        return FALSE;
+      }
+      chunks.push_back(offset);
+      offset = chunk.previous;
+    }
+
+    PString name(index[i].name, strnlen(index[i].name, sizeof(index[i].name)));
+    PWAVFile wavFile(directory + name, PFile::WriteOnly);
+    if (!wavFile.IsOpen()) {
+      error = "could not create " + directory + name;
+      return FALSE;
+    }
+
+    for (size_t c = chunks.size(); c-- > 0; ) {
+      RecordingChunk chunk;
+      file.SetPosition(chunks[c]);
+      file.Read(&chunk, sizeof(chunk));
+      if (!file.Read(data.GetPointer(chunk.size), chunk.size) || !wavFile.Write(data, chunk.size)) {
+        error = "could not copy " + name;
+        return FALSE;
+      }
+    }
+
+    cout << name << ": " << (PInt64)index[i].size/16 << "ms";
+    if (index[i].dropped > 0)
+      cout << ", " << index[i].dropped/16 << "ms lost while recording";
+    cout << endl;
+  }
+
+  return TRUE;
+}
@@ -27,43 +27,469 @@
 
 #include <ptclib/delaychan.h>
 #include <ptclib/pwavfile.h>
+#include <ptlib/pipechan.h>
 
 #include <h323.h>
 #include <h323pdu.h>
 
+#include <queue>
+
 #if !defined(P_USE_STANDARD_CXX_BOOL) && !defined(P_USE_INTEGER_BOOL)
     typedef int PBoolean;
 #endif
 
 ///////////////////////////////////////////////////////////////////////////////
 
-class PlayMessage : public PDelayChannel
+// xoshiro256** generator, cheap enough to give every thread its own
+class FastRandom
+{
+  public:
+    FastRandom(PUInt64 seed = 0) { SetSeed(seed); }
+
+    void SetSeed(PUInt64 seed) {
+      // expand the seed with splitmix64, as recommended for xoshiro
+      for (int i = 0; i < 4; i++) {
+        PUInt64 z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        state[i] = z ^ (z >> 31);
+      }
+    }
+
+    PUInt64 Generate() {
+      PUInt64 result = Rotate(state[1] * 5, 7) * 9;
+      PUInt64 t = state[1] << 17;
+      state[2] ^= state[0];
+      state[3] ^= state[1];
+      state[1] ^= state[2];
+      state[0] ^= state[3];
+      state[2] ^= t;
+      state[3] = Rotate(state[3], 45);
+      return result;
+    }
+
+    // uniform in [0, range)
+    unsigned Generate(unsigned range) { return (unsigned)(((Generate() >> 32) * range) >> 32); }
+
+    // uniform in (0, 1]
+    double GetReal() { return ((Generate() >> 11) + 1.0) / 9007199254740992.0; }
+
+  protected:
+    static PUInt64 Rotate(PUInt64 x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    PUInt64 state[4];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Paces the media of all calls from one thread with a timer wheel, instead
+// of every channel sleeping on its own
+class MediaPacer : public PThread
+{
+  PCLASSINFO(MediaPacer, PThread);
+  public:
+    class Client
+    {
+      public:
+        Client() : m_pacePeriod(0), m_paceDivisor(1), m_paceStart(0), m_paceCount(0), m_paceDue(0) { }
+        virtual ~Client() { }
+
+        // called on the pacer thread once per period, must not block
+        virtual void OnPace() = 0;
+
+      protected:
+        unsigned m_pacePeriod;   // in ms/m_paceDivisor, 0 when not paced
+        unsigned m_paceDivisor;
+        PUInt64  m_paceStart;    // ms of the pacer clock when it was added
+        PUInt64  m_paceCount;    // OnPace() calls so far
+        PUInt64  m_paceDue;      // tick of the next OnPace()
+      friend class MediaPacer;
+    };
+
+    enum {
+      TickTime = 5,       // ms
+      WheelSize = 256     // periods over this many ticks take several turns
+    };
+
+    struct Stats {
+      Stats() : ticks(0), overruns(0), maxLate(0), maxBusy(0) { }
+      PUInt64  ticks;
+      PUInt64  overruns;   // ticks that were not done before the next one was due
+      unsigned maxLate;    // ms a tick started late
+      unsigned maxBusy;    // ms a tick took
+    };
+
+    MediaPacer();
+    ~MediaPacer();
+
+    // every period/divisor ms, the ticks are rounded but don't add up, eg.
+    // 1000/30 for 30 fps alternates between 30 and 35 ms
+    void Add(Client & client, unsigned period, unsigned divisor = 1);
+    void Remove(Client & client);
+    void Stop();
+
+    Stats GetStats() const;
+    Stats GetIntervalStats();   // since the last call
+
+    void Main();
+
+  protected:
+    void ProcessTick();
+    void Schedule(Client & client);
+
+    PMutex           mutex;
+    vector<Client *> wheel[WheelSize];
+    PUInt64          currentTick;
+    bool             running;
+    Stats            total;
+    Stats            interval;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// The outgoing message as 8kHz 16 bit mono PCM, read once at startup and
+// shared by all calls, it is never changed after Load()
+class OutgoingMessage : public PObject
 {
-    PCLASSINFO(PlayMessage, PDelayChannel);
+    PCLASSINFO(OutgoingMessage, PObject);
   public:
-    PlayMessage(const PString & filename, unsigned frameDelay, unsigned frameSize);
+    PBoolean Load(const PString & filename, PString & error);
+    PBoolean IsEmpty() const { return samples.IsEmpty(); }
+    const BYTE * GetData() const { return samples; }
+    PINDEX GetSize() const { return samples.GetSize(); }
+  protected:
+    PBYTEArray samples;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Finds the outgoing message in the audio a call received, as sent back by an
+// echo or played by another callgen323, and measures how it was degraded.
+// The alignment is a cross-correlation done with an FFT at 2kHz, then refined
+// at 8kHz; all loops run over contiguous float arrays so the compiler can
+// vectorize them.
+class AudioComparison : public PObject
+{
+    PCLASSINFO(AudioComparison, PObject);
+  public:
+    // the outgoing message and its spectrum, prepared once and shared by all calls
+    class Reference : public PObject
+    {
+        PCLASSINFO(Reference, PObject);
+      public:
+        Reference() : length(0), capacity(0), fftSize(0) { }
+        PBoolean Prepare(const OutgoingMessage & message, unsigned seconds);
+        PBoolean IsEmpty() const { return length == 0; }
+
+      protected:
+        unsigned      length;     // samples of the message
+        unsigned      capacity;   // samples compared per call
+        unsigned      fftSize;
+        vector<float> samples;    // the message, followed by its start again for capacity samples
+        vector<float> spectrumRe; // of the decimated message, repeated like samples
+        vector<float> spectrumIm;
+        vector<float> twiddleRe;  // for each FFT stage of size 2h at h...2h-1
+        vector<float> twiddleIm;
+      friend class AudioComparison;
+    };
+
+    struct Result {
+      Result() : compared(false), aligned(false), delay(0), correlation(0), snr(0), clipped(0), dropouts(0), dropoutTime(0) { }
+      bool     compared;      // enough audio was received
+      bool     aligned;       // the message was found in it
+      unsigned delay;         // ms
+      double   correlation;   // normalized, 0..1
+      double   snr;           // dB
+      unsigned clipped;       // samples
+      unsigned dropouts;      // gaps of 20ms or more where the message has audio
+      unsigned dropoutTime;   // ms
+    };
+
+    AudioComparison(const Reference & reference);
+
+    void Add(const short * pcm, unsigned count);
+
+    // the delay is from referenceStart when the message was sent from then on,
+    // otherwise from the start of the received audio
+    Result Analyse(const PTime & referenceStart) const;
+
+    enum {
+      Decimation = 4,   // 8kHz to 2kHz for the coarse alignment
+      BlockSize = 80    // 10ms for the dropout detection
+    };
+
+    static void FFT(const Reference & reference, float * re, float * im, bool inverse);
+
+  protected:
+    const Reference & reference;
+    vector<float>     received;
+    PTime             started;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Each Read() returns one frame of the outgoing message, paced by the MediaPacer
+class PlayMessage : public PIndirectChannel, public MediaPacer::Client
+{
+    PCLASSINFO(PlayMessage, PIndirectChannel);
+  public:
+    PlayMessage(const OutgoingMessage & message, unsigned frameDelay);
+    ~PlayMessage();
+    virtual PBoolean IsOpen() const { return !closed; }
     virtual PBoolean Read(void *, PINDEX);
     virtual PBoolean Close();
+    virtual void OnPace();
   protected:
-    PWAVFile wavFile;
+    const OutgoingMessage & message;
+    PINDEX     offset;   // where this call is in the message
+    PBoolean   closed;
+    PSyncPoint frameTime;
 };
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Writes the incoming audio of all calls from a pool of writer threads, either
+// as a WAV file per call or into one container file. The codec threads only
+// copy their frames into a ring buffer per call and never wait for the disk.
+class AudioRecorder : public PObject
+{
+    PCLASSINFO(AudioRecorder, PObject);
+  public:
+    class Recording
+    {
+      public:
+        Recording(const PString & name, unsigned id);
+        ~Recording();
+
+        void Write(const void * data, PINDEX length);   // drops what does not fit
+        void Close();    // the recorder deletes it once everything is written
+
+      protected:
+        PBoolean Drain(PBYTEArray & data);    // TRUE when closed and empty
+
+        PString    name;
+        unsigned   id;
+        PTime      started;
+
+        PMutex     mutex;         // only held to copy frames in or out
+        PBYTEArray ring;
+        PINDEX     head;          // where the next frame goes
+        PINDEX     count;         // bytes waiting
+        bool       closed;
+        unsigned   dropped;       // bytes that did not fit
+
+        PWAVFile * wavFile;       // only used by the writers
+        PInt64     written;
+        PInt64     lastChunk;     // in the container, -1 for none
+      friend class AudioRecorder;
+    };
+
+    AudioRecorder(
+      const PDirectory & directory,   // for WAV files, when there is no container
+      const PFilePath & container,
+      unsigned threads
+    );
+    ~AudioRecorder();
+
+    PBoolean IsOpen() const { return !writers.empty(); }
+    Recording * Open(const PString & name);
+    void Stop();
+
+    static PBoolean Extract(const PFilePath & container, const PDirectory & directory, PString & error);
+
+  protected:
+    class Writer : public PThread
+    {
+        PCLASSINFO(Writer, PThread);
+      public:
+        Writer(AudioRecorder & recorder, unsigned index);
+        void Main();
+        PSyncPoint wakeup;
+      protected:
+        AudioRecorder & recorder;
+        unsigned        index;
+    };
+
+    void Flush(unsigned writer, bool final);
+    void WriteWAV(Recording & recording, const PBYTEArray & data);
+    void WriteContainer(const vector<Recording *> & recordings, const vector<PBYTEArray> & data);
+    void Finish(Recording & recording);
+
+    PDirectory directory;
+
+    PMutex     mutex;          // only held to add or take recordings
+    vector< vector<Recording *> > recordings;   // per writer
+    vector<Writer *> writers;
+    unsigned   nextId;
+    bool       stopping;
+
+    PFile      container;      // shared by the writers
+    PMutex     containerMutex;
+    PInt64     containerSize;
+    PBYTEArray containerIndex;
+    unsigned   containerRecordings;
+  friend class Writer;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct CallDetail;
+
 class RecordMessage : public PDelayChannel
 {
     PCLASSINFO(RecordMessage, PDelayChannel);
   public:
-    RecordMessage(const PString & filename, unsigned frameDelay, unsigned frameSize);
+    RecordMessage(const PString & name, unsigned frameDelay, unsigned frameSize, CallDetail * details = NULL);
+    ~RecordMessage();
     virtual PBoolean Write(const void *, PINDEX);
     virtual PBoolean Close();
   protected:
     PBoolean reallyClose;
+    PMutex   recordingMutex;
+    AudioRecorder::Recording * recording;   // with -I or --in-container
+    AudioComparison * comparison;   // with --compare-audio
+    CallDetail      * details;      // gets its result
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+#ifdef H323_VIDEO
+
+// One second of a Fake video test pattern, rendered once per pattern and
+// frame size and shared read-only by all calls sending it
+class VideoPatternCache : public PObject
+{
+    PCLASSINFO(VideoPatternCache, PObject);
+  public:
+    struct Frames {
+      unsigned width;
+      unsigned height;
+      vector<PBYTEArray> frames;   // YUV420P
+    };
+
+    ~VideoPatternCache();
+
+    static bool IsCacheable(const PString & pattern) { return pattern.Left(4) *= "Fake"; }
+
+    // renders the frames when the first call asks for them, NULL if the pattern can't be opened
+    const Frames * GetFrames(const PString & pattern, unsigned width, unsigned height, unsigned frameRate);
+
+  protected:
+    PMutex mutex;
+    map<PString, Frames *> cache;   // by pattern and frame size
+};
+
+
+// Each Read() returns the next frame of a cached pattern, paced by the MediaPacer.
+// The device only tells the codec the frame size, it never renders anything.
+class PatternVideoChannel : public PVideoChannel, public MediaPacer::Client
+{
+    PCLASSINFO(PatternVideoChannel, PVideoChannel);
+  public:
+    PatternVideoChannel(const VideoPatternCache::Frames & frames, unsigned frameRate);
+    ~PatternVideoChannel();
+    virtual PBoolean Read(void *, PINDEX);
+    virtual PBoolean Close();
+    virtual void OnPace();
+  protected:
+    const VideoPatternCache::Frames & frames;
+    size_t     index;
+    PBoolean   closed;
+    PSyncPoint frameTime;
+};
+
+#endif // H323_VIDEO
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Overwrites a percentage of the bytes of a packet with random values. The
+// random numbers are generated a block at a time and the bytes selected with
+// a branch free compare, so the compiler can vectorize the inner loop.
+class FuzzMutator
+{
+  public:
+    FuzzMutator(PUInt64 seed = 0) : random(seed) { }
+
+    void SetSeed(PUInt64 seed) { random.SetSeed(seed); }
+    FastRandom & GetRandom() { return random; }
+
+    // every byte is overwritten with a probability of percent/100
+    void Mutate(BYTE * data, PINDEX size, unsigned percent);
+
+  protected:
+    enum { BlockSize = 64 };
+
+    FastRandom random;
+};
+
+// Which mutation a fuzzed RTP or RTCP packet gets, picked by weight for every
+// packet. Except for the byte overwrites they keep the packet parseable up to
+// the field they change, so the target gets past the header checks.
+class FuzzWeights
+{
+  public:
+    enum Mutations {
+      RTPBytes,         // --fuzz-header of the header bytes
+      RTPFlags,         // version, padding, extension and CSRC count without the fields
+      RTPCSRC,          // CSRCs, with a true or false count
+      RTPExtension,     // header extension, with a true or false length
+      RTPPadding,       // padding, with a true or false count
+      RTPSequence,      // sequence number jumps
+      RTPTimestamp,     // timestamp jumps
+      RTPPayloadType,   // other payload types and marker bits
+      RTCPBytes,        // --fuzz-rtcp of all bytes
+      RTCPLength,       // false length of one packet of the compound
+      RTCPOrder,        // compound packets shuffled, with BYE and APP packets
+      RTCPReports,      // SR or RR with report blocks, with a true or false count
+      NumMutations
+    };
+
+    FuzzWeights();   // only byte overwrites
+
+    PBoolean Parse(const PString & spec, PString & error);
+    Mutations Pick(FastRandom & random, bool rtcp) const;
+
+  protected:
+    unsigned weights[NumMutations];
+};
+
+// The last packets a fuzzing channel sent, written to a pcap file when the
+// peer goes away, and the packets of such a file read back for --fuzz-replay
+class FuzzCapture
+{
+  public:
+    struct Packet {
+      Packet() : time(0), rtcp(false), size(0) { }
+      PInt64     time;     // us since 1970
+      bool       rtcp;
+      PINDEX     size;
+      PBYTEArray data;     // only grows, so the ring reuses the buffers
+    };
+
+    FuzzCapture(PINDEX maxPackets = 0);   // 0 for no limit
+
+    void Add(const BYTE * data, PINDEX size, bool rtcp);
+
+    // oldest first, only for a capture that isn't added to any more
+    PINDEX GetSize() const { return packets.size(); }
+    const Packet & operator[](PINDEX i) const { return packets[(next + i) % packets.size()]; }
+
+    PBoolean Write(const PFilePath & filename, const H323TransportAddress & localRTP, const H323TransportAddress & localRTCP,
+                   const H323TransportAddress & remoteRTP, const H323TransportAddress & remoteRTCP, PString & error) const;
+    PBoolean Read(const PFilePath & filename, PString & error);
+
+  protected:
+    PMutex         mutex;
+    PINDEX         maxPackets;
+    vector<Packet> packets;
+    PINDEX         next;    // the oldest packet once the ring is full
+};
+
 class MyH323EndPoint;
 
 class RTPFuzzingChannel : public H323_ExternalRTPChannel
@@ -74,10 +500,19 @@ public:
     virtual ~RTPFuzzingChannel();
 
     virtual PBoolean Start();
+    virtual void Close();
     PDECLARE_NOTIFIER(PTimer, RTPFuzzingChannel, TransmitRTP);
     PDECLARE_NOTIFIER(PTimer, RTPFuzzingChannel, TransmitRTCP);
+    PDECLARE_NOTIFIER(PTimer, RTPFuzzingChannel, TransmitReplay);
+
+    static void RequestCaptures();   // from a signal handler
 
 protected:
+    PINDEX MutateRTP(FuzzWeights::Mutations mutation, PINDEX payloadSize);
+    PINDEX MutateRTCP(FuzzWeights::Mutations mutation);
+    void Send(const BYTE * data, PINDEX size, bool rtcp);
+    void WriteCapture(const char * reason);
+
     PUDPSocket m_rtpSocket;
     PUDPSocket m_rtcpSocket;
     RTP_DataFrame m_rtpPacket;
@@ -88,9 +523,258 @@ protected:
     RTP_DataFrame::PayloadTypes m_payloadType;
     DWORD m_syncSource;
     DWORD m_timestamp;
+    FuzzMutator m_rtpMutator;    // RTP and RTCP may be sent from different timer threads
+    FuzzMutator m_rtcpMutator;
+    FuzzWeights m_weights;
+    PBYTEArray m_rtpBuffer;      // for the structure aware mutations
+    PBYTEArray m_rtcpBuffer;
     unsigned m_percentBadRTPHeader;
     unsigned m_percentBadRTPMedia;
     unsigned m_percentBadRTCP;
+
+    FuzzCapture * m_capture;     // NULL without --fuzz-capture
+    PFilePath m_captureFile;
+    int m_captureRequests;       // the requests already written
+    bool m_peerGone;
+
+    const FuzzCapture * m_replay;
+    PINDEX m_replayIndex;
+    PTimeInterval m_replayStart;
+    PTimer m_replayTimer;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// The outgoing message encoded once with one codec, as RTP payloads
+class EncodedMedia : public PObject
+{
+    PCLASSINFO(EncodedMedia, PObject);
+  public:
+    EncodedMedia();
+
+    PBoolean Encode(const H323Capability & capability, const OutgoingMessage & message);
+
+    struct Packet {
+      PBYTEArray payload;
+      DWORD      timestamp;   // from the start of the message
+    };
+
+    PINDEX GetSize() const { return packets.size(); }
+    const Packet & operator[](PINDEX i) const { return packets[i]; }
+    DWORD GetDuration() const { return duration; }          // in timestamp units
+    unsigned GetPacketTime() const { return packetTime; }   // in ms
+    RTP_DataFrame::PayloadTypes GetPayloadType() const { return payloadType; }
+
+  protected:
+    vector<Packet> packets;
+    DWORD          duration;
+    unsigned       packetTime;
+    RTP_DataFrame::PayloadTypes payloadType;
+};
+
+
+#ifdef H323_VIDEO
+
+// An H.264 or H.263 elementary stream, split into RTP payloads once and sent
+// by all calls using that codec
+class EncodedVideo : public PObject
+{
+    PCLASSINFO(EncodedVideo, PObject);
+  public:
+    enum Packetization {
+      H264,       // RFC 6184, single NAL units and FU-A
+      H263,       // RFC 2190 mode A
+      H263Plus    // RFC 4629
+    };
+
+    static PBoolean GetPacketization(const PString & formatName, Packetization & packetization);
+    static PString GetFileName(Packetization packetization, const char * frameSize);
+
+    PBoolean Load(const PFilePath & filename, Packetization packetization, PString & error);
+
+    struct Frame {
+      vector<PBYTEArray> packets;   // RTP payloads, the last one gets the marker bit
+      bool keyFrame;
+    };
+
+    size_t GetSize() const { return frames.size(); }
+    const Frame & operator[](size_t i) const { return frames[i]; }
+
+  protected:
+    void AddH264(const BYTE * data, PINDEX size);
+    void AddH263(const BYTE * data, PINDEX size, bool plus);
+
+    vector<Frame> frames;
+};
+
+#endif // H323_VIDEO
+
+
+// Sends the pre-encoded outgoing message instead of running the encoder,
+// incoming media on its ports is ignored
+class RTPReplayChannel : public H323_ExternalRTPChannel, public MediaPacer::Client
+{
+    PCLASSINFO(RTPReplayChannel, H323_ExternalRTPChannel);
+public:
+    RTPReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID, const EncodedMedia & media, WORD rtpPort, WORD rtcpPort);
+    virtual ~RTPReplayChannel();
+
+    virtual PBoolean Start();
+    virtual void Close();
+    virtual void OnPace();   // send the next RTP packet
+    PDECLARE_NOTIFIER(PTimer, RTPReplayChannel, TransmitRTCP);
+
+protected:
+    // for media other than the outgoing message, paced every packetTime/divisor ms
+    RTPReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID,
+                     RTP_DataFrame::PayloadTypes payloadType, unsigned packetTime, unsigned divisor, WORD rtpPort, WORD rtcpPort);
+    void OpenSockets(MyH323EndPoint & ep, WORD rtpPort, WORD rtcpPort);
+    void SendRTP(const PBYTEArray & payload, DWORD timestamp, bool marker);
+
+    const EncodedMedia * m_media;
+    unsigned m_packetTime;          // ms, divided by m_packetTimeDivisor
+    unsigned m_packetTimeDivisor;
+    PUDPSocket m_rtpSocket;
+    PUDPSocket m_rtcpSocket;
+    RTP_DataFrame m_rtpPacket;
+    PTimer m_rtcpTransmitTimer;
+    RTP_DataFrame::PayloadTypes m_payloadType;
+    DWORD m_syncSource;
+    DWORD m_timestampBase;
+    PINDEX m_index;
+    DWORD m_packetsSent;
+    DWORD m_octetsSent;
+};
+
+#ifdef H323_VIDEO
+
+// Sends a pre-encoded video stream, one frame per tick at the --framerate
+class VideoReplayChannel : public RTPReplayChannel
+{
+    PCLASSINFO(VideoReplayChannel, RTPReplayChannel);
+public:
+    VideoReplayChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID,
+                       const EncodedVideo & video, unsigned frameRate, WORD rtpPort, WORD rtcpPort);
+
+    virtual void OnPace();   // send all packets of the next frame
+
+protected:
+    const EncodedVideo & m_video;
+    DWORD m_frameTime;       // in 90kHz timestamp units
+};
+
+#endif // H323_VIDEO
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Takes part in the logical channel signaling like any other channel, but has
+// no RTP sockets and no codec and never sends or receives media
+class SignalingOnlyChannel : public H323_ExternalRTPChannel
+{
+    PCLASSINFO(SignalingOnlyChannel, H323_ExternalRTPChannel);
+public:
+    SignalingOnlyChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, Directions direction, unsigned sessionID, WORD rtpPort);
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// what an RTP session received, as it last reported it
+struct RTPReceiveStats
+{
+  enum Media {
+    Audio,
+    Video,
+    NumMedia
+  };
+  static bool GetMedia(unsigned sessionID, Media & media);
+
+  RTPReceiveStats()
+    : valid(false), packets(0), octets(0), lost(0), outOfOrder(0), late(0), avgJitter(0), maxJitter(0)
+    { }
+
+  void Update(const RTP_Session & session);
+
+  bool  valid;
+  DWORD packets;
+  DWORD octets;
+  DWORD lost;
+  DWORD outOfOrder;
+  DWORD late;
+  DWORD avgJitter;    // ms
+  DWORD maxJitter;    // ms
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef H323_VIDEO
+
+// Receives video without a codec, it only checks the RTP packets and counts
+// frames, key frames, sequence gaps and the bit rate of the call
+class VideoCountingChannel : public H323_ExternalRTPChannel
+{
+    PCLASSINFO(VideoCountingChannel, H323_ExternalRTPChannel);
+public:
+    VideoCountingChannel(MyH323EndPoint & ep, H323Connection & connection, const H323Capability & capability, unsigned sessionID, WORD rtpPort);
+    virtual ~VideoCountingChannel();
+
+    virtual PBoolean Start();
+    virtual void Close();
+
+protected:
+    class Receiver : public PThread
+    {
+        PCLASSINFO(Receiver, PThread);
+      public:
+        Receiver(VideoCountingChannel & channel);
+        void Main();
+      protected:
+        VideoCountingChannel & channel;
+    };
+
+    void OnPacket(const BYTE * data, PINDEX size, const PIPSocket::Address & from, WORD port);
+    bool IsKeyFrame(const BYTE * payload, PINDEX size) const;
+    bool StopReceiver();
+    void Report();
+
+    PUDPSocket m_rtpSocket;
+    PUDPSocket m_rtcpSocket;   // RTCP is ignored
+    Receiver * m_receiver;
+    PMutex m_mutex;
+    bool m_knownPacketization;
+    EncodedVideo::Packetization m_packetization;
+
+    RTPReceiveStats m_stats;
+    DWORD m_invalid;          // not RTP version 2 or too short
+    DWORD m_frames;
+    DWORD m_keyFrames;
+    DWORD m_gaps;             // sequence number jumps
+    WORD m_lastSequence;
+    DWORD m_lastTimestamp;
+    bool m_frameIsKey;        // a key frame was already counted for the current timestamp
+    PInt64 m_firstArrival;    // ms
+    PInt64 m_lastArrival;
+    PInt64 m_lastKeyFrame;
+    PInt64 m_keyFrameIntervals;   // sum of the intervals in ms
+    double m_jitter;          // RFC 3550 interarrival jitter in timestamp units
+    PInt64 m_lastTransit;
+    double m_jitterSum;
+};
+
+#endif // H323_VIDEO
+
+// ITU-T G.107 E-model estimate of the listening quality of an audio session
+class EModel
+{
+  public:
+    EModel(const PString & codec);   // by format name, eg. "G.729A"
+
+    double GetRFactor(const RTPReceiveStats & stats) const;
+    static double GetMOS(double rFactor);
+
+  protected:
+    double   ie;           // equipment impairment factor of the codec
+    double   bpl;          // packet loss robustness factor of the codec
+    unsigned packetTime;   // ms
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -102,7 +786,8 @@ struct CallDetail
       openedReceiveMedia(0),
       receivedMedia(0),
       receivedAudio(false),
-      receivedVideo(false)
+      receivedVideo(false),
+      recordedAlerting(false)
     { }
 
   PTime                openedTransmitMedia;
@@ -110,14 +795,70 @@ struct CallDetail
   PTime                receivedMedia;
   bool                 receivedAudio;
   bool                 receivedVideo;
+  bool                 recordedAlerting;
   H323TransportAddress mediaGateway;
+  RTPReceiveStats      received[RTPReceiveStats::NumMedia];
+  PString              audioCodec;    // received
+  AudioComparison::Result audioComparison;
 
   void Drop(H323Connection & connection);
 
-  void OnRTPStatistics(const RTP_Session & session, const PString & token);
+  void OnEstablished(const H323Connection & connection);
+  void OnRTPStatistics(const RTP_Session & session, const H323Connection & connection);
+  void OnMediaReceived(RTPReceiveStats::Media media, const H323TransportAddress & from, const H323Connection & connection);
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+// One call detail record, all times in ms, the event times are offsets from
+// the call setup and -1 if the event did not happen
+struct CDRRecord
+{
+  enum Formats {
+    CSV,
+    JSON,
+    Binary,     // fixed size little endian records after a file header
+    NumFormats
+  };
+  static PBoolean ParseFormat(const PString & name, Formats & format);
+
+  enum {
+    BinaryHeaderSize = 16,
+    BinaryRecordSize = 320
+  };
+
+  CDRRecord();
+
+  PInt64   setupTime;         // ms since 1 Jan 1970
+  PInt64   duration;
+  PInt64   transmitMediaOpen;
+  PInt64   receiveMediaOpen;
+  PInt64   mediaReceived;
+  PInt64   alerting;
+  PInt64   connect;
+  unsigned endReason;
+  PString  remoteParty;
+  PString  signalingGateway;
+  PString  mediaGateway;
+  PString  callId;
+  PString  callToken;
+  RTPReceiveStats received[RTPReceiveStats::NumMedia];
+  double   rFactor;           // of the received audio, -1 if unknown
+  double   mos;
+
+  static PBYTEArray GetHeader(Formats format);
+  void Encode(Formats format, PBYTEArray & data) const;
+
+  PString AsCSV() const;
+  PString AsJSON() const;
+  void AsBinary(BYTE * data) const;
+  PBoolean FromCSV(const PString & line);
+  PBoolean FromJSON(const PString & line);
+  void FromBinary(const BYTE * data);
+  static PBoolean IsBinaryHeader(const BYTE * data);
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class MyH323EndPoint;
@@ -154,14 +895,20 @@ class MyH323Connection : public H323Connection
                                                        unsigned sessionID, const H245_H2250LogicalChannelParameters * param, RTP_QOS * rtpqos = NULL);
 
     virtual void OnRTPStatistics(const RTP_Session & session) const;
+    virtual void OnClosedLogicalChannel(const H323Channel & channel);
+
+    unsigned GetCallNumber() const { return m_callNumber; }
 
     CallDetail details;
 
   protected:
     MyH323EndPoint & endpoint;
+    unsigned m_callNumber;    // in the order the endpoint created the calls
     PVideoChannel * videoChannelIn;
     PVideoChannel * videoChannelOut;
-    map<unsigned, WORD> m_sessionPorts;
+    WORD GetSessionPort(unsigned sessionID);
+
+    map<unsigned, WORD> m_sessionPorts;   // used by both directions of a session
     bool m_isH239ready;
     bool m_haveStartedH239;
     PTimer m_h239StartTimer;
@@ -175,6 +922,7 @@ class MyH323EndPoint : public H323EndPoint
     PCLASSINFO(MyH323EndPoint, H323EndPoint);
   public:
     MyH323EndPoint();
+    ~MyH323EndPoint();
 
     // override from H323EndPoint
     virtual H323Connection * CreateConnection(unsigned callReference);
@@ -197,6 +945,11 @@ class MyH323EndPoint : public H323EndPoint
 
     void SetVideoPattern(const PString & pattern, bool isH239 = false) { if (isH239) m_h239videoPattern = pattern; else m_videoPattern = pattern; }
     PString GetVideoPattern(bool isH239) const { return isH239 ? m_h239videoPattern : m_videoPattern; }
+#ifdef H323_VIDEO
+    VideoPatternCache & GetVideoPatternCache() { return m_videoPatternCache; }
+#endif
+
+    PINDEX GetActiveCalls() const { return connectionsActive.GetSize(); }
 
     void SetFrameRate(unsigned fps) { m_frameRate = fps; }
     unsigned GetFrameRate() const { return m_frameRate; }
@@ -209,6 +962,30 @@ class MyH323EndPoint : public H323EndPoint
     unsigned GetPercentBadRTPMedia() const { return m_percentBadRTPMedia; }
     void SetPercentBadRTCP(unsigned val) { m_percentBadRTCP = val; }
     unsigned GetPercentBadRTCP() const { return m_percentBadRTCP; }
+    void SetFuzzWeights(const FuzzWeights & weights) { m_fuzzWeights = weights; }
+    const FuzzWeights & GetFuzzWeights() const { return m_fuzzWeights; }
+
+    void SetReplay(bool val) { m_replay = val; }
+    bool IsReplay() const { return m_replay; }
+    void SetSignalingOnly(bool val) { m_signalingOnly = val; }
+    bool IsSignalingOnly() const { return m_signalingOnly; }
+    void SetFuzzSeed(PUInt64 seed) { m_fuzzSeed = seed; m_fuzzSeeded = true; }
+    bool GetFuzzSeed(PUInt64 & seed) const { seed = m_fuzzSeed; return m_fuzzSeeded; }
+    void SetFuzzCapture(const PDirectory & dir, PINDEX packets) { m_fuzzCaptureDir = dir; m_fuzzCaptureSize = packets; }
+    const PString & GetFuzzCaptureDir() const { return m_fuzzCaptureDir; }
+    PINDEX GetFuzzCaptureSize() const { return m_fuzzCaptureSize; }
+    PBoolean SetFuzzReplay(const PFilePath & filename, PString & error) { return m_fuzzReplay.Read(filename, error); }
+    const FuzzCapture * GetFuzzReplay() const { return m_fuzzReplay.GetSize() > 0 ? &m_fuzzReplay : NULL; }
+    unsigned GetNextCallNumber() { return ++m_callNumbers; }
+    PIPSocket::Address GetListenerAddress() const;
+    const EncodedMedia * GetEncodedMessage(const H323Capability & capability);
+#ifdef H323_VIDEO
+    void SetVideoReplay(const PDirectory & dir) { m_videoReplayDir = dir; }
+    bool IsVideoReplay() const { return !m_videoReplayDir.IsEmpty(); }
+    const EncodedVideo * GetEncodedVideo(const H323Capability & capability);
+    void SetVideoDecode(unsigned oneIn) { m_videoDecode = oneIn; }
+    bool IsVideoDecode();
+#endif
 
     void SetStartH239(bool start) { m_startH239 = start; }
     bool IsStartH239() const { return m_startH239; }
@@ -222,17 +999,258 @@ class MyH323EndPoint : public H323EndPoint
     BYTE m_rateMultiplier;
     PString m_videoPattern;
     PString m_h239videoPattern;
+#ifdef H323_VIDEO
+    VideoPatternCache m_videoPatternCache;
+#endif
     unsigned m_frameRate;
     H323Capability::CapabilityFrameSize m_maxFrameSize;
     bool m_fuzzing;
     unsigned m_percentBadRTPHeader;
     unsigned m_percentBadRTPMedia;
     unsigned m_percentBadRTCP;
+    FuzzWeights m_fuzzWeights;
+    bool m_replay;
+    bool m_signalingOnly;
+    PUInt64 m_fuzzSeed;
+    bool m_fuzzSeeded;
+    PString m_fuzzCaptureDir;
+    PINDEX m_fuzzCaptureSize;
+    FuzzCapture m_fuzzReplay;
+    PAtomicInteger m_callNumbers;
+    PMutex m_encodedMutex;
+    map<PString, EncodedMedia *> m_encodedMessages;   // by codec, NULL if it can't be used
+#ifdef H323_VIDEO
+    PString m_videoReplayDir;
+    map<PString, EncodedVideo *> m_encodedVideos;     // by file, NULL if it can't be used
+    unsigned m_videoDecode;                           // decode one in n incoming video channels, 0 for none
+    PAtomicInteger m_videoReceivers;
+#endif
     bool m_startH239;
     int m_h239delay;
     int m_h239duration;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+
+// Random call or wait durations in milliseconds
+class Distribution : public PObject
+{
+  PCLASSINFO(Distribution, PObject);
+  public:
+    enum Types {
+      Uniform,
+      Fixed,
+      Exponential,
+      LogNormal,
+      Empirical
+    };
+
+    Distribution();
+
+    // type[:parameters], defaults derived from tmin/tmax
+    PBoolean Parse(const PString & spec, const PTimeInterval & tmin, const PTimeInterval & tmax, PString & error);
+    PTimeInterval Generate(FastRandom & rand) const;
+    virtual void PrintOn(ostream & strm) const;
+
+  protected:
+    PBoolean LoadHistogram(const PFilePath & filename, PString & error);
+
+    Types  type;
+    double minimum;           // ms
+    double maximum;           // ms
+    double mean;              // ms
+    double mu;                // lognormal
+    double sigma;             // lognormal
+    vector<double> bounds;    // empirical: upper bound of each bin in ms
+    vector<double> weights;   // empirical: cumulative weight of each bin
+    PString histogramFile;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// When each simultaneous call makes its first call
+class StartupPolicy : public PObject
+{
+  PCLASSINFO(StartupPolicy, PObject);
+  public:
+    enum Types {
+      Stagger,    // random, about 500 ms per call
+      Burst,      // all at once
+      Ramp,       // linear over a given time
+      RampCPS     // at a given rate of calls per second
+    };
+
+    StartupPolicy() : type(Stagger), slots(1), value(0) { }
+
+    PBoolean Parse(const PString & spec, unsigned slots, PString & error);
+    PTimeInterval GetInitialDelay(unsigned index, FastRandom & rand) const;
+    PTimeInterval GetRampTime() const;
+    virtual void PrintOn(ostream & strm) const;
+
+  protected:
+    Types    type;
+    unsigned slots;
+    double   value;   // ramp time in ms or calls per second
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Lock-free log-linear histogram of durations in milliseconds, exact up to
+// 63 ms and within about 3% above, similar to an HDR histogram
+class LatencyHistogram
+{
+  public:
+    enum {
+      SubBuckets = 32,
+      NumBuckets = 2*SubBuckets + 16*SubBuckets   // up to about 70 minutes
+    };
+
+    struct Snapshot {
+      Snapshot() : counts(NumBuckets) { }
+
+      unsigned GetCount() const;
+      unsigned GetPercentile(double percentile) const;  // in ms
+      unsigned GetMax() const;                          // in ms
+      Snapshot operator-(const Snapshot & other) const;
+      void Add(const PTimeInterval & value);
+
+      vector<unsigned> counts;
+    };
+
+    void Record(const PTimeInterval & value) { ++counts[GetBucket(value.GetMilliSeconds())]; }
+    void GetSnapshot(Snapshot & snapshot) const;
+
+    static PINDEX GetBucket(PInt64 ms);
+    static unsigned GetBucketValue(PINDEX bucket);    // highest value in the bucket
+
+  protected:
+    PAtomicInteger counts[NumBuckets];
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Call counters, sharded by thread so the call path never contends on a
+// single cache line and reporting never takes a lock
+class CallStats
+{
+  public:
+    enum Counters {
+      Attempts,
+      Established,
+      ReceivedAudio,
+      ReceivedVideo,
+      FirstCleared,   // one counter per CallEndReason from here
+      FirstFailed = FirstCleared + H323Connection::NumCallEndReasons,  // cleared before established
+      NumCounters = FirstFailed + H323Connection::NumCallEndReasons
+    };
+
+    struct Snapshot {
+      Snapshot() { memset(counters, 0, sizeof(counters)); }
+
+      unsigned Get(Counters counter) const { return counters[counter]; }
+      unsigned GetCleared(H323Connection::CallEndReason reason) const { return counters[FirstCleared + reason]; }
+      unsigned GetFailed(H323Connection::CallEndReason reason) const { return counters[FirstFailed + reason]; }
+      Snapshot operator-(const Snapshot & other) const;
+
+      unsigned counters[NumCounters];
+    };
+
+    // times from call setup
+    enum Latencies {
+      AlertingLatency,
+      ConnectLatency,
+      TransmitMediaLatency,
+      ReceiveMediaLatency,
+      FirstMediaLatency,
+      NumLatencies
+    };
+
+    // MOS of the audio sessions in steps of 0.01
+    struct MOSDistribution {
+      enum { NumBuckets = 351 };   // 1.00 to 4.50
+
+      MOSDistribution() : counts(NumBuckets) { }
+
+      void Add(double mos);
+      unsigned GetCount() const;
+      unsigned GetCount(double from, double to) const;   // from <= MOS < to
+      double GetMean() const;
+      double GetPercentile(double percentile) const;
+      MOSDistribution operator-(const MOSDistribution & other) const;
+      void PrintOn(ostream & strm) const;
+
+      vector<unsigned> counts;
+    };
+
+    // receive totals of the RTP sessions of the cleared calls
+    struct RTPTotals {
+      RTPTotals() : sessions(0), packets(0), octets(0), lost(0), outOfOrder(0), late(0), avgJitter(0) { }
+      RTPTotals operator-(const RTPTotals & other) const;
+      double GetLossPercent() const;
+
+      PUInt64 sessions;
+      PUInt64 packets;
+      PUInt64 octets;
+      PUInt64 lost;
+      PUInt64 outOfOrder;
+      PUInt64 late;
+      PUInt64 avgJitter;   // sum of the average jitter of all sessions
+      LatencyHistogram::Snapshot maxJitter;   // of each session
+      MOSDistribution mos;                    // audio only
+    };
+
+    void Increment(Counters counter) { ++GetShard().counters[counter]; }
+    void OnCleared(H323Connection::CallEndReason reason, bool established);
+    void RecordLatency(Latencies latency, const PTime & setupTime, const PTime & eventTime);
+    void RecordRTP(RTPReceiveStats::Media media, const RTPReceiveStats & stats, double mos = -1);
+    void GetRTPTotals(RTPTotals totals[RTPReceiveStats::NumMedia]) const;
+
+    // --compare-audio results of the cleared calls
+    struct ComparisonTotals {
+      ComparisonTotals() : calls(0), aligned(0), snr(0), clipped(0), dropouts(0) { }
+      ComparisonTotals operator-(const ComparisonTotals & other) const;
+      void PrintOn(ostream & strm) const;
+
+      unsigned calls;
+      unsigned aligned;     // calls where the outgoing message was found
+      double   snr;         // sum over the aligned calls
+      unsigned clipped;     // calls with clipping
+      unsigned dropouts;    // calls with dropouts
+      LatencyHistogram::Snapshot delay;
+    };
+
+    void RecordComparison(const AudioComparison::Result & result);
+    ComparisonTotals GetComparisonTotals() const;
+    static void PrintRTPTotals(ostream & strm, const RTPTotals totals[RTPReceiveStats::NumMedia]);
+
+    unsigned Get(Counters counter) const;
+    void GetSnapshot(Snapshot & snapshot) const;
+    void GetLatencies(LatencyHistogram::Snapshot snapshots[NumLatencies]) const;
+    static void PrintLatencies(ostream & strm, const LatencyHistogram::Snapshot snapshots[NumLatencies]);
+
+  protected:
+    enum { NumShards = 16 };
+
+    struct Shard {
+      PAtomicInteger counters[NumCounters];
+      char padding[64];   // keep neighbouring shards off the same cache line
+    };
+
+    Shard & GetShard();
+
+    Shard shards[NumShards];
+    LatencyHistogram latencies[NumLatencies];
+
+    // updated once per call, a mutex is cheap enough and keeps 64 bit sums
+    PMutex    rtpMutex;
+    RTPTotals rtpTotals[RTPReceiveStats::NumMedia];
+    ComparisonTotals comparisonTotals;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class CallGen;
@@ -250,6 +1268,9 @@ struct CallParams
   PTimeInterval tmax_call;
   PTimeInterval tmin_wait;
   PTimeInterval tmax_wait;
+  Distribution  callTime;
+  Distribution  waitTime;
+  StartupPolicy startup;
 };
 
 
@@ -277,6 +1298,248 @@ class CallThread : public PThread
 PLIST(CallThreadList, CallThread);
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+// A copy of callgen323 started with --worker, with its share of the calls
+class WorkerProcess : public PThread
+{
+  PCLASSINFO(WorkerProcess, PThread);
+  public:
+    WorkerProcess(
+      unsigned index,
+      const PFilePath & program,
+      const PStringArray & arguments
+    );
+    void Main();
+    void Stop();
+
+    unsigned GetAttempts() const;
+    unsigned GetEstablished() const;
+    unsigned GetActive() const;
+
+  protected:
+    void OnLine(const PString & line);
+
+    unsigned       index;
+    PPipeChannel   pipe;
+    PMutex         mutex;
+    unsigned       attempts;
+    unsigned       established;
+    unsigned       active;
+};
+
+PLIST(WorkerProcessList, WorkerProcess);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Writes call detail records from a background thread in batches, so clearing
+// calls never waits for the disk, and rotates the file by size or age
+class CDRWriter : public PThread
+{
+  PCLASSINFO(CDRWriter, PThread);
+  public:
+    CDRWriter(
+      const PFilePath & filename,
+      const PBYTEArray & header,
+      off_t maxSize,                // 0 for no size based rotation
+      const PTimeInterval & maxAge  // 0 for no time based rotation
+    );
+    ~CDRWriter();
+
+    PBoolean IsOpen() const { return file.IsOpen(); }
+    const PFilePath & GetFilePath() const { return filename; }
+
+    void Write(const PBYTEArray & record);
+    void Close();
+
+    void Main();
+
+  protected:
+    PBoolean OpenFile();
+    void WriteBatch(const vector<PBYTEArray> & batch);
+    void Rotate();
+
+    PFilePath          filename;
+    PBYTEArray         header;
+    off_t              maxSize;
+    PTimeInterval      maxAge;
+
+    PMutex             mutex;        // only held to add or take records
+    vector<PBYTEArray> pending;
+    PSyncPoint         wakeup;
+    bool               stopping;
+
+    PFile              file;         // only used by the writer thread
+    off_t              fileSize;
+    PTime              fileOpened;
+    unsigned           fileRecords;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Statistics over CDR files in any format for --analyze, in a single pass
+// and without keeping the records
+class CDRAnalyzer
+{
+  public:
+    CDRAnalyzer();
+
+    PBoolean Analyze(const PFilePath & filename, PString & error);
+    void Add(const CDRRecord & record);
+    void PrintOn(ostream & strm) const;
+
+  protected:
+    PBoolean AnalyzeBinary(PFile & file, PString & error);
+    PBoolean AnalyzeText(PTextFile & file, PString & error);
+
+    PUInt64  records;
+    PUInt64  established;
+    PUInt64  invalid;
+    PUInt64  totalDuration;    // of the established calls
+    PUInt64  cleared[H323Connection::NumCallEndReasons];
+    PUInt64  failed[H323Connection::NumCallEndReasons];
+    PTime    firstSetup;
+    PTime    lastSetup;
+    LatencyHistogram::Snapshot latencies[CallStats::NumLatencies];
+    CallStats::MOSDistribution mos;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Offered call rate over time, as a sequence of linear phases
+class LoadProfile : public PObject
+{
+  PCLASSINFO(LoadProfile, PObject);
+  public:
+    LoadProfile() { }
+
+    PBoolean Load(const PFilePath & filename, PString & error);
+    void SetConstant(double cps);
+    void Scale(double factor);
+
+    // advance time to where the expected number of arrivals has grown by the
+    // given amount, returns FALSE if the profile ends before that
+    PBoolean Advance(double & time, double arrivals) const;
+    // expected number of arrivals from the start up to the given time
+    double GetArrivals(double time) const;
+    PINDEX GetPhase(double time) const;
+    PString GetPhaseDescription(PINDEX phase) const;
+    PTimeInterval GetDuration() const;
+
+  protected:
+    struct Phase {
+      PString name;
+      double  start;      // ms since start of profile
+      double  duration;   // ms, negative for no end
+      double  fromRate;   // calls per ms
+      double  toRate;     // calls per ms
+
+      double GetRate(double offset) const;
+      double GetArrivals(double offset) const;
+    };
+
+    vector<Phase> phases;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+class CallScheduler : public PObject
+{
+  PCLASSINFO(CallScheduler, PObject);
+  public:
+    CallScheduler(
+      const CallParams & params,
+      unsigned workers
+    );
+    ~CallScheduler();
+
+    void AddSlot(unsigned index, const PStringArray & destinations);
+    void SetArrivals(const LoadProfile & profile, bool poisson, unsigned total, const PStringArray & destinations);
+    void Start();
+    void Stop();
+    PBoolean IsFinished() const;
+
+  protected:
+    // state of one simultaneous call, replaces a CallThread
+    struct Slot {
+      enum States {
+        e_Starting,
+        e_Calling,
+        e_Establishing,
+        e_Holding,
+        e_Arrivals
+      };
+
+      Slot(unsigned idx, const PStringArray & dest, bool single = false)
+        : index(idx), destinations(dest), count(1), state(e_Starting), oneShot(single) { }
+
+      unsigned      index;
+      PStringArray  destinations;
+      unsigned      count;
+      States        state;
+      bool          oneShot;    // open-loop call, ends after the first call
+      PString       token;
+      PTimeInterval holdTime;
+      PTimeInterval establishDeadline;
+    };
+
+    struct Event {
+      Event(const PTimeInterval & t, Slot * s) : due(t), slot(s) { }
+      // priority_queue keeps the largest element on top, we want the earliest
+      bool operator<(const Event & other) const { return due > other.due; }
+
+      PTimeInterval due;
+      Slot *        slot;
+    };
+
+    class Worker : public PThread
+    {
+      PCLASSINFO(Worker, PThread);
+      public:
+        Worker(CallScheduler & scheduler, unsigned index);
+        void Main();
+      protected:
+        CallScheduler & scheduler;
+    };
+
+    void RunWorker();
+    PBoolean Process(Slot & slot, FastRandom & rand, PTimeInterval & delay);
+    PBoolean ProcessArrivals(FastRandom & rand, PTimeInterval & delay);
+    void Schedule(Slot & slot, const PTimeInterval & delay);
+    void ReportArrivals(const PTimeInterval & now, bool final);
+
+    CallParams               params;
+    unsigned                 numWorkers;
+    vector<Worker *>         workers;
+    vector<Slot *>           slots;
+    priority_queue<Event>    queue;
+    PMutex                   queueMutex;
+    PSyncPoint               wakeup;
+    unsigned                 activeSlots;
+    bool                     stopping;
+
+    // open-loop arrival process for --cps and --profile
+    Slot *                   arrivals;
+    LoadProfile              profile;
+    PINDEX                   currentPhase;
+    bool                     poissonArrivals;
+    unsigned                 arrivalTotal;      // 0 for infinite
+    unsigned                 arrivalCount;
+    double                   nextArrival;       // ms since arrivalStart
+    PTimeInterval            arrivalStart;
+    PTimeInterval            lastReport;
+    unsigned                 lastReportCount;
+    unsigned                 lastReportAttempts;
+    unsigned                 lastReportEstablished;
+    unsigned                 startAttempts;
+    unsigned                 startEstablished;
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 class CallGen : public PProcess
@@ -289,14 +1552,38 @@ class CallGen : public PProcess
     static CallGen & Current() { return (CallGen&)PProcess::Current(); }
 
     PString    outgoingMessageFile;
+    OutgoingMessage outgoingMessage;
+    AudioComparison::Reference audioReference;   // empty without --compare-audio
     PString    incomingAudioDirectory;
-    PTextFile  cdrFile;
+    CDRWriter * cdrWriter;
+    MediaPacer * pacer;
+    AudioRecorder * recorder;
 
     PSyncPoint threadEnded;
-    unsigned   totalAttempts;
-    unsigned   totalEstablished;
+    CallStats  stats;
+    bool       quiet;
     PMutex     coutMutex;
 
+    // count simultaneous calls that made their first call, to mark the end of the ramp up
+    void OnSlotStarted();
+    PTime          startTime;
+    PTime          steadyStateTime;
+    unsigned       totalSlots;
+    PAtomicInteger startedSlots;
+
+    // multi-process mode: parent starts workers, each worker sends its results to the parent
+    void RunWorkers(PArgList & args, const char * options);
+    unsigned GetWorkerShare(unsigned total) const;
+    void SplitPortRange(unsigned & base, unsigned & max, unsigned align) const;
+    void OpenCDR(PArgList & args);
+    void CloseCDR();
+    void WriteCDR(const CDRRecord & record);
+    void WriteCDR(const PString & line);    // from a worker
+    CDRRecord::Formats cdrFormat;
+    unsigned workerIndex;
+    unsigned workerCount;
+    bool     cdrToParent;
+
   MyH323EndPoint * h323;
 
   PBoolean Start(const PString & destination, PString & token) {
@@ -311,14 +1598,24 @@ class CallGen : public PProcess
   PBoolean Clear(PString & token) {
     return h323->ClearCallSynchronous(token);
   }
+  PBoolean ClearNoWait(const PString & token) {
+    return h323->ClearCall(token);
+  }
   void ClearAll() {
     h323->ClearAllCalls();
   }
 
   protected:
     PDECLARE_NOTIFIER(PThread, CallGen, Cancel);
+    PDECLARE_NOTIFIER(PThread, CallGen, CancelWorkers);
+    PDECLARE_NOTIFIER(PTimer, CallGen, SendWorkerStats);
+    PDECLARE_NOTIFIER(PTimer, CallGen, ReportStats);
+    PTimer statsTimer;
+    PTimer workerStatsTimer;
+    WorkerProcessList workerList;
     PConsoleChannel console;
     CallThreadList threadList;
+    CallScheduler * scheduler;
 };
 
 